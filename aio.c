@@ -0,0 +1,421 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+#endif
+
+#include "aio.h"
+
+#if defined(IORING_OFF_SQ_RING) && defined(__NR_io_uring_setup)
+#define HAVE_IO_URING 1
+#endif
+
+/******************************************************************************/
+/* AioQueue -- both engines share the done list: requests that finished but
+ * haven't been reaped. An AIO_THREADS queue's workers take requests off
+ * pending; an AIO_URING queue hands them to the kernel through the rings,
+ * which are only touched by the thread using the queue
+ * inflight: submitted and not reaped yet, also only touched by that thread
+ * lock: guards pending, done and stopping                                   */
+struct AioQueue {
+  Disk *disk;
+  int backend;
+  int depth;
+  int inflight;
+
+  pthread_mutex_t lock;
+  pthread_cond_t work;         /* pending got a request, or stopping is set   */
+  pthread_cond_t finished;     /* done got a request                          */
+  AioRequest *pending, *pending_tail;
+  AioRequest *done, *done_tail;
+  pthread_t *threads;
+  int nthreads;
+  int stopping;
+
+#ifdef HAVE_IO_URING
+  int ring;
+  char *sq_ring, *cq_ring;
+  size_t sq_bytes, cq_bytes, sqe_bytes;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  unsigned *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+#endif
+};
+
+/* does the request synchronously, which is also how anything io_uring
+ * couldn't finish in one go gets finished */
+static int run(AioQueue *q, AioRequest *req)
+{
+  if (req->op == AIO_WRITE)
+    return blocks_writev(q->disk, req->block, req->iov, req->iovcnt);
+  return blocks_readv(q->disk, req->block, req->iov, req->iovcnt);
+}
+
+static void push(AioRequest **head, AioRequest **tail, AioRequest *req)
+{
+  req->next = NULL;
+  if (*tail)
+    (*tail)->next = req;
+  else
+    *head = req;
+  *tail = req;
+}
+
+static AioRequest *pop(AioRequest **head, AioRequest **tail)
+{
+  AioRequest *req = *head;
+
+  if (req && !(*head = req->next))
+    *tail = NULL;
+  return req;
+}
+
+static void finish(AioQueue *q, AioRequest *req)
+{
+  pthread_mutex_lock(&q->lock);
+  push(&q->done, &q->done_tail, req);
+  pthread_cond_signal(&q->finished);
+  pthread_mutex_unlock(&q->lock);
+}
+
+static int take_done(AioQueue *q, AioRequest **done, int max)
+{
+  int got = 0;
+
+  pthread_mutex_lock(&q->lock);
+  while (got < max && q->done)
+    done[got++] = pop(&q->done, &q->done_tail);
+  pthread_mutex_unlock(&q->lock);
+  q->inflight -= got;
+  return got;
+}
+
+/* threads -------------------------------------------------------------------*/
+static void *worker(void *arg)
+{
+  AioQueue *q = arg;
+  AioRequest *req;
+
+  pthread_mutex_lock(&q->lock);
+  while (1) {
+    while (!q->pending && !q->stopping)
+      pthread_cond_wait(&q->work, &q->lock);
+    // whatever was submitted still gets done before the queue goes away
+    if (!(req = pop(&q->pending, &q->pending_tail)))
+      break;
+    pthread_mutex_unlock(&q->lock);
+    req->result = run(q, req);
+    pthread_mutex_lock(&q->lock);
+    push(&q->done, &q->done_tail, req);
+    pthread_cond_signal(&q->finished);
+  }
+  pthread_mutex_unlock(&q->lock);
+  return NULL;
+}
+
+static int threads_setup(AioQueue *q)
+{
+  int n = q->depth < AIO_MAX_THREADS ? q->depth : AIO_MAX_THREADS;
+
+  if (!(q->threads = malloc(n * sizeof(pthread_t))))
+    return -1;
+  for (q->nthreads = 0; q->nthreads < n; q->nthreads++)
+    if (pthread_create(&q->threads[q->nthreads], NULL, worker, q) != 0)
+      break;
+  // one worker is enough to make progress
+  return q->nthreads > 0 ? 0 : -1;
+}
+
+static void threads_stop(AioQueue *q)
+{
+  pthread_mutex_lock(&q->lock);
+  q->stopping = 1;
+  pthread_cond_broadcast(&q->work);
+  pthread_mutex_unlock(&q->lock);
+  for (int i = 0; i < q->nthreads; i++)
+    pthread_join(q->threads[i], NULL);
+  free(q->threads);
+}
+
+static int threads_reap(AioQueue *q, AioRequest **done, int min, int max)
+{
+  int got = 0;
+
+  pthread_mutex_lock(&q->lock);
+  while (got < max) {
+    if (q->done)
+      done[got++] = pop(&q->done, &q->done_tail);
+    else if (got < min)
+      pthread_cond_wait(&q->finished, &q->lock);
+    else
+      break;
+  }
+  pthread_mutex_unlock(&q->lock);
+  q->inflight -= got;
+  return got;
+}
+
+/* io_uring ------------------------------------------------------------------*/
+#ifdef HAVE_IO_URING
+static void uring_free(AioQueue *q)
+{
+  if (q->sqes && q->sqes != MAP_FAILED)
+    munmap(q->sqes, q->sqe_bytes);
+  if (q->cq_ring && q->cq_ring != MAP_FAILED)
+    munmap(q->cq_ring, q->cq_bytes);
+  if (q->sq_ring && q->sq_ring != MAP_FAILED)
+    munmap(q->sq_ring, q->sq_bytes);
+  close(q->ring);
+}
+
+/* sets up the rings with plain system calls, nothing beyond the kernel
+ * headers is needed */
+static int uring_setup(AioQueue *q)
+{
+  struct io_uring_params p;
+
+  memset(&p, 0, sizeof(p));
+  if ((q->ring = syscall(__NR_io_uring_setup, q->depth, &p)) < 0)
+    return -1;
+
+  q->sq_bytes = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  q->cq_bytes = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  q->sqe_bytes = p.sq_entries * sizeof(struct io_uring_sqe);
+  q->sq_ring = mmap(NULL, q->sq_bytes, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, q->ring, IORING_OFF_SQ_RING);
+  q->cq_ring = mmap(NULL, q->cq_bytes, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, q->ring, IORING_OFF_CQ_RING);
+  q->sqes = mmap(NULL, q->sqe_bytes, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, q->ring, IORING_OFF_SQES);
+  if (q->sq_ring == MAP_FAILED || q->cq_ring == MAP_FAILED
+      || q->sqes == MAP_FAILED) {
+    uring_free(q);
+    return -1;
+  }
+
+  q->sq_tail = (unsigned *) (q->sq_ring + p.sq_off.tail);
+  q->sq_mask = (unsigned *) (q->sq_ring + p.sq_off.ring_mask);
+  q->sq_array = (unsigned *) (q->sq_ring + p.sq_off.array);
+  q->cq_head = (unsigned *) (q->cq_ring + p.cq_off.head);
+  q->cq_tail = (unsigned *) (q->cq_ring + p.cq_off.tail);
+  q->cq_mask = (unsigned *) (q->cq_ring + p.cq_off.ring_mask);
+  q->cqes = (struct io_uring_cqe *) (q->cq_ring + p.cq_off.cqes);
+
+  return 0;
+}
+
+static void uring_queue(AioQueue *q, AioRequest *req)
+{
+  unsigned tail = *q->sq_tail,
+           idx = tail & *q->sq_mask;
+  struct io_uring_sqe *sqe = &q->sqes[idx];
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = req->op == AIO_WRITE ? IORING_OP_WRITEV : IORING_OP_READV;
+  sqe->fd = q->disk->handle;
+  sqe->addr = (uintptr_t) req->iov;
+  sqe->len = req->iovcnt;
+  sqe->off = (off_t) req->block * q->disk->block_size;
+  sqe->user_data = (uintptr_t) req;
+  q->sq_array[idx] = idx;
+  __atomic_store_n(q->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static int uring_enter(AioQueue *q, int submit, int wait)
+{
+  long n;
+
+  do {
+    __atomic_add_fetch(&q->disk->syscalls, 1, __ATOMIC_RELAXED);
+    n = syscall(__NR_io_uring_enter, q->ring, submit, wait,
+        wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  } while (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY));
+
+  if (n < 0)
+    perror("aio: io_uring_enter failed");
+  return n < 0 ? -1 : 0;
+}
+
+static int uring_reap(AioQueue *q, AioRequest **done, int min, int max)
+{
+  int got = take_done(q, done, max);
+  unsigned head, tail;
+  AioRequest *req;
+
+  while (got < max) {
+    head = *q->cq_head;
+    tail = __atomic_load_n(q->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail && got < max; head++, got++) {
+      struct io_uring_cqe *cqe = &q->cqes[head & *q->cq_mask];
+      req = (AioRequest *) (uintptr_t) cqe->user_data;
+      // a short or failed transfer is redone the slow way, which reports
+      // the error if there really is one
+      if (cqe->res < 0 || (size_t) cqe->res != req->bytes)
+        req->result = run(q, req);
+      else {
+        req->result = 0;
+        __atomic_add_fetch(req->op == AIO_WRITE ? &q->disk->blocks_written
+            : &q->disk->blocks_read, req->bytes / q->disk->block_size,
+            __ATOMIC_RELAXED);
+      }
+      done[got] = req;
+      q->inflight--;
+    }
+    __atomic_store_n(q->cq_head, head, __ATOMIC_RELEASE);
+
+    if (got >= min || got >= max)
+      break;
+    if (uring_enter(q, 0, min - got) < 0)
+      break;
+  }
+  return got;
+}
+#endif
+
+/******************************************************************************/
+AioQueue *aio_open(Disk *disk, int depth, int backend)
+{
+  AioQueue *q;
+
+  if (!disk->active) {
+    fprintf(stderr, "aio_open: disk not active\n");
+    return NULL;
+  }
+  if (depth <= 0) {
+    fprintf(stderr, "aio_open: invalid queue depth\n");
+    return NULL;
+  }
+
+  if (!(q = calloc(1, sizeof(AioQueue)))) {
+    fprintf(stderr, "aio_open: out of memory\n");
+    return NULL;
+  }
+  q->disk = disk;
+  q->depth = depth;
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->work, NULL);
+  pthread_cond_init(&q->finished, NULL);
+
+#ifdef HAVE_IO_URING
+  if (backend != AIO_THREADS && uring_setup(q) == 0) {
+    q->backend = AIO_URING;
+    return q;
+  }
+#endif
+  if (backend == AIO_URING) {
+    fprintf(stderr, "aio_open: io_uring is not available\n");
+  } else if (threads_setup(q) == 0) {
+    q->backend = AIO_THREADS;
+    return q;
+  } else {
+    fprintf(stderr, "aio_open: cannot start worker threads\n");
+    threads_stop(q);
+  }
+
+  pthread_mutex_destroy(&q->lock);
+  pthread_cond_destroy(&q->work);
+  pthread_cond_destroy(&q->finished);
+  free(q);
+  return NULL;
+}
+
+int aio_backend(AioQueue *q)
+{
+  return q->backend;
+}
+
+int aio_submit(AioQueue *q, AioRequest **reqs, int n)
+{
+  AioRequest *req;
+  int i, queued = 0;
+
+  for (i = 0; i < n && q->inflight < q->depth; i++) {
+    req = reqs[i];
+    req->result = 0;
+    req->bytes = 0;
+    for (int j = 0; j < req->iovcnt; j++)
+      req->bytes += req->iov[j].iov_len;
+    q->inflight++;
+
+    // nothing to wait for on a mapping, and bad requests fail right away
+    if (q->disk->map || (req->block < 0) || (req->bytes % q->disk->block_size)
+        || (req->bytes / q->disk->block_size
+          > (size_t) (q->disk->blocks - req->block))) {
+      req->result = run(q, req);
+      finish(q, req);
+      continue;
+    }
+
+#ifdef HAVE_IO_URING
+    if (q->backend == AIO_URING) {
+      uring_queue(q, req);
+      queued++;
+      continue;
+    }
+#endif
+    pthread_mutex_lock(&q->lock);
+    push(&q->pending, &q->pending_tail, req);
+    pthread_cond_signal(&q->work);
+    pthread_mutex_unlock(&q->lock);
+  }
+
+#ifdef HAVE_IO_URING
+  if (queued > 0 && uring_enter(q, queued, 0) < 0)
+    return -1;
+#endif
+  return i;
+}
+
+int aio_reap(AioQueue *q, AioRequest **done, int min, int max)
+{
+  // there is no waiting for requests that were never submitted
+  if (min > q->inflight)
+    min = q->inflight;
+
+#ifdef HAVE_IO_URING
+  if (q->backend == AIO_URING)
+    return uring_reap(q, done, min, max);
+#endif
+  return threads_reap(q, done, min, max);
+}
+
+int aio_inflight(AioQueue *q)
+{
+  return q->inflight;
+}
+
+void aio_close(AioQueue *q)
+{
+  AioRequest *done[64];
+
+  if (!q)
+    return;
+
+#ifdef HAVE_IO_URING
+  if (q->backend == AIO_URING) {
+    while (q->inflight > 0)
+      if (aio_reap(q, done, 1, 64) <= 0)
+        break;
+    uring_free(q);
+  }
+#endif
+  if (q->backend == AIO_THREADS)
+    threads_stop(q);
+
+  pthread_mutex_destroy(&q->lock);
+  pthread_cond_destroy(&q->work);
+  pthread_cond_destroy(&q->finished);
+  free(q);
+}
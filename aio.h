@@ -0,0 +1,53 @@
+#ifndef _AIO_H_
+#define _AIO_H_
+
+#include <sys/uio.h>
+
+#include "disk.h"
+
+/******************************************************************************/
+#define AIO_READ     0
+#define AIO_WRITE    1
+
+/* which engine aio_open sets up                                              */
+#define AIO_ANY      0         /* io_uring if the kernel has it, else threads */
+#define AIO_URING    1         /* io_uring only                               */
+#define AIO_THREADS  2         /* worker threads making blocks_readv/writev
+                                  calls, works everywhere                     */
+
+#define AIO_MAX_THREADS 16     /* most workers an AIO_THREADS queue starts    */
+
+/* AioRequest -- one transfer of consecutive blocks, like blocks_readv or
+ * blocks_writev. The request and its buffers belong to the queue from
+ * aio_submit until aio_reap hands them back                                  */
+typedef struct AioRequest {
+  int op;                      /* AIO_READ or AIO_WRITE                       */
+  int block;                   /* first block                                 */
+  const struct iovec *iov;     /* buffers adding up to whole blocks           */
+  int iovcnt;
+  int result;                  /* 0, or -1 if the transfer failed             */
+  void *data;                  /* the caller's, left alone                    */
+  size_t bytes;                /* private to the queue                        */
+  struct AioRequest *next;
+} AioRequest;
+
+/* AioQueue -- requests in flight on one open disk. A queue is used by one
+ * thread at a time; the disk must stay open until aio_close                  */
+typedef struct AioQueue AioQueue;
+
+/******************************************************************************/
+AioQueue *aio_open(Disk *disk, int depth, int backend);
+                               /* queue of up to depth requests in flight     */
+int aio_backend(AioQueue *q);  /* AIO_URING or AIO_THREADS                    */
+int aio_submit(AioQueue *q, AioRequest **reqs, int n);
+                               /* start the first n requests, fewer if the
+                                  queue fills up; returns how many started    */
+int aio_reap(AioQueue *q, AioRequest **done, int min, int max);
+                               /* hand back up to max finished requests,
+                                  waiting for at least min of them; min 0
+                                  only polls. Returns how many                */
+int aio_inflight(AioQueue *q); /* submitted and not reaped yet                */
+void aio_close(AioQueue *q);   /* wait for everything in flight and free q    */
+/******************************************************************************/
+
+#endif
@@ -0,0 +1,245 @@
+/* bench_aio -- random block reads and writes through the synchronous calls
+ * and through the asynchronous ones at queue depths 1, 8 and 32: on a raw
+ * disk with block_read/block_write against an AioQueue (io_uring and worker
+ * threads), and on a file with fs_lseek + fs_read/fs_write against
+ * fs_submit. Last, a sequential read of a fragmented file, whose chain goes
+ * out as many reads in flight at once
+ *   $ gcc -O2 -pthread -I. bench/bench_aio.c filesystem.c disk.c cache.c \
+ *         aio.c lz.c crc32c.c -o bench_aio
+ *   $ ./bench_aio /tmp/bench [file MiB] [ops]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "filesystem.h"
+#include "aio.h"
+
+#define MAX_DEPTH 32
+
+static int depths[] = { 1, 8, 32 };
+static int ops;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char * level, const char * engine, int depth,
+        const char * op, int bs, double elapsed)
+{
+    char d[12] = "-";
+
+    if (depth > 0)
+        snprintf(d, sizeof(d), "%d", depth);
+    printf("%-5s %-8s %5s %-6s %12.0f %10.1f\n", level, engine, d, op,
+            ops / elapsed, (double) ops * bs / elapsed / 1e6);
+}
+
+/* keeps depth requests in flight until ops of them have completed */
+static int run_aio(Disk * disk, int backend, int depth, int op, char * bufs)
+{
+    AioRequest reqs[MAX_DEPTH], * ptrs[MAX_DEPTH];
+    struct iovec iov[MAX_DEPTH];
+    AioQueue * q = aio_open(disk, depth, backend);
+    int issued = 0, done = 0, n;
+
+    if (q == NULL)
+        return -1;
+    for (int i = 0; i < depth; i++)
+    {
+        iov[i].iov_base = bufs + (long) i * disk->block_size;
+        iov[i].iov_len = disk->block_size;
+        reqs[i].op = op;
+        reqs[i].iov = &iov[i];
+        reqs[i].iovcnt = 1;
+        ptrs[i] = &reqs[i];
+    }
+
+    for (n = 0; n < depth && issued < ops; n++, issued++)
+        reqs[n].block = rand() % disk->blocks;
+    while (done < ops)
+    {
+        if (aio_submit(q, ptrs, n) != n)
+            return -1;
+        done += n = aio_reap(q, ptrs, 1, depth);
+        for (int i = 0; i < n; i++)
+            if (ptrs[i]->result < 0)
+                return -1;
+        // what came back goes out again as the next requests
+        if (n > ops - issued)
+            n = ops - issued;
+        for (int i = 0; i < n; i++, issued++)
+            ptrs[i]->block = rand() % disk->blocks;
+    }
+    aio_close(q);
+    return 0;
+}
+
+static int bench_disk(char * name)
+{
+    Disk disk = { 0 };
+    char * bufs = malloc(MAX_DEPTH * DEFAULT_BLOCK_SIZE);
+    int backends[] = { AIO_URING, AIO_THREADS };
+    const char * engines[] = { "io_uring", "threads" };
+    double start;
+
+    if (bufs == NULL || make_disk_geometry(name, 32768, DEFAULT_BLOCK_SIZE) < 0
+            || open_disk(&disk, name) < 0
+            || set_disk_geometry(&disk, 32768, DEFAULT_BLOCK_SIZE) < 0)
+        return -1;
+    memset(bufs, 'x', MAX_DEPTH * DEFAULT_BLOCK_SIZE);
+
+    for (int op = AIO_READ; op <= AIO_WRITE; op++)
+    {
+        const char * label = op == AIO_READ ? "read" : "write";
+
+        srand(1);
+        start = now();
+        for (int i = 0; i < ops; i++)
+            if ((op == AIO_READ ? block_read : block_write)(&disk,
+                        rand() % disk.blocks, bufs) < 0)
+                return -1;
+        report("disk", "sync", 0, label, disk.block_size, now() - start);
+
+        for (int b = 0; b < 2; b++)
+            for (int d = 0; d < 3; d++)
+            {
+                srand(1);
+                start = now();
+                if (run_aio(&disk, backends[b], depths[d], op, bufs) < 0)
+                {
+                    printf("%-5s %-8s %5d %-6s %12s\n", "disk", engines[b],
+                            depths[d], label, "n/a");
+                    continue;
+                }
+                report("disk", engines[b], depths[d], label,
+                        disk.block_size, now() - start);
+            }
+    }
+
+    free(bufs);
+    return close_disk(&disk);
+}
+
+static int run_submit(fs_t * fs, int fd, int depth, int write, int size,
+        char * bufs)
+{
+    fs_io_t ios[MAX_DEPTH], * ptrs[MAX_DEPTH];
+    int bs = fs_block_size(fs), issued = 0, done = 0, n;
+
+    for (int i = 0; i < depth; i++)
+    {
+        ios[i].fildes = fd;
+        ios[i].write = write;
+        ios[i].buf = bufs + (long) i * bs;
+        ios[i].nbyte = bs;
+        ptrs[i] = &ios[i];
+    }
+
+    for (n = 0; n < depth && issued < ops; n++, issued++)
+        ios[n].offset = (off_t) (rand() % (size / bs)) * bs;
+    while (done < ops)
+    {
+        if (fs_submit(fs, ptrs, n) != n)
+            return -1;
+        done += n = fs_reap(fs, ptrs, 1, depth);
+        for (int i = 0; i < n; i++)
+            if (ptrs[i]->result != bs)
+                return -1;
+        if (n > ops - issued)
+            n = ops - issued;
+        for (int i = 0; i < n; i++, issued++)
+            ptrs[i]->offset = (off_t) (rand() % (size / bs)) * bs;
+    }
+    return 0;
+}
+
+static int bench_fs(char * name, int size)
+{
+    char * bufs = malloc(MAX_DEPTH * DEFAULT_BLOCK_SIZE), * big = malloc(size);
+    int fd, other, bs = DEFAULT_BLOCK_SIZE;
+    double start;
+    fs_t * fs;
+
+    if (bufs == NULL || big == NULL
+            || make_fs_geometry(name, 3 * (size / bs) + 1024, bs) < 0
+            || (fs = fs_mount(name)) == NULL)
+        return -1;
+    memset(bufs, 'x', MAX_DEPTH * bs);
+    memset(big, 'y', size);
+
+    // two files written a block at a time in turn, so each chain is
+    // fragmented into single blocks
+    fs_set_alloc_mode(fs, ALLOC_FIRST_FIT);
+    if (fs_create(fs, "data") < 0 || fs_create(fs, "other") < 0
+            || (fd = fs_open(fs, "data")) < 0
+            || (other = fs_open(fs, "other")) < 0)
+        return -1;
+    for (int off = 0; off < size; off += bs)
+        if (fs_write(fs, fd, big + off, bs) != bs
+                || fs_write(fs, other, big + off, bs) != bs)
+            return -1;
+    fs_close(fs, other);
+    fs_set_block_index(fs, fd, 1);
+
+    for (int write = 0; write <= 1; write++)
+    {
+        const char * label = write ? "write" : "read";
+
+        srand(1);
+        start = now();
+        for (int i = 0; i < ops; i++)
+        {
+            fs_lseek(fs, fd, (off_t) (rand() % (size / bs)) * bs);
+            if ((write ? fs_write : fs_read)(fs, fd, bufs, bs) != bs)
+                return -1;
+        }
+        report("fs", "sync", 0, label, bs, now() - start);
+
+        for (int d = 0; d < 3; d++)
+        {
+            srand(1);
+            start = now();
+            if (run_submit(fs, fd, depths[d], write, size, bufs) < 0)
+                return -1;
+            report("fs", "submit", depths[d], label, bs, now() - start);
+        }
+    }
+
+    // the whole fragmented file in one call, after a remount so nothing
+    // of it is cached
+    fs_close(fs, fd);
+    if (fs_umount(fs) < 0 || (fs = fs_mount(name)) == NULL
+            || (fd = fs_open(fs, "data")) < 0)
+        return -1;
+    start = now();
+    if (fs_read(fs, fd, big, size) != size)
+        return -1;
+    printf("%-5s %-8s %5s %-6s %12s %10.1f\n", "fs", "chain", "-", "seq",
+            "-", size / (now() - start) / 1e6);
+
+    free(bufs);
+    free(big);
+    return fs_umount(fs);
+}
+
+int main(int argc, char ** argv)
+{
+    char * prefix = argc > 1 ? argv[1] : "bench_aio";
+    int size = (argc > 2 ? atoi(argv[2]) : 64) << 20;
+    char name[256];
+
+    ops = argc > 3 ? atoi(argv[3]) : 50000;
+
+    printf("%-5s %-8s %5s %-6s %12s %10s\n",
+            "level", "engine", "depth", "op", "op/s", "MB/s");
+    snprintf(name, sizeof(name), "%s.raw", prefix);
+    if (bench_disk(name) < 0)
+        return 1;
+    snprintf(name, sizeof(name), "%s.disk", prefix);
+    return bench_fs(name, size) < 0;
+}
@@ -0,0 +1,70 @@
+/* bench_append -- four log files growing side by side by small records of
+ * 64 bytes up to 4 KiB, appended to each in turn, the way several writers
+ * keep logs. Reports appends/s and MB/s for each record size, plus how many
+ * extents the first log ended up in
+ *   $ gcc -O2 -pthread -I. bench/bench_append.c filesystem.c disk.c cache.c \
+ *         aio.c lz.c crc32c.c -o bench_append
+ *   $ ./bench_append /tmp/bench.disk [MiB per log]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "filesystem.h"
+
+#define LOGS 4
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int run(char * diskname, int size, int record)
+{
+    int bs = DEFAULT_BLOCK_SIZE, fd[LOGS], appends = size / record;
+    char name[16], buf[4096];
+    double start, elapsed;
+    fs_t * fs;
+
+    if (make_fs_geometry(diskname, LOGS * 2 * (size / bs) + 1024, bs) < 0
+            || (fs = fs_mount(diskname)) == NULL)
+        return -1;
+    for (int i = 0; i < LOGS; i++)
+    {
+        snprintf(name, sizeof(name), "log%d", i);
+        if (fs_create(fs, name) < 0 || (fd[i] = fs_open(fs, name)) < 0)
+            return -1;
+    }
+    memset(buf, 'l', record);
+
+    start = now();
+    for (int n = 0; n < appends; n++)
+        for (int i = 0; i < LOGS; i++)
+            if (fs_write(fs, fd[i], buf, record) != record)
+                return -1;
+    for (int i = 0; i < LOGS; i++)
+        if (fs_fsync(fs, fd[i]) < 0)
+            return -1;
+    elapsed = now() - start;
+
+    printf("%8d %12.0f %10.1f %8d\n", record,
+            LOGS * appends / elapsed,
+            (double) LOGS * appends * record / elapsed / 1e6,
+            get_extent_count(fs, fd[0]));
+    return fs_umount(fs);
+}
+
+int main(int argc, char ** argv)
+{
+    char * diskname = argc > 1 ? argv[1] : "bench_append.disk";
+    int size = (argc > 2 ? atoi(argv[2]) : 8) << 20;
+
+    printf("%8s %12s %10s %8s\n", "record", "appends/s", "MB/s", "extents");
+    for (int record = 64; record <= 4096; record *= 4)
+        if (run(diskname, size, record) < 0)
+            return 1;
+    return 0;
+}
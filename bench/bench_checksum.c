@@ -0,0 +1,116 @@
+/* bench_checksum -- what checking every block costs. Writes a file and
+ * reads it back after a remount with checksums off (fs_set_checksums 0),
+ * on, and on with the scrubber going through the rest of the image at
+ * SCRUB_RATE blocks a second. Reports MB/s both ways, and the blocks the
+ * scrubber got through meanwhile
+ *   $ gcc -O2 -pthread -I. bench/bench_checksum.c filesystem.c disk.c \
+ *         cache.c aio.c lz.c crc32c.c -o bench_checksum
+ *   $ ./bench_checksum /tmp/bench.disk [MiB]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "filesystem.h"
+
+#define ROUNDS 5
+#define SCRUB_RATE 20000
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* pass -- "file" written with checksums on or off, then read back on a
+ * fresh mount, scrubbing "other" if asked. Adds the times taken to w and r */
+static int pass(char * diskname, char * buf, int size, int sums, int scrub,
+        double * w, double * r, uint64_t * scrubbed)
+{
+    int fd;
+    double start;
+    fs_stats_t st;
+    fs_t * fs;
+
+    if (make_fs_geometry(diskname, 2 * size / DEFAULT_BLOCK_SIZE + 4096,
+                DEFAULT_BLOCK_SIZE) < 0 || (fs = fs_mount(diskname)) == NULL
+            || fs_set_checksums(fs, sums) < 0
+            || fs_create(fs, "file") < 0 || fs_create(fs, "other") < 0)
+        return -1;
+    start = now();
+    if ((fd = fs_open(fs, "file")) < 0)
+        return -1;
+    for (int off = 0; off < size; off += 1 << 20)
+        if (fs_write(fs, fd, buf, 1 << 20) != 1 << 20)
+            return -1;
+    if (fs_close(fs, fd) < 0 || fs_sync(fs) < 0)
+        return -1;
+    *w += now() - start;
+    if ((fd = fs_open(fs, "other")) < 0)
+        return -1;
+    for (int off = 0; off < size; off += 1 << 20)
+        if (fs_write(fs, fd, buf, 1 << 20) != 1 << 20)
+            return -1;
+    fs_close(fs, fd);
+
+    if (fs_umount(fs) < 0 || (fs = fs_mount(diskname)) == NULL
+            || fs_set_checksums(fs, sums) < 0
+            || (scrub && fs_scrub(fs, SCRUB_RATE) < 0)
+            || (fd = fs_open(fs, "file")) < 0)
+        return -1;
+    start = now();
+    for (int off = 0; off < size; off += 1 << 20)
+        if (fs_read(fs, fd, buf, 1 << 20) != 1 << 20)
+            return -1;
+    *r += now() - start;
+    fs_stats(fs, &st);
+    *scrubbed += st.scrub_blocks;
+    if (st.checksum_errors != 0)
+    {
+        printf("bench_checksum: %llu blocks failed their checksums\n",
+                (unsigned long long) st.checksum_errors);
+        return -1;
+    }
+    fs_close(fs, fd);
+    return fs_umount(fs);
+}
+
+int main(int argc, char ** argv)
+{
+    char * diskname = argc > 1 ? argv[1] : "bench_checksum.disk";
+    int size = (argc > 2 ? atoi(argv[2]) : 256) << 20;
+    char * buf = malloc(1 << 20);
+    char * names[] = { "off", "on", "on+scrub" };
+
+    if (buf == NULL)
+        return 1;
+    for (int i = 0; i < 1 << 20; i++)
+        buf[i] = rand();
+    printf("%d MiB file, best of %d\n", size >> 20, ROUNDS);
+    printf("%10s %12s %12s %10s\n", "checksums", "write MB/s", "read MB/s",
+            "scrubbed");
+    for (int mode = 0; mode < 3; mode++)
+    {
+        double w = 0, r = 0, best_w = 0, best_r = 0;
+        uint64_t scrubbed = 0;
+
+        for (int i = 0; i < ROUNDS; i++)
+        {
+            w = r = 0;
+            if (pass(diskname, buf, size, mode > 0, mode == 2, &w, &r,
+                        &scrubbed) < 0)
+                return 1;
+            if (best_w == 0 || w < best_w)
+                best_w = w;
+            if (best_r == 0 || r < best_r)
+                best_r = r;
+        }
+        printf("%10s %12.0f %12.0f %10llu\n", names[mode],
+                size / best_w / (1 << 20), size / best_r / (1 << 20),
+                (unsigned long long) scrubbed / ROUNDS);
+    }
+    free(buf);
+    return 0;
+}
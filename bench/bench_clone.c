@@ -0,0 +1,127 @@
+/* bench_clone -- what sharing blocks saves and what it costs. Times
+ * fs_clone of a file against copying it with fs_read and fs_write,
+ * fs_snapshot of a tree of files, then a one block write into the first,
+ * middle and last block of a file that shares its blocks and of one that
+ * doesn't. The first write into a shared block copies it, and the blocks
+ * before it
+ *   $ gcc -O2 -pthread -I. bench/bench_clone.c filesystem.c disk.c cache.c \
+ *         aio.c lz.c crc32c.c -o bench_clone
+ *   $ ./bench_clone /tmp/bench.disk [MiB per file]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "filesystem.h"
+
+#define FILES 32
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int fill(fs_t * fs, char * name, char * buf, int size)
+{
+    int fd;
+
+    if (fs_create(fs, name) < 0 || (fd = fs_open(fs, name)) < 0
+            || fs_write(fs, fd, buf, size) != size)
+        return -1;
+    return fs_close(fs, fd);
+}
+
+static int copy(fs_t * fs, char * src, char * dst, char * buf, int size)
+{
+    int in, out;
+
+    if (fs_create(fs, dst) < 0 || (in = fs_open(fs, src)) < 0
+            || (out = fs_open(fs, dst)) < 0
+            || fs_read(fs, in, buf, size) != size
+            || fs_write(fs, out, buf, size) != size)
+        return -1;
+    fs_close(fs, in);
+    return fs_close(fs, out);
+}
+
+/* poke -- µs a one block write at 'offset' into a fresh clone of "src"
+ * takes, or into a fresh copy of it if 'shared' is 0 */
+static double poke(fs_t * fs, char * buf, int size, off_t offset, int shared)
+{
+    static int n;
+    char name[16];
+    double start;
+    int fd, bs = fs_block_size(fs);
+
+    snprintf(name, sizeof(name), "poke%d", n++);
+    if ((shared ? fs_clone(fs, "src", name) : copy(fs, "src", name, buf,
+                    size)) < 0 || fs_sync(fs) < 0
+            || (fd = fs_open(fs, name)) < 0)
+        return -1;
+    start = now();
+    if (fs_lseek(fs, fd, offset) < 0 || fs_write(fs, fd, buf, bs) != bs
+            || fs_fsync(fs, fd) < 0)
+        return -1;
+    start = now() - start;
+    fs_close(fs, fd);
+    fs_delete(fs, name);
+    return start * 1e6;
+}
+
+int main(int argc, char ** argv)
+{
+    char * diskname = argc > 1 ? argv[1] : "bench_clone.disk";
+    int size = (argc > 2 ? atoi(argv[2]) : 8) << 20,
+        bs = DEFAULT_BLOCK_SIZE;
+    off_t at[3] = { 0, size / 2, size - bs };
+    char name[16], * buf;
+    double start, t;
+    fs_t * fs;
+
+    if (make_fs_geometry(diskname, (FILES + 4) * (size / bs) + 4096, bs) < 0
+            || (fs = fs_mount(diskname)) == NULL
+            || (buf = malloc(size)) == NULL)
+        return 1;
+    memset(buf, 'c', size);
+    if (fill(fs, "src", buf, size) < 0)
+        return 1;
+
+    start = now();
+    if (copy(fs, "src", "copy", buf, size) < 0 || fs_sync(fs) < 0)
+        return 1;
+    t = now() - start;
+    start = now();
+    if (fs_clone(fs, "src", "clone") < 0 || fs_sync(fs) < 0)
+        return 1;
+    printf("%d MiB file: copy %.3f ms, clone %.3f ms\n", size >> 20,
+            t * 1e3, (now() - start) * 1e3);
+
+    fs_delete(fs, "copy");
+    fs_delete(fs, "clone");
+    if (fs_mkdir(fs, "/tree") < 0)
+        return 1;
+    for (int i = 0; i < FILES; i++)
+    {
+        snprintf(name, sizeof(name), "/tree/f%d", i);
+        if (fill(fs, name, buf, size / FILES) < 0)
+            return 1;
+    }
+    start = now();
+    if (fs_snapshot(fs, "/snap") < 0 || fs_sync(fs) < 0)
+        return 1;
+    printf("snapshot of %d files: %.3f ms\n", FILES,
+            (now() - start) * 1e3);
+    if (fs_rmdir(fs, "/snap") < 0)
+        return 1;
+
+    printf("%10s %12s %12s\n", "write at", "private µs", "shared µs");
+    for (int i = 0; i < 3; i++)
+        printf("%10ld %12.0f %12.0f\n", (long) at[i],
+                poke(fs, buf, size, at[i], 0), poke(fs, buf, size, at[i], 1));
+
+    free(buf);
+    return fs_umount(fs) < 0;
+}
@@ -0,0 +1,101 @@
+/* bench_disk -- compares the two disk backends: per-block read/write calls
+ * through the block cache (DISK_FILE) against an mmap'd image (DISK_MMAP).
+ * Times make_fs, mount, a sequential write, sequential and random reads
+ * after a remount, and unmount, for each mode in turn
+ *   $ gcc -O2 -pthread -I. bench/bench_disk.c filesystem.c disk.c cache.c \
+ *         aio.c lz.c crc32c.c -o bench_disk
+ *   $ ./bench_disk /tmp/bench.disk [file size in MiB] [random reads]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "filesystem.h"
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char * mode, const char * what, double bytes,
+        double elapsed)
+{
+    if (bytes > 0)
+        printf("%-5s %-12s %8.4f s (%.1f MB/s)\n",
+                mode, what, elapsed, bytes / elapsed / 1e6);
+    else
+        printf("%-5s %-12s %8.4f s\n", mode, what, elapsed);
+}
+
+static int run(char * diskname, int mode, int size, int reads)
+{
+    const char * label = mode == DISK_MMAP ? "mmap" : "file";
+    char * buf = malloc(size);
+    double start;
+    int fd, bs;
+    fs_t * fs;
+
+    if (buf == NULL)
+        return -1;
+    memset(buf, 'x', size);
+
+    start = now();
+    if (make_fs(diskname) < 0)
+        return -1;
+    report(label, "make_fs", 0, now() - start);
+
+    start = now();
+    if ((fs = fs_mount_mode(diskname, mode)) == NULL)
+        return -1;
+    report(label, "mount", 0, now() - start);
+
+    if (fs_create(fs, "data") < 0 || (fd = fs_open(fs, "data")) < 0)
+        return -1;
+    start = now();
+    if (fs_write(fs, fd, buf, size) != size)
+        return -1;
+    fs_close(fs, fd);
+    report(label, "seq write", size, now() - start);
+
+    start = now();
+    if (fs_umount(fs) < 0)
+        return -1;
+    report(label, "umount", 0, now() - start);
+
+    if ((fs = fs_mount_mode(diskname, mode)) == NULL
+            || (fd = fs_open(fs, "data")) < 0)
+        return -1;
+    bs = fs_block_size(fs);
+    start = now();
+    if (fs_read(fs, fd, buf, size) != size)
+        return -1;
+    report(label, "seq read", size, now() - start);
+
+    srand(1);
+    start = now();
+    for (int i = 0; i < reads; i++)
+    {
+        fs_lseek(fs, fd, rand() % (size / bs) * bs);
+        if (fs_read(fs, fd, buf, bs) != bs)
+            return -1;
+    }
+    report(label, "random read", (double) reads * bs, now() - start);
+
+    fs_close(fs, fd);
+    free(buf);
+    return fs_umount(fs);
+}
+
+int main(int argc, char ** argv)
+{
+    char * diskname = argc > 1 ? argv[1] : "bench_disk.disk";
+    int size = (argc > 2 ? atoi(argv[2]) : 16) << 20;
+    int reads = argc > 3 ? atoi(argv[3]) : 20000;
+
+    if (run(diskname, DISK_FILE, size, reads) < 0)
+        return 1;
+    return run(diskname, DISK_MMAP, size, reads) < 0;
+}
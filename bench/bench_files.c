@@ -0,0 +1,83 @@
+/* bench_files -- metadata stress: creates, opens, closes and deletes tens of
+ * thousands of files in rounds, keeping a whole round open at once
+ *   $ gcc -O2 -pthread -I. bench/bench_files.c filesystem.c disk.c cache.c \
+ *         aio.c lz.c crc32c.c -o bench_files
+ *   $ ./bench_files /tmp/bench.disk [files per round] [rounds]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "filesystem.h"
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char * what, int ops, double elapsed)
+{
+    printf("%-8s %8d ops in %.3f s (%.0f ops/s)\n", 
+            what, ops, elapsed, ops / elapsed);
+}
+
+int main(int argc, char ** argv)
+{
+    char * diskname = argc > 1 ? argv[1] : "bench_files.disk";
+    int files = argc > 2 ? atoi(argv[2]) : 5000;
+    int rounds = argc > 3 ? atoi(argv[3]) : 4;
+    double t_create = 0, t_open = 0, t_close = 0, t_delete = 0, start;
+    int * fd = malloc(files * sizeof(int));
+    char name[32];
+    fs_t * fs;
+
+    if (fd == NULL || make_fs(diskname) < 0
+            || (fs = fs_mount(diskname)) == NULL)
+        return 1;
+
+    for (int r = 0; r < rounds; r++)
+    {
+        start = now();
+        for (int i = 0; i < files; i++)
+        {
+            snprintf(name, sizeof(name), "r%d_f%d", r, i);
+            if (fs_create(fs, name) < 0)
+                return 1;
+        }
+        t_create += now() - start;
+
+        start = now();
+        for (int i = 0; i < files; i++)
+        {
+            snprintf(name, sizeof(name), "r%d_f%d", r, i);
+            if ((fd[i] = fs_open(fs, name)) < 0)
+                return 1;
+        }
+        t_open += now() - start;
+
+        start = now();
+        for (int i = 0; i < files; i++)
+            fs_close(fs, fd[i]);
+        t_close += now() - start;
+
+        // delete in a different order than creation
+        start = now();
+        for (int i = files - 1; i >= 0; i--)
+        {
+            snprintf(name, sizeof(name), "r%d_f%d", r, i);
+            if (fs_delete(fs, name) < 0)
+                return 1;
+        }
+        t_delete += now() - start;
+    }
+
+    report("create", files * rounds, t_create);
+    report("open", files * rounds, t_open);
+    report("close", files * rounds, t_close);
+    report("delete", files * rounds, t_delete);
+
+    free(fd);
+    return fs_umount(fs) < 0;
+}
@@ -0,0 +1,74 @@
+/* bench_fsync -- 1, 2, 4, 8 and 16 threads each appending 512 byte records
+ * to a file of their own and calling fs_fsync after every one, the way a
+ * database logs its transactions. Reports fsyncs/s over all threads; calls
+ * that come in together share a commit
+ *   $ gcc -O2 -pthread -I. bench/bench_fsync.c filesystem.c disk.c cache.c \
+ *         aio.c lz.c crc32c.c -o bench_fsync
+ *   $ ./bench_fsync /tmp/bench.disk [fsyncs per thread]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "filesystem.h"
+
+#define MAX_THREADS 16
+#define RECORD 512
+
+static fs_t * fs;
+static int fsyncs;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void * logger(void * arg)
+{
+    char name[16], buf[RECORD];
+    int fd;
+
+    snprintf(name, sizeof(name), "log%ld", (long) arg);
+    memset(buf, 'r', RECORD);
+    if (fs_create(fs, name) < 0 || (fd = fs_open(fs, name)) < 0)
+        return (void *) 1;
+    for (int i = 0; i < fsyncs; i++)
+        if (fs_write(fs, fd, buf, RECORD) != RECORD || fs_fsync(fs, fd) < 0)
+            return (void *) 1;
+    fs_close(fs, fd);
+    return NULL;
+}
+
+int main(int argc, char ** argv)
+{
+    char * diskname = argc > 1 ? argv[1] : "bench_fsync.disk";
+    pthread_t threads[MAX_THREADS];
+    void * failed;
+    double start;
+
+    fsyncs = argc > 2 ? atoi(argv[2]) : 200;
+
+    printf("%8s %12s\n", "threads", "fsyncs/s");
+    for (int n = 1; n <= MAX_THREADS; n *= 2)
+    {
+        if (make_fs(diskname) < 0 || (fs = fs_mount(diskname)) == NULL)
+            return 1;
+        start = now();
+        for (long i = 0; i < n; i++)
+            pthread_create(&threads[i], NULL, logger, (void *) i);
+        for (int i = 0; i < n; i++)
+        {
+            pthread_join(threads[i], &failed);
+            if (failed)
+                return 1;
+        }
+        printf("%8d %12.0f\n", n, n * fsyncs / (now() - start));
+        if (fs_umount(fs) < 0)
+            return 1;
+    }
+    return 0;
+}
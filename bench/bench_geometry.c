@@ -0,0 +1,84 @@
+/* bench_geometry -- sweeps the block size from MIN_BLOCK_SIZE to
+ * MAX_BLOCK_SIZE on an image of fixed size, and for each one times a
+ * sequential write, a sequential read after a remount, and random reads of
+ * one block each
+ *   $ gcc -O2 -pthread -I. bench/bench_geometry.c filesystem.c disk.c \
+ *         cache.c aio.c lz.c crc32c.c -o bench_geometry
+ *   $ ./bench_geometry /tmp/bench.disk [image MiB] [file MiB] [random reads]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "filesystem.h"
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char ** argv)
+{
+    char * diskname = argc > 1 ? argv[1] : "bench_geometry.disk";
+    long image = (argc > 2 ? atol(argv[2]) : 256) << 20;
+    int size = (argc > 3 ? atoi(argv[3]) : 64) << 20;
+    int reads = argc > 4 ? atoi(argv[4]) : 20000;
+    char * buf = malloc(size);
+    double start, t_write, t_read, t_random;
+    int fd;
+    fs_t * fs;
+
+    if (buf == NULL)
+        return 1;
+    memset(buf, 'x', size);
+
+    printf("%10s %10s %12s %12s %12s\n",
+            "block", "blocks", "write MB/s", "read MB/s", "random op/s");
+    for (int bs = MIN_BLOCK_SIZE; bs <= MAX_BLOCK_SIZE; bs *= 2)
+    {
+        int blocks = image / bs;
+
+        if (make_fs_geometry(diskname, blocks, bs) < 0
+                || (fs = fs_mount(diskname)) == NULL)
+            return 1;
+        if (fs_create(fs, "data") < 0 || (fd = fs_open(fs, "data")) < 0)
+            return 1;
+        start = now();
+        if (fs_write(fs, fd, buf, size) != size)
+            return 1;
+        fs_close(fs, fd);
+        if (fs_umount(fs) < 0)
+            return 1;
+        t_write = now() - start;
+
+        if ((fs = fs_mount(diskname)) == NULL
+                || (fd = fs_open(fs, "data")) < 0)
+            return 1;
+        start = now();
+        if (fs_read(fs, fd, buf, size) != size)
+            return 1;
+        t_read = now() - start;
+
+        srand(1);
+        start = now();
+        for (int i = 0; i < reads; i++)
+        {
+            fs_lseek(fs, fd, rand() % (size / bs) * bs);
+            if (fs_read(fs, fd, buf, bs) != bs)
+                return 1;
+        }
+        t_random = now() - start;
+        fs_close(fs, fd);
+        if (fs_umount(fs) < 0)
+            return 1;
+
+        printf("%10d %10d %12.1f %12.1f %12.0f\n", bs, blocks,
+                size / t_write / 1e6, size / t_read / 1e6, reads / t_random);
+    }
+
+    free(buf);
+    return 0;
+}
@@ -0,0 +1,128 @@
+/* bench_mounts -- serves many small images from one process: makes them,
+ * mounts them all at once, writes a file to each in round-robin order,
+ * remounts and reads every file back. Reports the time for each step and
+ * how much the process grew per mounted image
+ *   $ gcc -O2 -pthread -I. bench/bench_mounts.c filesystem.c disk.c cache.c \
+ *         aio.c lz.c crc32c.c -o bench_mounts
+ *   $ ./bench_mounts /tmp/bench [images] [image KiB] [file KiB]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "filesystem.h"
+
+#define CHUNK 4096
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long max_rss_kib()
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss;
+}
+
+static int mount_all(fs_t ** fs, char (*names)[256], int images)
+{
+    for (int i = 0; i < images; i++)
+        if ((fs[i] = fs_mount(names[i])) == NULL)
+            return -1;
+    return 0;
+}
+
+static int umount_all(fs_t ** fs, int images)
+{
+    for (int i = 0; i < images; i++)
+        if (fs_umount(fs[i]) < 0)
+            return -1;
+    return 0;
+}
+
+int main(int argc, char ** argv)
+{
+    char * prefix = argc > 1 ? argv[1] : "bench_mounts";
+    int images = argc > 2 ? atoi(argv[2]) : 256;
+    int blocks = (argc > 3 ? atoi(argv[3]) : 1024) * 1024 / DEFAULT_BLOCK_SIZE;
+    int size = (argc > 4 ? atoi(argv[4]) : 256) * 1024;
+    char (*names)[256] = malloc(images * sizeof(*names));
+    fs_t ** fs = malloc(images * sizeof(fs_t *));
+    int * fd = malloc(images * sizeof(int));
+    char out[CHUNK], in[CHUNK];
+    double start;
+    long rss;
+
+    if (names == NULL || fs == NULL || fd == NULL)
+        return 1;
+
+    start = now();
+    for (int i = 0; i < images; i++)
+    {
+        snprintf(names[i], sizeof(names[i]), "%s.%d.disk", prefix, i);
+        if (make_fs_geometry(names[i], blocks, DEFAULT_BLOCK_SIZE) < 0)
+            return 1;
+    }
+    printf("%-10s %8.4f s\n", "make_fs", now() - start);
+
+    rss = max_rss_kib();
+    start = now();
+    if (mount_all(fs, names, images) < 0)
+        return 1;
+    printf("%-10s %8.4f s\n", "mount", now() - start);
+
+    // every image gets a chunk in turn, so all of them stay busy at once
+    start = now();
+    for (int i = 0; i < images; i++)
+        if (fs_create(fs[i], "data") < 0
+                || (fd[i] = fs_open(fs[i], "data")) < 0)
+            return 1;
+    for (int off = 0; off < size; off += CHUNK)
+        for (int i = 0; i < images; i++)
+        {
+            memset(out, 'a' + (i + off / CHUNK) % 26, CHUNK);
+            if (fs_write(fs[i], fd[i], out, CHUNK) != CHUNK)
+                return 1;
+        }
+    printf("%-10s %8.4f s (%.1f MB/s)\n", "write", now() - start,
+            (double) images * size / (now() - start) / 1e6);
+    printf("%-10s %8ld KiB per mounted image\n", "memory",
+            (max_rss_kib() - rss) / images);
+
+    start = now();
+    if (umount_all(fs, images) < 0 || mount_all(fs, names, images) < 0)
+        return 1;
+    printf("%-10s %8.4f s\n", "remount", now() - start);
+
+    start = now();
+    for (int i = 0; i < images; i++)
+        if ((fd[i] = fs_open(fs[i], "data")) < 0)
+            return 1;
+    for (int off = 0; off < size; off += CHUNK)
+        for (int i = 0; i < images; i++)
+        {
+            memset(out, 'a' + (i + off / CHUNK) % 26, CHUNK);
+            if (fs_read(fs[i], fd[i], in, CHUNK) != CHUNK
+                    || memcmp(in, out, CHUNK) != 0)
+            {
+                fprintf(stderr, "bench_mounts: image %d read back bad data\n",
+                        i);
+                return 1;
+            }
+        }
+    printf("%-10s %8.4f s (%.1f MB/s)\n", "read", now() - start,
+            (double) images * size / (now() - start) / 1e6);
+
+    if (umount_all(fs, images) < 0)
+        return 1;
+    free(names);
+    free(fs);
+    free(fd);
+    return 0;
+}
@@ -0,0 +1,76 @@
+/* bench_small -- many tiny files: creates them with 0 to 1000 bytes each,
+ * spread over a few directories, syncs, then remounts and reads them all
+ * back. Reports files/s both ways, the blocks the files took and how many
+ * blocks the read back had to fetch from the disk
+ *   $ gcc -O2 -pthread -I. bench/bench_small.c filesystem.c disk.c cache.c \
+ *         aio.c lz.c crc32c.c -o bench_small
+ *   $ ./bench_small /tmp/bench.disk [files]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "filesystem.h"
+
+#define DIRS 8
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char ** argv)
+{
+    char * diskname = argc > 1 ? argv[1] : "bench_small.disk";
+    int files = argc > 2 ? atoi(argv[2]) : 20000,
+        fd, size, before;
+    char name[32], buf[1024];
+    double start;
+    fs_stats_t st;
+    fs_t * fs;
+
+    if (make_fs_geometry(diskname, files + 16384, DEFAULT_BLOCK_SIZE) < 0
+            || (fs = fs_mount(diskname)) == NULL)
+        return 1;
+    memset(buf, 't', sizeof(buf));
+    for (int i = 0; i < DIRS; i++)
+    {
+        snprintf(name, sizeof(name), "/d%d", i);
+        if (fs_mkdir(fs, name) < 0)
+            return 1;
+    }
+    before = get_free_blocks(fs);
+
+    srand(1);
+    start = now();
+    for (int i = 0; i < files; i++)
+    {
+        snprintf(name, sizeof(name), "/d%d/f%d", i % DIRS, i);
+        size = rand() % 1001;
+        if (fs_create(fs, name) < 0 || (fd = fs_open(fs, name)) < 0
+                || fs_write(fs, fd, buf, size) != size || fs_close(fs, fd) < 0)
+            return 1;
+    }
+    if (fs_sync(fs) < 0)
+        return 1;
+    printf("create+write %8.0f files/s, %d blocks\n",
+            files / (now() - start), before - get_free_blocks(fs));
+
+    if (fs_umount(fs) < 0 || (fs = fs_mount(diskname)) == NULL)
+        return 1;
+    start = now();
+    for (int i = 0; i < files; i++)
+    {
+        snprintf(name, sizeof(name), "/d%d/f%d", i % DIRS, i);
+        if ((fd = fs_open(fs, name)) < 0 || fs_read(fs, fd, buf, 1024) < 0
+                || fs_close(fs, fd) < 0)
+            return 1;
+    }
+    fs_stats(fs, &st);
+    printf("read back    %8.0f files/s, %llu blocks read\n",
+            files / (now() - start), (unsigned long long) st.disk_blocks_read);
+    return fs_umount(fs) < 0;
+}
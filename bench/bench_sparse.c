@@ -0,0 +1,123 @@
+/* bench_sparse -- a large file with a little data scattered through it,
+ * made sparse (fs_truncate to its size, then one block written every
+ * STRIDE blocks) and made dense (every block written, zeros and all). For
+ * each reports how long making it took and how many blocks it ended up
+ * with, how fast it reads back after a remount, and how long mapping its
+ * data with fs_lseek_data takes
+ *   $ gcc -O2 -pthread -I. bench/bench_sparse.c filesystem.c disk.c cache.c \
+ *         aio.c lz.c crc32c.c -o bench_sparse
+ *   $ ./bench_sparse /tmp/bench.disk [MiB]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "filesystem.h"
+
+#define STRIDE 64
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* make -- "file" of 'size' bytes with a block of data every STRIDE blocks,
+ * written in random order, the rest a hole or, if dense, zeros */
+static int make(fs_t * fs, int size, char * zeros, char * data, int dense)
+{
+    int bs = fs_block_size(fs),
+        blocks = size / bs,
+        fd;
+
+    if (fs_create(fs, "file") < 0 || (fd = fs_open(fs, "file")) < 0)
+        return -1;
+    if (!dense && fs_truncate(fs, fd, size) < 0)
+        return -1;
+    for (int off = 0; dense && off < size; off += 1 << 20)
+        if (fs_write(fs, fd, zeros, 1 << 20) != 1 << 20)
+            return -1;
+
+    srand(1);
+    for (int i = 0; i < blocks / STRIDE; i++)
+    {
+        int at = rand() % (blocks / STRIDE) * STRIDE;
+        if (fs_lseek(fs, fd, (off_t) at * bs) < 0
+                || fs_write(fs, fd, data, bs) != bs)
+            return -1;
+    }
+    return fs_close(fs, fd);
+}
+
+/* extents -- how many runs of data fs_lseek_data finds in "file" */
+static int extents(fs_t * fs)
+{
+    int fd = fs_open(fs, "file"),
+        n = 0;
+    off_t at = 0;
+
+    while ((at = fs_lseek_data(fs, fd, at, FS_SEEK_DATA)) >= 0)
+    {
+        n++;
+        if ((at = fs_lseek_data(fs, fd, at, FS_SEEK_HOLE)) < 0)
+            return -1;
+    }
+    fs_close(fs, fd);
+    return n;
+}
+
+int main(int argc, char ** argv)
+{
+    char * diskname = argc > 1 ? argv[1] : "bench_sparse.disk";
+    int size = (argc > 2 ? atoi(argv[2]) : 256) << 20,
+        bs = DEFAULT_BLOCK_SIZE,
+        free0,
+        n,
+        fd;
+    char * zeros = calloc(1, 1 << 20),
+         * data = malloc(bs),
+         * buf = malloc(1 << 20);
+    double start, t;
+    fs_t * fs;
+
+    if (zeros == NULL || data == NULL || buf == NULL)
+        return 1;
+    memset(data, 's', bs);
+    printf("%d MiB file, a block written every %d\n", size >> 20, STRIDE);
+    printf("%8s %10s %10s %12s %10s %12s\n", "", "make ms", "blocks",
+            "read MB/s", "extents", "map ms");
+    for (int dense = 0; dense < 2; dense++)
+    {
+        if (make_fs_geometry(diskname, size / bs + 4096, bs) < 0
+                || (fs = fs_mount(diskname)) == NULL)
+            return 1;
+        free0 = get_free_blocks(fs);
+        start = now();
+        if (make(fs, size, zeros, data, dense) < 0 || fs_sync(fs) < 0)
+            return 1;
+        t = now() - start;
+        n = free0 - get_free_blocks(fs);
+
+        if (fs_umount(fs) < 0 || (fs = fs_mount(diskname)) == NULL
+                || (fd = fs_open(fs, "file")) < 0)
+            return 1;
+        start = now();
+        while (fs_read(fs, fd, buf, 1 << 20) > 0)
+            ;
+        printf("%8s %10.1f %10d %12.0f", dense ? "dense" : "sparse",
+                t * 1e3, n, size / (now() - start) / (1 << 20));
+        fs_close(fs, fd);
+
+        start = now();
+        n = extents(fs);
+        printf(" %10d %12.3f\n", n, (now() - start) * 1e3);
+        if (n < 0 || fs_umount(fs) < 0)
+            return 1;
+    }
+    free(zeros);
+    free(data);
+    free(buf);
+    return 0;
+}
@@ -0,0 +1,87 @@
+/* bench_stats -- a mixed workload on one mount: files created, written,
+ * read back at random offsets, truncated and deleted, some of it in
+ * subdirectories. Prints how long it took on stderr and the mount's
+ * fs_stats_dump on stdout, so the JSON can be piped on as it is
+ *   $ gcc -O2 -pthread -I. bench/bench_stats.c filesystem.c disk.c cache.c \
+ *         aio.c lz.c crc32c.c -o bench_stats
+ *   $ ./bench_stats /tmp/bench.disk [rounds] > stats.json
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "filesystem.h"
+
+#define FILES 64
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int round_trip(fs_t * fs, char * buf, int bs)
+{
+    char name[32];
+    int fd;
+
+    for (int i = 0; i < FILES; i++)
+    {
+        snprintf(name, sizeof(name), "/d%d/f%d", i % 4, i);
+        if (fs_create(fs, name) < 0 || (fd = fs_open(fs, name)) < 0)
+            return -1;
+        for (int b = 0; b < 16; b++)
+            if (fs_write(fs, fd, buf, bs) != bs)
+                return -1;
+        for (int r = 0; r < 16; r++)
+        {
+            fs_lseek(fs, fd, (off_t) (rand() % 16) * bs + rand() % bs);
+            if (fs_read(fs, fd, buf, 512) < 0)
+                return -1;
+        }
+        if (fs_truncate(fs, fd, 3 * bs) < 0 || fs_close(fs, fd) < 0)
+            return -1;
+    }
+    for (int i = 0; i < FILES; i++)
+    {
+        snprintf(name, sizeof(name), "/d%d/f%d", i % 4, i);
+        if (fs_delete(fs, name) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char ** argv)
+{
+    char * diskname = argc > 1 ? argv[1] : "bench_stats.disk";
+    int rounds = argc > 2 ? atoi(argv[2]) : 50;
+    char name[16], * buf;
+    double start;
+    fs_t * fs;
+
+    if (make_fs(diskname) < 0 || (fs = fs_mount(diskname)) == NULL
+            || (buf = malloc(fs_block_size(fs))) == NULL)
+        return 1;
+    memset(buf, 's', fs_block_size(fs));
+    for (int i = 0; i < 4; i++)
+    {
+        snprintf(name, sizeof(name), "/d%d", i);
+        if (fs_mkdir(fs, name) < 0)
+            return 1;
+    }
+
+    srand(1);
+    start = now();
+    for (int r = 0; r < rounds; r++)
+        if (round_trip(fs, buf, fs_block_size(fs)) < 0)
+            return 1;
+    fprintf(stderr, "%d rounds in %.3f s\n", rounds, now() - start);
+
+    fs_sync(fs);
+    if (fs_stats_dump(fs, stdout) < 0)
+        return 1;
+    free(buf);
+    return fs_umount(fs) < 0;
+}
@@ -0,0 +1,89 @@
+/* bench_stream -- streams a large file front to back with fs_read calls of
+ * 4 KiB up to 1 MiB, remounting before each pass so none of it starts out
+ * in the block cache. Once for a file laid out in one run and once for one
+ * fragmented into single blocks, where read-ahead has to follow the chain
+ *   $ gcc -O2 -pthread -I. bench/bench_stream.c filesystem.c disk.c cache.c \
+ *         aio.c lz.c crc32c.c -o bench_stream
+ *   $ ./bench_stream /tmp/bench.disk [file MiB]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "filesystem.h"
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* writes 'data' and, when fragmented, 'other' a block at a time in turn */
+static int make_file(char * diskname, int size, int fragmented)
+{
+    int bs = DEFAULT_BLOCK_SIZE, fd, other = -1;
+    char * buf = malloc(bs);
+    fs_t * fs;
+
+    if (buf == NULL
+            || make_fs_geometry(diskname, 2 * (size / bs) + 1024, bs) < 0
+            || (fs = fs_mount(diskname)) == NULL)
+        return -1;
+    fs_set_alloc_mode(fs, fragmented ? ALLOC_FIRST_FIT : ALLOC_EXTENT);
+    if (fs_create(fs, "data") < 0 || (fd = fs_open(fs, "data")) < 0)
+        return -1;
+    if (fragmented && (fs_create(fs, "other") < 0
+                || (other = fs_open(fs, "other")) < 0))
+        return -1;
+
+    for (int off = 0; off < size; off += bs)
+    {
+        memset(buf, 'a' + off / bs % 26, bs);
+        if (fs_write(fs, fd, buf, bs) != bs
+                || (other >= 0 && fs_write(fs, other, buf, bs) != bs))
+            return -1;
+    }
+    free(buf);
+    return fs_umount(fs);
+}
+
+static int stream(char * diskname, int size, int chunk, double * mbs)
+{
+    char * buf = malloc(chunk);
+    double start;
+    int fd, n;
+    fs_t * fs;
+
+    if (buf == NULL || (fs = fs_mount(diskname)) == NULL
+            || (fd = fs_open(fs, "data")) < 0)
+        return -1;
+
+    start = now();
+    for (int off = 0; off < size; off += n)
+        if ((n = fs_read(fs, fd, buf, chunk)) <= 0)
+            return -1;
+    *mbs = size / (now() - start) / 1e6;
+
+    free(buf);
+    return fs_umount(fs);
+}
+
+int main(int argc, char ** argv)
+{
+    char * diskname = argc > 1 ? argv[1] : "bench_stream.disk";
+    int size = (argc > 2 ? atoi(argv[2]) : 64) << 20;
+    double mbs[2];
+
+    printf("%10s %16s %16s\n", "read size", "one run MB/s", "fragmented MB/s");
+    for (int chunk = 4 << 10; chunk <= 1 << 20; chunk *= 4)
+    {
+        for (int fragmented = 0; fragmented <= 1; fragmented++)
+            if (make_file(diskname, size, fragmented) < 0
+                    || stream(diskname, size, chunk, &mbs[fragmented]) < 0)
+                return 1;
+        printf("%10d %16.1f %16.1f\n", chunk, mbs[0], mbs[1]);
+    }
+    return 0;
+}
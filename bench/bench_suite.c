@@ -0,0 +1,448 @@
+/* bench_suite -- the workloads below, each on a fresh image with a fixed
+ * seed so two runs do the same calls in the same order. Every call timed
+ * is one op; a row of CSV per workload and I/O size, the median of -R
+ * runs, goes to stdout (or -o) with MB/s, ops/s and p50/p99 latency.
+ * Given the CSV of an earlier run with -c, exits 1 if any row lost more
+ * than -t percent of its ops/s
+ *   $ gcc -O2 -pthread -I. bench/bench_suite.c filesystem.c disk.c cache.c \
+ *         aio.c lz.c crc32c.c -o bench_suite
+ *   $ ./bench_suite [-s MiB] [-n ops] [-R repeats] [-w workload]
+ *         [-o out.csv] [-c baseline.csv] [-t percent] /dev/shm/bench.disk
+ * `make bench` runs it on a tmpfs image and checks bench-baseline.csv
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "filesystem.h"
+
+#define MAX_IO (1 << 20)
+#define MAX_ROWS 64
+#define LOGS 4
+#define RECORD 256
+#define CHURN_LIVE 64
+
+typedef struct Run
+{
+    fs_t * fs;
+    char * buf;
+    int io;                 /* bytes per call */
+    int ops;                /* calls to time, at most */
+    int size;               /* bytes in the file the workload works on */
+    double * lat;           /* microseconds, one per op */
+    int n;                  /* ops timed so far */
+    long bytes;
+    double start;
+} Run;
+
+typedef struct Workload
+{
+    const char * name;
+    int (*run)(Run * r);
+    int io[3];              /* sizes to run it at, 0 ending the list */
+} Workload;
+
+typedef struct Row
+{
+    char name[32];
+    int io;
+    int ops;
+    double seconds, mb_s, ops_s, p50, p99;
+} Row;
+
+static char * diskname;
+static int size = 64, ops = 20000, repeats = 3;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* times one call: 'began' is now() from just before it */
+static int timed(Run * r, double began, int ret, int bytes)
+{
+    r->lat[r->n++] = (now() - began) * 1e6;
+    if (ret >= 0)
+        r->bytes += bytes;
+    return ret;
+}
+
+/* 'data' written out in full, unmounted and mounted again so its blocks
+ * start out of the cache */
+static int make_data(Run * r)
+{
+    int fd;
+
+    if (fs_create(r->fs, "data") < 0 || (fd = fs_open(r->fs, "data")) < 0)
+        return -1;
+    for (int off = 0; off < r->size; off += MAX_IO)
+        if (fs_write(r->fs, fd, r->buf, MAX_IO) != MAX_IO)
+            return -1;
+    if (fs_umount(r->fs) < 0 || (r->fs = fs_mount(diskname)) == NULL)
+        return -1;
+    return fs_open(r->fs, "data");
+}
+
+static int seq_write(Run * r)
+{
+    double t;
+    int fd;
+
+    if (fs_create(r->fs, "data") < 0 || (fd = fs_open(r->fs, "data")) < 0)
+        return -1;
+    r->start = now();
+    for (int off = 0; off < r->size && r->n < r->ops; off += r->io)
+    {
+        t = now();
+        if (timed(r, t, fs_write(r->fs, fd, r->buf, r->io), r->io) != r->io)
+            return -1;
+    }
+    return fs_fsync(r->fs, fd);
+}
+
+static int seq_read(Run * r)
+{
+    double t;
+    int fd;
+
+    if ((fd = make_data(r)) < 0)
+        return -1;
+    r->start = now();
+    for (int off = 0; off < r->size && r->n < r->ops; off += r->io)
+    {
+        t = now();
+        if (timed(r, t, fs_read(r->fs, fd, r->buf, r->io), r->io) != r->io)
+            return -1;
+    }
+    return 0;
+}
+
+static int random_io(Run * r, int write)
+{
+    int fd, slots = r->size / r->io;
+    double t;
+
+    if ((fd = make_data(r)) < 0)
+        return -1;
+    r->start = now();
+    while (r->n < r->ops)
+    {
+        fs_lseek(r->fs, fd, (off_t) (rand() % slots) * r->io);
+        t = now();
+        if (timed(r, t, (write ? fs_write : fs_read)(r->fs, fd, r->buf,
+                        r->io), r->io) != r->io)
+            return -1;
+    }
+    return write ? fs_fsync(r->fs, fd) : 0;
+}
+
+static int rand_read(Run * r)
+{
+    return random_io(r, 0);
+}
+
+static int rand_write(Run * r)
+{
+    return random_io(r, 1);
+}
+
+/* each op creates, writes and closes one file; past CHURN_LIVE files the
+ * oldest is deleted too, so the directory stays the same size */
+static int churn(Run * r)
+{
+    char name[32];
+    double t;
+    int fd;
+
+    if (fs_mkdir(r->fs, "/churn") < 0)
+        return -1;
+    r->start = now();
+    for (int i = 0; r->n < r->ops; i++)
+    {
+        t = now();
+        snprintf(name, sizeof(name), "/churn/f%d", i);
+        if (fs_create(r->fs, name) < 0 || (fd = fs_open(r->fs, name)) < 0
+                || fs_write(r->fs, fd, r->buf, r->io) != r->io
+                || fs_close(r->fs, fd) < 0)
+            return -1;
+        snprintf(name, sizeof(name), "/churn/f%d", i - CHURN_LIVE);
+        if (timed(r, t, i >= CHURN_LIVE ? fs_delete(r->fs, name) : 0,
+                    r->io) < 0)
+            return -1;
+    }
+    return fs_sync(r->fs);
+}
+
+/* LOGS files grown side by side by RECORD byte appends, fsyncing one of
+ * them every io bytes */
+static int append(Run * r)
+{
+    int fd[LOGS], limit = r->size / LOGS / RECORD;
+    char name[16];
+    double t;
+
+    for (int i = 0; i < LOGS; i++)
+    {
+        snprintf(name, sizeof(name), "log%d", i);
+        if (fs_create(r->fs, name) < 0 || (fd[i] = fs_open(r->fs, name)) < 0)
+            return -1;
+    }
+    r->start = now();
+    for (int n = 0; r->n < r->ops && n < limit * LOGS; n++)
+    {
+        t = now();
+        if (fs_write(r->fs, fd[n % LOGS], r->buf, RECORD) != RECORD
+                || ((n + 1) * RECORD % r->io == 0
+                    && fs_fsync(r->fs, fd[n % LOGS]) < 0))
+            return -1;
+        timed(r, t, 0, RECORD);
+    }
+    for (int i = 0; i < LOGS; i++)
+        if (fs_fsync(r->fs, fd[i]) < 0)
+            return -1;
+    return 0;
+}
+
+/* each op cuts a 1 MiB file back to nothing and writes it again io bytes
+ * at a time, so there are a 64th as many of them as -n asks for */
+static int truncate_regrow(Run * r)
+{
+    int fd, grown = 1 << 20;
+    double t;
+
+    if (fs_create(r->fs, "data") < 0 || (fd = fs_open(r->fs, "data")) < 0)
+        return -1;
+    for (int off = 0; off < grown; off += r->io)
+        if (fs_write(r->fs, fd, r->buf, r->io) != r->io)
+            return -1;
+    r->start = now();
+    while (r->n < r->ops / 64 + 1)
+    {
+        t = now();
+        if (fs_truncate(r->fs, fd, 0) < 0)
+            return -1;
+        fs_lseek(r->fs, fd, 0);
+        for (int off = 0; off < grown; off += r->io)
+            if (fs_write(r->fs, fd, r->buf, r->io) != r->io)
+                return -1;
+        timed(r, t, 0, grown);
+    }
+    return fs_fsync(r->fs, fd);
+}
+
+/* fills all but half a file's worth of the image with files of 1 to 64
+ * blocks and deletes every other one, leaving most free space in holes,
+ * then writes a file through them and reads it back after a remount. Only
+ * the read is timed */
+static int aged_read(Run * r)
+{
+    int bs = fs_block_size(r->fs), fd, files = 0, blocks;
+    char name[32];
+    double t;
+
+    fs_set_alloc_mode(r->fs, ALLOC_FIRST_FIT);
+    if (fs_mkdir(r->fs, "/aged") < 0)
+        return -1;
+    for (int used = 0; used < 7 * (r->size / bs) / 2; used += blocks, files++)
+    {
+        blocks = 1 + rand() % 64;
+        snprintf(name, sizeof(name), "/aged/f%d", files);
+        if (fs_create(r->fs, name) < 0 || (fd = fs_open(r->fs, name)) < 0)
+            return -1;
+        for (int b = 0; b < blocks; b++)
+            if (fs_write(r->fs, fd, r->buf, bs) != bs)
+                return -1;
+        fs_close(r->fs, fd);
+    }
+    for (int i = 0; i < files; i += 2)
+    {
+        snprintf(name, sizeof(name), "/aged/f%d", i);
+        if (fs_delete(r->fs, name) < 0)
+            return -1;
+    }
+    fs_set_alloc_mode(r->fs, ALLOC_EXTENT);
+
+    if ((fd = make_data(r)) < 0)
+        return -1;
+    r->start = now();
+    for (int off = 0; off < r->size && r->n < r->ops; off += r->io)
+    {
+        t = now();
+        if (timed(r, t, fs_read(r->fs, fd, r->buf, r->io), r->io) != r->io)
+            return -1;
+    }
+    return 0;
+}
+
+static Workload workloads[] = {
+    { "seqwrite", seq_write, { 4096, 65536, MAX_IO } },
+    { "seqread", seq_read, { 4096, 65536, MAX_IO } },
+    { "randread", rand_read, { 4096, 65536, 0 } },
+    { "randwrite", rand_write, { 4096, 65536, 0 } },
+    { "churn", churn, { 512, 16384, 0 } },
+    { "append", append, { 4096, 65536, 0 } },
+    { "truncate", truncate_regrow, { 4096, 65536, 0 } },
+    { "aged", aged_read, { 65536, 0 } },
+};
+
+static int by_value(const void * a, const void * b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static int by_rate(const void * a, const void * b)
+{
+    return by_value(&((const Row *) a)->ops_s, &((const Row *) b)->ops_s);
+}
+
+static double percentile(double * sorted, int n, double p)
+{
+    int i = (int) (p * n);
+    return sorted[i < n ? i : n - 1];
+}
+
+/* the rows of an earlier run's CSV; the header line fails to scan */
+static int load_rows(char * name, Row * rows)
+{
+    char line[256];
+    int n = 0;
+    FILE * f = fopen(name, "r");
+
+    if (f == NULL)
+    {
+        fprintf(stderr, "bench_suite: can't open %s\n", name);
+        return -1;
+    }
+    while (n < MAX_ROWS && fgets(line, sizeof(line), f))
+        if (sscanf(line, "%31[^,],%d,%*d,%*f,%*f,%lf", rows[n].name,
+                    &rows[n].io, &rows[n].ops_s) == 3)
+            n++;
+    fclose(f);
+    return n;
+}
+
+static int run(Workload * w, int io, unsigned seed, Row * row)
+{
+    int bs = DEFAULT_BLOCK_SIZE;
+    double elapsed;
+    Run r = { 0 };
+
+    r.io = io;
+    r.ops = ops;
+    r.size = size << 20;
+    if ((r.buf = malloc(MAX_IO)) == NULL
+            || (r.lat = malloc(sizeof(double) * ops)) == NULL)
+        return -1;
+    memset(r.buf, 'b', MAX_IO);
+
+    srand(seed);
+    if (make_fs_geometry(diskname, 4 * (r.size / bs) + 1024, bs) < 0
+            || (r.fs = fs_mount(diskname)) == NULL)
+        return -1;
+    if (w->run(&r) < 0 || r.n == 0)
+    {
+        fprintf(stderr, "bench_suite: %s at %d failed\n", w->name, io);
+        return -1;
+    }
+    elapsed = now() - r.start;
+    if (fs_umount(r.fs) < 0)
+        return -1;
+
+    qsort(r.lat, r.n, sizeof(double), by_value);
+    snprintf(row->name, sizeof(row->name), "%s", w->name);
+    row->io = io;
+    row->ops = r.n;
+    row->seconds = elapsed;
+    row->mb_s = r.bytes / elapsed / 1e6;
+    row->ops_s = r.n / elapsed;
+    row->p50 = percentile(r.lat, r.n, 0.50);
+    row->p99 = percentile(r.lat, r.n, 0.99);
+
+    free(r.buf);
+    free(r.lat);
+    return 0;
+}
+
+int main(int argc, char ** argv)
+{
+    char * only = NULL, * baseline = NULL;
+    Row rows[MAX_ROWS], old[MAX_ROWS], * tries, * mid;
+    int nrows = 0, nold = 0, regressed = 0, c;
+    double tolerance = 15;
+    unsigned seed = 1;
+    FILE * out = stdout;
+
+    while ((c = getopt(argc, argv, "s:n:R:w:o:c:t:r:")) != -1)
+    {
+        switch (c)
+        {
+            case 's': size = atoi(optarg); break;
+            case 'n': ops = atoi(optarg); break;
+            case 'R': repeats = atoi(optarg); break;
+            case 'w': only = optarg; break;
+            case 'c': baseline = optarg; break;
+            case 't': tolerance = atof(optarg); break;
+            case 'r': seed = atoi(optarg); break;
+            case 'o':
+                if ((out = fopen(optarg, "w")) == NULL)
+                {
+                    fprintf(stderr, "bench_suite: can't write %s\n", optarg);
+                    return 2;
+                }
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-s MiB] [-n ops] [-R repeats] "
+                        "[-w workload] [-o out.csv] [-c baseline.csv] "
+                        "[-t percent] [-r seed] image\n", argv[0]);
+                return 2;
+        }
+    }
+    diskname = optind < argc ? argv[optind] : "bench_suite.disk";
+    if (size <= 0 || ops <= 0 || repeats <= 0
+            || (tries = malloc(sizeof(Row) * repeats)) == NULL
+            || (baseline && (nold = load_rows(baseline, old)) < 0))
+        return 2;
+
+    fprintf(out, "workload,io_size,ops,seconds,mb_s,ops_s,p50_us,p99_us\n");
+    for (int i = 0; i < (int) (sizeof(workloads) / sizeof(workloads[0])); i++)
+    {
+        if (only && strcmp(only, workloads[i].name) != 0)
+            continue;
+        for (int j = 0; j < 3 && workloads[i].io[j]; j++)
+        {
+            // the same run again, keeping the median by ops/s
+            for (int k = 0; k < repeats; k++)
+                if (run(&workloads[i], workloads[i].io[j], seed,
+                            &tries[k]) < 0)
+                    return 2;
+            qsort(tries, repeats, sizeof(Row), by_rate);
+            mid = &rows[nrows++];
+            *mid = tries[repeats / 2];
+            fprintf(out, "%s,%d,%d,%.4f,%.1f,%.0f,%.2f,%.2f\n", mid->name,
+                    mid->io, mid->ops, mid->seconds, mid->mb_s, mid->ops_s,
+                    mid->p50, mid->p99);
+            fflush(out);
+        }
+    }
+    if (out != stdout)
+        fclose(out);
+    unlink(diskname);
+
+    for (int i = 0; i < nrows; i++)
+        for (int j = 0; j < nold; j++)
+            if (strcmp(rows[i].name, old[j].name) == 0
+                    && rows[i].io == old[j].io
+                    && rows[i].ops_s < old[j].ops_s * (1 - tolerance / 100))
+            {
+                fprintf(stderr, "bench_suite: %s at %d: %.0f ops/s, "
+                        "%.0f in %s\n", rows[i].name, rows[i].io,
+                        rows[i].ops_s, old[j].ops_s, baseline);
+                regressed = 1;
+            }
+    return regressed;
+}
@@ -0,0 +1,158 @@
+/* bench_threads -- 1, 2, 4 and 8 threads each write their own file, then read
+ * it back and check it, while one more thread keeps creating, opening,
+ * listing and deleting files in the same directory. Reports the aggregate
+ * throughput of the I/O threads and how many metadata ops got through
+ *   $ gcc -O2 -pthread -I. bench/bench_threads.c filesystem.c disk.c cache.c \
+ *         aio.c lz.c crc32c.c -o bench_threads
+ *   $ ./bench_threads /tmp/bench.disk [MiB per thread] [passes]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "filesystem.h"
+
+#define MAX_THREADS 8
+#define CHUNK (64 << 10)
+
+static int size;
+static int passes;
+static int done;
+static fs_t * fs;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* writes the file in CHUNK sized pieces, seeks back and checks every byte */
+static void * io_thread(void * arg)
+{
+    long id = (long) arg;
+    char name[MAX_FILENAME], * out = malloc(CHUNK), * in = malloc(CHUNK);
+    int fd;
+    long failed = 0;
+
+    snprintf(name, sizeof(name), "/io/data%ld", id);
+    if (!out || !in || fs_create(fs, name) < 0
+            || (fd = fs_open(fs, name)) < 0)
+        return (void *) 1;
+
+    for (int p = 0; p < passes && !failed; p++)
+    {
+        fs_lseek(fs, fd, 0);
+        for (int off = 0; off < size; off += CHUNK)
+        {
+            memset(out, 'a' + (id + p + off / CHUNK) % 26, CHUNK);
+            if (fs_write(fs, fd, out, CHUNK) != CHUNK)
+                failed = 1;
+        }
+
+        fs_lseek(fs, fd, 0);
+        for (int off = 0; off < size && !failed; off += CHUNK)
+        {
+            memset(out, 'a' + (id + p + off / CHUNK) % 26, CHUNK);
+            if (fs_read(fs, fd, in, CHUNK) != CHUNK
+                    || memcmp(in, out, CHUNK))
+                failed = 1;
+        }
+    }
+
+    fs_close(fs, fd);
+    free(out);
+    free(in);
+    return (void *) failed;
+}
+
+/* creates, opens, lists and deletes small files until the I/O is done,
+ * returning how many of those calls failed */
+static void * meta_thread(void * arg)
+{
+    long * ops = arg;
+    char name[MAX_FILENAME];
+    Attribute entry;
+    int fd;
+    long failed = 0;
+
+    for (int i = 0; !__atomic_load_n(&done, __ATOMIC_RELAXED); i++)
+    {
+        snprintf(name, sizeof(name), "/meta/f%d", i % 32);
+        if (fs_create(fs, name) < 0 || (fd = fs_open(fs, name)) < 0)
+            failed++;
+        else
+        {
+            fs_write(fs, fd, name, strlen(name));
+            fs_close(fs, fd);
+        }
+        for (int pos = 0; fs_readdir(fs, "/meta", pos, &entry) > 0; pos++)
+            ;
+        if (i % 32 == 31)
+            for (int j = 0; j < 32; j++)
+            {
+                snprintf(name, sizeof(name), "/meta/f%d", j);
+                failed += fs_delete(fs, name) < 0;
+            }
+        *ops += 4;
+    }
+    return (void *) failed;
+}
+
+static int run(char * diskname, int threads)
+{
+    pthread_t io[MAX_THREADS], meta;
+    long ops = 0;
+    void * failed;
+    int errors = 0;
+    double start, elapsed;
+
+    // room for every thread's file plus some slack
+    if (make_fs_geometry(diskname,
+                (MAX_THREADS * (long) size + (16 << 20)) / DEFAULT_BLOCK_SIZE,
+                DEFAULT_BLOCK_SIZE) < 0
+            || (fs = fs_mount(diskname)) == NULL)
+        return -1;
+    if (fs_mkdir(fs, "/io") < 0 || fs_mkdir(fs, "/meta") < 0)
+        return -1;
+
+    __atomic_store_n(&done, 0, __ATOMIC_RELAXED);
+    start = now();
+    pthread_create(&meta, NULL, meta_thread, &ops);
+    for (long i = 0; i < threads; i++)
+        pthread_create(&io[i], NULL, io_thread, (void *) i);
+    for (int i = 0; i < threads; i++)
+    {
+        pthread_join(io[i], &failed);
+        errors += failed != NULL;
+    }
+    elapsed = now() - start;
+    __atomic_store_n(&done, 1, __ATOMIC_RELAXED);
+    pthread_join(meta, &failed);
+
+    if (errors)
+        fprintf(stderr, "bench_threads: %d threads read back bad data\n",
+                errors);
+    if (failed != NULL)
+        fprintf(stderr, "bench_threads: %ld metadata calls failed\n",
+                (long) failed);
+    printf("%8d %12.1f %12.0f\n", threads,
+            2.0 * threads * passes * size / elapsed / 1e6, ops / elapsed);
+    return errors || failed != NULL || fs_umount(fs) < 0 ? -1 : 0;
+}
+
+int main(int argc, char ** argv)
+{
+    char * diskname = argc > 1 ? argv[1] : "bench_threads.disk";
+
+    size = (argc > 2 ? atoi(argv[2]) : 8) << 20;
+    passes = argc > 3 ? atoi(argv[3]) : 4;
+
+    printf("%8s %12s %12s\n", "threads", "MB/s", "meta op/s");
+    for (int threads = 1; threads <= MAX_THREADS; threads *= 2)
+        if (run(diskname, threads) < 0)
+            return 1;
+    return 0;
+}
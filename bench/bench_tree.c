@@ -0,0 +1,116 @@
+/* bench_tree -- metadata benchmark: builds a directory tree, then walks it
+ * find-style with fs_readdir and reopens its deepest files
+ *   $ gcc -O2 -pthread -I. bench/bench_tree.c filesystem.c disk.c cache.c \
+ *         aio.c lz.c crc32c.c -o bench_tree
+ *   $ ./bench_tree /tmp/bench.disk [fanout] [depth] [files per dir]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "filesystem.h"
+
+#define PATH_LEN 1024
+
+static int fanout, depth, files;
+static char deepest[PATH_LEN];
+static fs_t * fs;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* build -- fills 'path' with 'files' files and 'fanout' subdirectories,
+ * recursing until 'level' reaches 'depth'. Returns entries created */
+static int build(const char * path, int level)
+{
+    char child[PATH_LEN];
+    int created = 0;
+
+    for (int i = 0; i < files; i++)
+    {
+        snprintf(child, PATH_LEN, "%s/file_%d", path, i);
+        if (fs_create(fs, child) == 0)
+            created++;
+        snprintf(deepest, PATH_LEN, "%s", child);
+    }
+    if (level == depth)
+        return created;
+
+    for (int i = 0; i < fanout; i++)
+    {
+        snprintf(child, PATH_LEN, "%s/dir_level%d_%d", path, level, i);
+        if (fs_mkdir(fs, child) < 0)
+            continue;
+        created += 1 + build(child, level + 1);
+    }
+    return created;
+}
+
+/* walk -- counts every entry below 'path', like find(1) */
+static int walk(const char * path)
+{
+    char child[PATH_LEN];
+    Attribute entry;
+    int found = 0;
+
+    for (int pos = 0; fs_readdir(fs, (char *) path, pos, &entry) == 1; pos++)
+    {
+        found++;
+        if (entry.type == ATTR_DIR)
+        {
+            snprintf(child, PATH_LEN, "%s/%s", path, entry.name);
+            found += walk(child);
+        }
+    }
+    return found;
+}
+
+static void timed_walk(const char * what)
+{
+    double start = now();
+    int found = walk("");
+    double elapsed = now() - start;
+    printf("%-12s %8d entries in %.4f s (%.0f entries/s)\n",
+            what, found, elapsed, found / elapsed);
+}
+
+int main(int argc, char ** argv)
+{
+    char * diskname = argc > 1 ? argv[1] : "bench_tree.disk";
+    int opens = 100000, created;
+    double start, elapsed;
+
+    fanout = argc > 2 ? atoi(argv[2]) : 4;
+    depth = argc > 3 ? atoi(argv[3]) : 5;
+    files = argc > 4 ? atoi(argv[4]) : 3;
+
+    if (make_fs(diskname) < 0 || (fs = fs_mount(diskname)) == NULL)
+        return 1;
+
+    start = now();
+    created = build("", 0);
+    elapsed = now() - start;
+    printf("%-12s %8d entries in %.4f s (%.0f entries/s)\n",
+            "build", created, elapsed, created / elapsed);
+
+    timed_walk("walk");
+
+    start = now();
+    for (int i = 0; i < opens; i++)
+        fs_close(fs, fs_open(fs, deepest));
+    elapsed = now() - start;
+    printf("%-12s %8d opens   in %.4f s (%.0f opens/s) of %s\n",
+            "deep open", opens, elapsed, opens / elapsed, deepest);
+
+    // directories get loaded again on first use after a remount
+    if (fs_umount(fs) < 0 || (fs = fs_mount(diskname)) == NULL)
+        return 1;
+    timed_walk("cold walk");
+    timed_walk("warm walk");
+
+    return fs_umount(fs) < 0;
+}
@@ -0,0 +1,520 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "cache.h"
+#include "crc32c.h"
+
+/******************************************************************************/
+/* read-ahead leaves at least half the cache to cache_get, however many
+ * readers there are                                                          */
+#define FETCH_SLOTS(c) ((c)->size / 2)
+
+static char * slot_buffer(Cache * c, int idx)
+{
+    return c->buffers + idx * (long) c->disk->block_size;
+}
+
+static int is_dirty(Cache * c, int block)
+{
+    return block >= 0 && block < c->disk_blocks
+        && c->slot_of[block] != CACHE_EMPTY
+        && c->slots[c->slot_of[block]].dirty
+        && !c->slots[c->slot_of[block]].pins;
+}
+
+static void set_sum(Cache * c, int block, uint32_t sum)
+{
+    if (c->sums[block] == sum)
+        return;
+    c->sums[block] = sum;
+    __atomic_store_n(&c->sums_dirty[block
+            / (c->disk->block_size / sizeof(uint32_t))], 1, __ATOMIC_RELAXED);
+}
+
+/* whether block, just read into buf, is what was last written there. Says
+ * so and counts it when it isn't */
+static int sum_ok(Cache * c, int block, const char * buf)
+{
+    if (c->sums == NULL || c->sums[block] == SUM_UNKNOWN
+            || cache_sum(c, block, buf) == c->sums[block])
+        return 1;
+    __atomic_add_fetch(&c->sum_errors, 1, __ATOMIC_RELAXED);
+    fprintf(stderr, "cache: block %d failed its checksum\n", block);
+    return 0;
+}
+
+/* writes back the dirty block in slot idx together with the unpinned dirty
+ * cached blocks physically next to it, in a single call */
+static int write_back(Cache * c, int idx)
+{
+    struct iovec iov[CACHE_RUN];
+    uint32_t sums[CACHE_RUN];
+    int first = c->slots[idx].block,
+        last = first,
+        n;
+
+    while (last - first + 1 < CACHE_RUN && is_dirty(c, first - 1))
+        first--;
+    while (last - first + 1 < CACHE_RUN && is_dirty(c, last + 1))
+        last++;
+
+    // a do loop, so the compiler sees iov[0] set: idx is always in the run
+    n = 0;
+    do {
+        iov[n].iov_base = slot_buffer(c, c->slot_of[first + n]);
+        iov[n].iov_len = c->disk->block_size;
+        if (c->sums != NULL)
+            sums[n] = cache_sum(c, first + n, iov[n].iov_base);
+    } while (first + ++n <= last);
+    if (blocks_writev(c->disk, first, iov, n) < 0)
+        return -1;
+    for (int i = 0; i < n; i++) {
+        c->slots[c->slot_of[first + i]].dirty = 0;
+        if (c->sums != NULL)
+            set_sum(c, first + i, sums[i]);
+    }
+
+    return 0;
+}
+
+/* finds a slot to reuse. When every slot is pinned or loading, waits for
+ * one to come free if wait, otherwise fails */
+static int evict(Cache * c, int wait)
+{
+    CacheSlot * slot;
+    int skipped = 0;
+
+    // CLOCK: skip over (and clear) recently used slots
+    while (1)
+    {
+        slot = &c->slots[c->clock_hand];
+        c->clock_hand = (c->clock_hand + 1) % c->size;
+
+        if (slot->block == CACHE_EMPTY)
+            break;
+        if (slot->pins || slot->loading)
+        {
+            // two full turns means every slot is in use
+            if (++skipped > 2 * c->size)
+            {
+                if (!wait)
+                    return -1;
+                c->waiting++;
+                pthread_cond_wait(&c->loaded, &c->lock);
+                c->waiting--;
+                skipped = 0;
+            }
+            continue;
+        }
+        if (slot->referenced)
+        {
+            slot->referenced = 0;
+            continue;
+        }
+        if (slot->dirty && write_back(c, slot - c->slots) < 0)
+            return -1;
+        c->slot_of[slot->block] = CACHE_EMPTY;
+        slot->block = CACHE_EMPTY;
+        break;
+    }
+    return slot - c->slots;
+}
+
+/* gives up on a slot claimed for a read that failed */
+static void unclaim(Cache * c, int idx)
+{
+    c->slot_of[c->slots[idx].block] = CACHE_EMPTY;
+    c->slots[idx].block = CACHE_EMPTY;
+    c->slots[idx].dirty = c->slots[idx].referenced = 0;
+    c->slots[idx].pins = c->slots[idx].loading = 0;
+}
+
+int cache_init(Cache * c, Disk * disk, int nblocks)
+{
+    memset(c, 0, sizeof(Cache));
+    c->disk = disk;
+    c->disk_blocks = disk->blocks;
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->loaded, NULL);
+
+    // nothing to cache, the mapping already is the disk
+    if (block_map(disk, 0) != NULL) {
+        c->mapped = 1;
+        return 0;
+    }
+
+    c->slots = malloc(nblocks * sizeof(CacheSlot));
+    c->buffers = malloc(nblocks * (long) disk->block_size);
+    c->slot_of = malloc(disk->blocks * sizeof(int));
+    if (!c->slots || !c->buffers || !c->slot_of) {
+        fprintf(stderr, "cache_init: out of memory\n");
+        cache_destroy(c);
+        return -1;
+    }
+
+    for (int i = 0; i < nblocks; i++) {
+        c->slots[i].block = CACHE_EMPTY;
+        c->slots[i].dirty = c->slots[i].referenced = 0;
+        c->slots[i].pins = c->slots[i].loading = 0;
+    }
+    for (int i = 0; i < disk->blocks; i++)
+        c->slot_of[i] = CACHE_EMPTY;
+    c->size = nblocks;
+
+    return 0;
+}
+
+char * cache_get(Cache * c, int block, int mode)
+{
+    int idx, failed;
+    char * buf;
+
+    if ((block < 0) || (block >= c->disk_blocks)) {
+        fprintf(stderr, "cache_get: block index out of bounds\n");
+        return NULL;
+    }
+
+    if (c->mapped) {
+        buf = block_map(c->disk, block);
+        if (mode == CACHE_ZERO)
+            memset(buf, 0, c->disk->block_size);
+        if (mode != CACHE_READ)
+            block_dirty(c->disk, block, 1);
+        return buf;
+    }
+
+    pthread_mutex_lock(&c->lock);
+    while ((idx = c->slot_of[block]) != CACHE_EMPTY && c->slots[idx].loading)
+        pthread_cond_wait(&c->loaded, &c->lock);
+
+    __atomic_add_fetch(idx == CACHE_EMPTY ? &c->misses : &c->hits, 1,
+            __ATOMIC_RELAXED);
+    if (idx == CACHE_EMPTY) {
+        if ((idx = evict(c, 1)) < 0) {
+            pthread_mutex_unlock(&c->lock);
+            return NULL;
+        }
+        buf = slot_buffer(c, idx);
+        c->slots[idx].block = block;
+        c->slot_of[block] = idx;
+
+        if (mode == CACHE_READ || mode == CACHE_WRITE) {
+            c->slots[idx].loading = 1;
+            pthread_mutex_unlock(&c->lock);
+            failed = block_read(c->disk, block, buf) < 0
+                || !sum_ok(c, block, buf);
+            pthread_mutex_lock(&c->lock);
+            c->slots[idx].loading = 0;
+            pthread_cond_broadcast(&c->loaded);
+            if (failed) {
+                unclaim(c, idx);
+                pthread_mutex_unlock(&c->lock);
+                return NULL;
+            }
+        }
+    }
+
+    buf = slot_buffer(c, idx);
+    if (mode == CACHE_ZERO)
+        memset(buf, 0, c->disk->block_size);
+    if (mode != CACHE_READ)
+        c->slots[idx].dirty = 1;
+    c->slots[idx].referenced = 1;
+    c->slots[idx].pins++;
+    pthread_mutex_unlock(&c->lock);
+
+    return buf;
+}
+
+void cache_put(Cache * c, int block)
+{
+    int idx;
+
+    if ((block < 0) || (block >= c->disk_blocks) || c->mapped)
+        return;
+
+    pthread_mutex_lock(&c->lock);
+    if ((idx = c->slot_of[block]) != CACHE_EMPTY && c->slots[idx].pins > 0
+            && --c->slots[idx].pins == 0 && c->waiting > 0)
+        pthread_cond_broadcast(&c->loaded);
+    pthread_mutex_unlock(&c->lock);
+}
+
+int cache_zero(Cache * c, int block)
+{
+    if (cache_get(c, block, CACHE_ZERO) == NULL)
+        return -1;
+    cache_put(c, block);
+    return 0;
+}
+
+void cache_discard(Cache * c, int block)
+{
+    int idx;
+
+    if ((block < 0) || (block >= c->disk_blocks) || c->mapped)
+        return;
+
+    pthread_mutex_lock(&c->lock);
+    if ((idx = c->slot_of[block]) != CACHE_EMPTY && !c->slots[idx].loading) {
+        unclaim(c, idx);
+        if (c->waiting > 0)
+            pthread_cond_broadcast(&c->loaded);
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+int cache_prefetch(Cache * c, int block, int count)
+{
+    struct iovec iov[CACHE_RUN];
+    char bad[CACHE_RUN];
+    int first, n, failed;
+
+    if (c->mapped) {
+        block_advise(c->disk, block, count);
+        return 0;
+    }
+
+    if (count > CACHE_RUN)
+        count = CACHE_RUN;
+    if ((block < 0) || (count <= 0) || (block > c->disk_blocks - count))
+        return -1;
+
+    pthread_mutex_lock(&c->lock);
+    for (int b = block; b < block + count; ) {
+        if (c->slot_of[b] != CACHE_EMPTY) {
+            b++;
+            continue;
+        }
+
+        // claim slots for the run of blocks that aren't cached yet, as
+        // many as the cache can spare
+        for (first = b, n = 0;
+                b < block + count && c->slot_of[b] == CACHE_EMPTY; b++, n++) {
+            int idx = c->fetching < FETCH_SLOTS(c) ? evict(c, 0) : -1;
+            if (idx < 0)
+                break;
+            c->fetching++;
+            c->slots[idx].block = b;
+            c->slots[idx].referenced = c->slots[idx].loading = 1;
+            c->slot_of[b] = idx;
+            iov[n].iov_base = slot_buffer(c, idx);
+            iov[n].iov_len = c->disk->block_size;
+        }
+        if (n == 0)
+            break;
+
+        pthread_mutex_unlock(&c->lock);
+        failed = blocks_readv(c->disk, first, iov, n) < 0;
+        for (int i = 0; i < n; i++)
+            bad[i] = failed || !sum_ok(c, first + i, iov[i].iov_base);
+        pthread_mutex_lock(&c->lock);
+
+        for (int i = first; i < first + n; i++) {
+            if (bad[i - first])
+                unclaim(c, c->slot_of[i]);
+            else
+                c->slots[c->slot_of[i]].loading = 0;
+        }
+        c->fetching -= n;
+        pthread_cond_broadcast(&c->loaded);
+        if (failed)
+            break;
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    return 0;
+}
+
+int cache_fetch(Cache * c, AioQueue * q, const CacheRun * runs, int nruns)
+{
+    AioRequest * reqs, ** ptrs;
+    struct iovec * iov;
+    char * bad;
+    int limit = c->size / 2, n = 0, nreq = 0, sent = 0, finished = 0, k,
+        full = 0;
+
+    if (c->mapped || q == NULL) {
+        for (int i = 0; i < nruns; i++)
+            cache_prefetch(c, runs[i].block, runs[i].count);
+        return 0;
+    }
+
+    reqs = malloc(limit * sizeof(AioRequest));
+    ptrs = malloc(2 * limit * sizeof(AioRequest *));
+    iov = malloc(limit * sizeof(struct iovec));
+    bad = malloc(limit);
+    if (!reqs || !ptrs || !iov || !bad || limit == 0) {
+        free(reqs);
+        free(ptrs);
+        free(iov);
+        free(bad);
+        return -1;
+    }
+
+    // claim slots for the uncached blocks, one request per stretch of them
+    pthread_mutex_lock(&c->lock);
+    for (int i = 0; i < nruns && n < limit && !full; i++) {
+        int b = runs[i].block, end = b + runs[i].count;
+        if (b < 0 || end > c->disk_blocks)
+            break;
+        for (AioRequest * req = NULL; b < end && n < limit; b++) {
+            int idx;
+            if (c->slot_of[b] != CACHE_EMPTY) {
+                req = NULL;
+                continue;
+            }
+            if (c->fetching >= FETCH_SLOTS(c) || (idx = evict(c, 0)) < 0) {
+                full = 1;
+                break;
+            }
+            c->fetching++;
+            c->slots[idx].block = b;
+            c->slots[idx].referenced = c->slots[idx].loading = 1;
+            c->slot_of[b] = idx;
+            iov[n].iov_base = slot_buffer(c, idx);
+            iov[n].iov_len = c->disk->block_size;
+
+            if (req == NULL || req->iovcnt == CACHE_RUN) {
+                req = &reqs[nreq];
+                req->op = AIO_READ;
+                req->block = b;
+                req->iov = &iov[n];
+                req->iovcnt = 0;
+                ptrs[nreq++] = req;
+            }
+            req->iovcnt++;
+            n++;
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    // keep the queue full until every request is back
+    while (finished < nreq) {
+        if (sent < nreq) {
+            if ((k = aio_submit(q, ptrs + sent, nreq - sent)) < 0) {
+                for (int i = sent; i < nreq; i++)
+                    ptrs[i]->result = -1;
+                finished += nreq - sent;
+                sent = nreq;
+                k = 0;
+            }
+            sent += k;
+        }
+        if (aio_inflight(q) > 0)
+            finished += aio_reap(q, ptrs + limit, 1, limit);
+    }
+
+    for (int i = 0; i < nreq; i++) {
+        for (int j = 0; j < reqs[i].iovcnt; j++) {
+            int at = reqs[i].iov - iov + j;
+            bad[at] = reqs[i].result < 0
+                || !sum_ok(c, reqs[i].block + j, iov[at].iov_base);
+        }
+    }
+
+    pthread_mutex_lock(&c->lock);
+    for (int i = 0; i < nreq; i++) {
+        for (int b = reqs[i].block; b < reqs[i].block + reqs[i].iovcnt; b++) {
+            if (bad[reqs[i].iov - iov + b - reqs[i].block])
+                unclaim(c, c->slot_of[b]);
+            else
+                c->slots[c->slot_of[b]].loading = 0;
+        }
+    }
+    c->fetching -= n;
+    pthread_cond_broadcast(&c->loaded);
+    pthread_mutex_unlock(&c->lock);
+
+    free(reqs);
+    free(ptrs);
+    free(iov);
+    free(bad);
+    return 0;
+}
+
+int cache_sync(Cache * c)
+{
+    int ret = 0;
+
+    // walking by block number writes back runs in disk order
+    pthread_mutex_lock(&c->lock);
+    for (int b = 0; b < c->disk_blocks && !c->mapped; b++) {
+        if (is_dirty(c, b) && write_back(c, c->slot_of[b]) < 0) {
+            ret = -1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+    return ret;
+}
+
+void cache_set_sums(Cache * c, uint32_t * sums, char * dirty)
+{
+    pthread_mutex_lock(&c->lock);
+    c->sums = sums;
+    c->sums_dirty = dirty;
+    pthread_mutex_unlock(&c->lock);
+}
+
+uint32_t cache_sum(Cache * c, int block, const char * buf)
+{
+    uint32_t sum = crc32c(block, buf, c->disk->block_size);
+
+    return sum != SUM_UNKNOWN ? sum : 1;
+}
+
+void cache_set_sum(Cache * c, int block, const char * buf)
+{
+    if (c->sums != NULL && (block >= 0) && (block < c->disk_blocks))
+        set_sum(c, block, cache_sum(c, block, buf));
+}
+
+int cache_scrub(Cache * c, int block, char * buf)
+{
+    int idx, ret = 1;
+
+    if ((block < 0) || (block >= c->disk_blocks) || c->sums == NULL)
+        return -1;
+
+    // most blocks pass without holding anyone up
+    if (block_read(c->disk, block, buf) < 0)
+        return -1;
+    if (cache_sum(c, block, buf) == c->sums[block])
+        return 1;
+
+    // a block being written back changes under the read, and its checksum
+    // with it; nothing is written back while the lock is held
+    pthread_mutex_lock(&c->lock);
+    if ((idx = c->slot_of[block]) == CACHE_EMPTY) {
+        if (block_read(c->disk, block, buf) < 0)
+            ret = -1;
+        else if (c->sums[block] == SUM_UNKNOWN)
+            set_sum(c, block, cache_sum(c, block, buf));
+        else
+            ret = sum_ok(c, block, buf);
+    } else if (c->sums[block] == SUM_UNKNOWN && !c->slots[idx].dirty
+            && !c->slots[idx].loading) {
+        // a clean cached copy is what's on the disk
+        set_sum(c, block, cache_sum(c, block, slot_buffer(c, idx)));
+    }
+    pthread_mutex_unlock(&c->lock);
+    return ret;
+}
+
+void cache_destroy(Cache * c)
+{
+    // never set up, or already torn down
+    if (c->disk == NULL)
+        return;
+
+    free(c->slots);
+    free(c->buffers);
+    free(c->slot_of);
+    pthread_mutex_destroy(&c->lock);
+    pthread_cond_destroy(&c->loaded);
+    memset(c, 0, sizeof(Cache));
+}
@@ -0,0 +1,127 @@
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "disk.h"
+#include "aio.h"
+
+/******************************************************************************/
+#define CACHE_BYTES  (2 << 20) /* memory filesystem.c gives the cache         */
+#define CACHE_RUN    64        /* most blocks moved in one disk call          */
+
+/* how cache_get should treat the block                                       */
+#define CACHE_READ      0      /* read it from disk if it isn't cached        */
+#define CACHE_WRITE     1      /* same, and mark it dirty                     */
+#define CACHE_OVERWRITE 2      /* caller rewrites all of it: skip the read    */
+#define CACHE_ZERO      3      /* zero-fill it and mark it dirty              */
+
+#define CACHE_EMPTY    -1
+#define SUM_UNKNOWN     0      /* no checksum for the block, see below        */
+
+/* CacheSlot -- one cached block
+ * block: disk block held here, CACHE_EMPTY when the slot is unused
+ * dirty: block has to be written back before the slot is reused
+ * referenced: CLOCK bit, set on every hit and cleared as the hand passes
+ * pins: cache_get calls not yet matched by cache_put. A pinned slot is
+ *       never evicted or written back, its owner may be changing it
+ * loading: the block is being read in with the lock dropped; anyone
+ *          else who wants it waits on 'loaded'
+ */
+typedef struct {
+    int block;
+    int dirty;
+    int referenced;
+    int pins;
+    int loading;
+} CacheSlot;
+
+/* CacheRun -- count consecutive blocks from block on, see cache_fetch */
+typedef struct {
+    int block;
+    int count;
+} CacheRun;
+
+/* Cache -- the block cache of one disk
+ * slots, buffers: size slots, block_size bytes of buffer for each
+ * slot_of: disk block -> slot, or CACHE_EMPTY
+ * mapped: disk is mmap'd, blocks are handed out of the mapping
+ * hits, misses: cache_get calls that found their block cached, and those
+ *               that had to read it in or claim a slot for it. Bumped
+ *               atomically so they can be read without the lock
+ * sums: NULL, or the checksum of every disk block as it is on disk,
+ *       SUM_UNKNOWN for those without one. Blocks read in are checked
+ *       against it and fail the read if they don't match; blocks written
+ *       back update it, setting sums_dirty[b / (block_size / 4)] when
+ *       sums[b] changes. sum_errors counts the blocks that failed
+ * fetching: slots cache_prefetch and cache_fetch have claimed and are
+ *           still reading in, for the whole cache however many call them
+ * waiting: cache_get calls waiting on 'loaded' for a slot to unpin
+ * lock: guards everything else. Disk reads happen with it dropped; write
+ *       back of evicted blocks happens with it held
+ */
+typedef struct {
+    Disk * disk;
+    CacheSlot * slots;
+    char * buffers;
+    int * slot_of;
+    int size;
+    int disk_blocks;
+    int clock_hand;
+    int mapped;
+    int fetching;
+    int waiting;
+    uint64_t hits;
+    uint64_t misses;
+    uint32_t * sums;
+    char * sums_dirty;
+    uint64_t sum_errors;
+    pthread_mutex_t lock;
+    pthread_cond_t loaded;
+} Cache;
+
+/******************************************************************************/
+int cache_init(Cache * c, Disk * disk, int nblocks);
+                               /* set up an empty cache of nblocks blocks for
+                                  the open disk                               */
+char * cache_get(Cache * c, int block, int mode);
+                               /* block_size buffer holding block, pinned in
+                                  the cache until the matching cache_put.
+                                  Waits for a slot when all are pinned        */
+void cache_put(Cache * c, int block);
+                               /* unpin a block returned by cache_get         */
+int cache_zero(Cache * c, int block);
+                               /* zero-fill a block without keeping it pinned */
+void cache_discard(Cache * c, int block);
+                               /* forget a block without writing it back      */
+int cache_prefetch(Cache * c, int block, int count);
+                               /* read the uncached ones among count blocks
+                                  from block on, one disk call per run, as
+                                  far as the cache can spare slots            */
+int cache_fetch(Cache * c, AioQueue * q, const CacheRun * runs, int nruns);
+                               /* read the uncached blocks of every run with
+                                  all of them in flight on q at once, while
+                                  read-ahead holds under half the cache       */
+int cache_sync(Cache * c);     /* write back every dirty block, one disk call
+                                  per run of adjacent blocks                  */
+void cache_set_sums(Cache * c, uint32_t * sums, char * dirty);
+                               /* check and keep the checksums in sums from
+                                  now on, or stop if it's NULL                */
+uint32_t cache_sum(Cache * c, int block, const char * buf);
+                               /* the checksum of block holding buf: its
+                                  CRC32C seeded with the block number, so a
+                                  block written to the wrong place fails too,
+                                  and never SUM_UNKNOWN                       */
+void cache_set_sum(Cache * c, int block, const char * buf);
+                               /* make buf block's checksum, for a block
+                                  written around the cache                    */
+int cache_scrub(Cache * c, int block, char * buf);
+                               /* check block on disk against its checksum,
+                                  reading it into buf, unless it's cached;
+                                  one without a checksum gets one. 0 if it's
+                                  damaged, -1 if it couldn't be read          */
+void cache_destroy(Cache * c); /* free the cache, dropping dirty blocks       */
+/******************************************************************************/
+
+#endif
@@ -0,0 +1,251 @@
+#include <pthread.h>
+#include <string.h>
+
+#include "crc32c.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+/******************************************************************************/
+/* the polynomial, bit reversed. The hardware path runs three streams at
+ * once, since the instruction takes three cycles but can start one every
+ * cycle, and then shifts the first two over the bytes that followed them
+ * with the zeros tables: LONG and SHORT byte streams on big buffers, one
+ * stream on the rest. Where there is VPCLMULQDQ, buffers of FOLD bytes or
+ * more are instead folded 64 bytes a multiply, see crc_fold                  */
+#define POLY 0x82f63b78
+#define LONG 8192
+#define SHORT 256
+#define FOLD 256
+#define FOLD_TARGET "avx512f,pclmul,vpclmulqdq,sse4.2"
+
+static uint32_t table[8][256];         /* slicing-by-8, table[0] bytewise     */
+static uint32_t long_zeros[4][256];    /* crc -> crc after LONG zero bytes    */
+static uint32_t short_zeros[4][256];   /* same after SHORT zero bytes         */
+static uint64_t fold_keys[3][2];       /* x^(d+63), x^(d-1) mod POLY for d of
+                                          8 * FOLD, 512 and 128 bits          */
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static uint32_t (*crc_fn)(uint32_t crc, const unsigned char *p, size_t n);
+
+static uint64_t load64(const unsigned char *p)
+{
+  uint64_t v;
+
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+/* gf2_times, gf2_square -- a 32x32 matrix over GF(2), a column per word,
+ * times a vector; and a matrix squared                                       */
+static uint32_t gf2_times(const uint32_t *mat, uint32_t vec)
+{
+  uint32_t sum = 0;
+
+  for (; vec; vec >>= 1, mat++)
+    if (vec & 1)
+      sum ^= *mat;
+  return sum;
+}
+
+static void gf2_square(uint32_t *square, const uint32_t *mat)
+{
+  for (int n = 0; n < 32; n++)
+    square[n] = gf2_times(mat, mat[n]);
+}
+
+/* make_zeros -- tables taking a crc to what it is after len more zero
+ * bytes, len a power of two. Squaring the one zero bit operator doubles
+ * the zeros it stands for                                                    */
+static void make_zeros(uint32_t zeros[4][256], size_t len)
+{
+  uint32_t odd[32], even[32], *op = even;
+
+  odd[0] = POLY;
+  for (int n = 1; n < 32; n++)
+    odd[n] = 1u << (n - 1);
+  gf2_square(even, odd);
+  gf2_square(odd, even);
+  // odd is four zero bits now, the first square below makes a byte
+  for (;;) {
+    gf2_square(even, odd);
+    op = even;
+    if ((len >>= 1) == 0)
+      break;
+    gf2_square(odd, even);
+    op = odd;
+    if ((len >>= 1) == 0)
+      break;
+  }
+  for (int n = 0; n < 256; n++)
+    for (int k = 0; k < 4; k++)
+      zeros[k][n] = gf2_times(op, (uint32_t) n << (8 * k));
+}
+
+static uint32_t shift(uint32_t zeros[4][256], uint32_t crc)
+{
+  return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff]
+    ^ zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+/* fold_key -- x^k mod POLY, bit reflected into the top half of a word the
+ * way carry-less multiplies take it                                          */
+static uint64_t fold_key(int k)
+{
+  uint32_t v = 1, r = 0;
+
+  // POLY unreflected, the usual way round to take a remainder
+  for (; k > 0; k--)
+    v = v & 0x80000000 ? (v << 1) ^ 0x1edc6f41 : v << 1;
+  for (int n = 0; n < 32; n++)
+    r |= ((v >> n) & 1) << (31 - n);
+  return (uint64_t) r << 32;
+}
+
+/******************************************************************************/
+static uint32_t crc_sw(uint32_t crc, const unsigned char *p, size_t n)
+{
+  for (; n > 0 && ((uintptr_t) p & 7); n--)
+    crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  // the eight bytes picked apart one by one, whatever the byte order
+  for (; n >= 8; n -= 8, p += 8) {
+    uint32_t lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24);
+    crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff]
+      ^ table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24]
+      ^ table[3][p[4]] ^ table[2][p[5]] ^ table[1][p[6]] ^ table[0][p[7]];
+  }
+  for (; n > 0; n--)
+    crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc_hw(uint32_t crc, const unsigned char *p, size_t n)
+{
+  uint64_t c0 = crc, c1, c2;
+  const unsigned char *end;
+
+  for (; n > 0 && ((uintptr_t) p & 7); n--)
+    c0 = _mm_crc32_u8(c0, *p++);
+  for (; n >= 3 * LONG; n -= 3 * LONG, p += 2 * LONG) {
+    for (c1 = c2 = 0, end = p + LONG; p < end; p += 8) {
+      c0 = _mm_crc32_u64(c0, load64(p));
+      c1 = _mm_crc32_u64(c1, load64(p + LONG));
+      c2 = _mm_crc32_u64(c2, load64(p + 2 * LONG));
+    }
+    c0 = shift(long_zeros, c0) ^ c1;
+    c0 = shift(long_zeros, c0) ^ c2;
+  }
+  for (; n >= 3 * SHORT; n -= 3 * SHORT, p += 2 * SHORT) {
+    for (c1 = c2 = 0, end = p + SHORT; p < end; p += 8) {
+      c0 = _mm_crc32_u64(c0, load64(p));
+      c1 = _mm_crc32_u64(c1, load64(p + SHORT));
+      c2 = _mm_crc32_u64(c2, load64(p + 2 * SHORT));
+    }
+    c0 = shift(short_zeros, c0) ^ c1;
+    c0 = shift(short_zeros, c0) ^ c2;
+  }
+  for (; n >= 8; n -= 8, p += 8)
+    c0 = _mm_crc32_u64(c0, load64(p));
+  for (; n > 0; n--)
+    c0 = _mm_crc32_u8(c0, *p++);
+  return c0;
+}
+
+/* fold512, fold128 -- take 16 byte lanes d bits further on, where they
+ * xor into next: their halves times x^(d+64) and x^d mod POLY leave the
+ * same remainder. The keys are an x short, which a reflected multiply adds */
+__attribute__((target(FOLD_TARGET)))
+static __m512i fold512(__m512i x, __m512i keys, __m512i next)
+{
+  return _mm512_ternarylogic_epi64(_mm512_clmulepi64_epi128(x, keys, 0x00),
+      _mm512_clmulepi64_epi128(x, keys, 0x11), next, 0x96);
+}
+
+__attribute__((target(FOLD_TARGET)))
+static __m128i fold128(__m128i x, __m128i next)
+{
+  __m128i keys = _mm_loadu_si128((const __m128i *) fold_keys[2]);
+
+  return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, keys, 0x00),
+        _mm_clmulepi64_si128(x, keys, 0x11)), next);
+}
+
+/* crc_fold -- four registers of four lanes go through FOLD bytes at a time
+ * and then fold down into one lane, which the crc32 instruction turns into
+ * the crc of everything before it                                            */
+__attribute__((target(FOLD_TARGET)))
+static uint32_t crc_fold(uint32_t crc, const unsigned char *p, size_t n)
+{
+  __m512i x[4], keys;
+  __m128i lane;
+  uint64_t c;
+
+  if (n < FOLD)
+    return crc_hw(crc, p, n);
+  for (int i = 0; i < 4; i++)
+    x[i] = _mm512_loadu_si512(p + 64 * i);
+  // a crc carried in is the same as those bits flipped in the first bytes
+  x[0] = _mm512_xor_si512(x[0],
+      _mm512_zextsi128_si512(_mm_cvtsi32_si128(crc)));
+  keys = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *) fold_keys));
+  for (p += FOLD, n -= FOLD; n >= FOLD; p += FOLD, n -= FOLD)
+    for (int i = 0; i < 4; i++)
+      x[i] = fold512(x[i], keys, _mm512_loadu_si512(p + 64 * i));
+
+  keys = _mm512_broadcast_i32x4(
+      _mm_loadu_si128((const __m128i *) fold_keys[1]));
+  for (int i = 1; i < 4; i++)
+    x[i] = fold512(x[i - 1], keys, x[i]);
+  lane = _mm512_extracti32x4_epi32(x[3], 0);
+  lane = fold128(lane, _mm512_extracti32x4_epi32(x[3], 1));
+  lane = fold128(lane, _mm512_extracti32x4_epi32(x[3], 2));
+  lane = fold128(lane, _mm512_extracti32x4_epi32(x[3], 3));
+  for (; n >= 16; p += 16, n -= 16)
+    lane = fold128(lane, _mm_loadu_si128((const __m128i *) p));
+
+  c = _mm_crc32_u64(0, _mm_cvtsi128_si64(lane));
+  c = _mm_crc32_u64(c, _mm_extract_epi64(lane, 1));
+  return crc_hw(c, p, n);
+}
+#endif
+
+static void init(void)
+{
+  for (uint32_t n = 0; n < 256; n++) {
+    uint32_t c = n;
+    for (int k = 0; k < 8; k++)
+      c = c & 1 ? (c >> 1) ^ POLY : c >> 1;
+    table[0][n] = c;
+  }
+  for (int n = 0; n < 256; n++)
+    for (int k = 1; k < 8; k++)
+      table[k][n] = table[0][table[k - 1][n] & 0xff] ^ (table[k - 1][n] >> 8);
+
+  crc_fn = crc_sw;
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("sse4.2")) {
+    make_zeros(long_zeros, LONG);
+    make_zeros(short_zeros, SHORT);
+    crc_fn = crc_hw;
+  }
+  if (crc_fn == crc_hw && __builtin_cpu_supports("avx512f")
+      && __builtin_cpu_supports("pclmul")
+      && __builtin_cpu_supports("vpclmulqdq")) {
+    int bits[3] = { 8 * FOLD, 512, 128 };
+    for (int i = 0; i < 3; i++) {
+      fold_keys[i][0] = fold_key(bits[i] + 63);
+      fold_keys[i][1] = fold_key(bits[i] - 1);
+    }
+    crc_fn = crc_fold;
+  }
+#endif
+}
+
+/******************************************************************************/
+uint32_t crc32c(uint32_t crc, const void *buf, size_t n)
+{
+  pthread_once(&once, init);
+  return ~crc_fn(~crc, buf, n);
+}
@@ -0,0 +1,19 @@
+#ifndef _CRC32C_H_
+#define _CRC32C_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/******************************************************************************/
+/* CRC32C, the CRC with the Castagnoli polynomial that iSCSI and ext4 use.
+ * On x86 CPUs with SSE4.2 it runs on the crc32 instruction, with AVX-512
+ * VPCLMULQDQ on carry-less multiplies 64 bytes at a time, otherwise on
+ * lookup tables eight bytes at a time; the first call picks which            */
+/******************************************************************************/
+uint32_t crc32c(uint32_t crc, const void *buf, size_t n);
+                               /* crc carried on over n bytes of buf. Start
+                                  from 0, or from any value to tell apart the
+                                  same bytes in different places              */
+/******************************************************************************/
+
+#endif
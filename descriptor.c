@@ -1,17 +1,63 @@
 #include "filesystem.h"
 
-#define MAX_OPEN_FILES 32
 #define DESCRIPTOR_UNUSED -1
 
 /* Descriptor -- file descriptor for an open file
  * Don't store this struct on disk! Generate it on the fly
- * descriptor: file descriptor (0-31)
- * ptr: where the next read/write should occur in this file
+ * descriptor: file descriptor, same as its slot in 'descriptors', or
+ *             DESCRIPTOR_UNUSED for a free slot
+ * attr, parent: the file's entry and the directory holding it
+ * offset: logical byte offset where the next read/write should occur
+ * block: physical block the cursor is in. On a block boundary the cursor
+ *        stays in the previous block until there's something to read or
+ *        write past it, so block_num is (offset - 1) / BLOCK_SIZE (or 0)
+ * block_num: logical block number of the cursor's block within the file
+ * hole: 0, or how many blocks past 'block' the cursor is when it's in a
+ *       hole, 'block' being the last one before the hole
+ * index: optional block map, index[n] is the physical block of logical
+ *        block n for the first 'index_size' blocks, see fs_set_block_index.
+ *        index_capacity is -1 on a copy that borrows the index, which
+ *        then never grows
+ * ra_offset: where the last read ended, a read starting there is sequential
+ * ra_window: blocks read ahead past each sequential read, 0 after a random
+ *            one
+ * ra_next: logical block at which the next batch gets read in
+ * wbuf: appends not written to the file yet, wbuf_len bytes of them. They
+ *       go after 'offset', which stays at the file's on-disk size until
+ *       they are flushed. wbuf_blocks is how many blocks they will take
+ * wbuf_error: a flush of wbuf for the whole mount or for the file failed,
+ *             for the next fs_write, fs_fsync or fs_close on this
+ *             descriptor to report
+ * cow_private, cow_tail: the first cow_private blocks of the file are its
+ *       own, shared with no other file, the last of them being cow_tail.
+ *       Only ever an underestimate, see unshare()
+ * zbuf: on a compressed file, cluster zbuf_cluster unpacked, or -1 for
+ *       none, with room after it to pack it into. zbuf_dirty is set while
+ *       it holds writes that aren't packed into the file yet
+ * next_free: next slot on the free list while this one is unused
  */
 typedef struct {
     int descriptor;
     Attribute * attr;
-    char * ptr;
+    Directory * parent;
+    int offset;
+    int block;
+    int block_num;
+    int hole;
+    int * index;
+    int index_size;
+    int index_capacity;
+    int ra_offset;
+    int ra_window;
+    int ra_next;
+    char * wbuf;
+    int wbuf_len;
+    int wbuf_blocks;
+    int wbuf_error;
+    int cow_private;
+    int cow_tail;
+    char * zbuf;
+    int zbuf_cluster;
+    int zbuf_dirty;
+    int next_free;
 } Descriptor;
-
-Descriptor descriptors[MAX_OPEN_FILES];
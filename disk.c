@@ -1,125 +1,372 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <unistd.h>
-#include <fcntl.h>
-#include <string.h>
-
-#include "disk.h"
-
-/******************************************************************************/
-static int active = 0;  /* is the virtual disk open (active) */
-static int handle;      /* file handle to virtual disk       */
-
-/******************************************************************************/
-int make_disk(char *name)
-{ 
-  int f, cnt;
-  char buf[BLOCK_SIZE];
-
-  if (!name) {
-    fprintf(stderr, "make_disk: invalid file name\n");
-    return -1;
-  }
-
-  if ((f = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
-    perror("make_disk: cannot open file");
-    return -1;
-  }
-
-  memset(buf, 0, BLOCK_SIZE);
-  for (cnt = 0; cnt < DISK_BLOCKS; ++cnt)
-    write(f, buf, BLOCK_SIZE);
-
-  close(f);
-
-  return 0;
-}
-
-int open_disk(char *name)
-{
-  int f;
-
-  if (!name) {
-    fprintf(stderr, "open_disk: invalid file name\n");
-    return -1;
-  }  
-  
-  if (active) {
-    fprintf(stderr, "open_disk: disk is already open\n");
-    return -1;
-  }
-  
-  if ((f = open(name, O_RDWR, 0644)) < 0) {
-    perror("open_disk: cannot open file");
-    return -1;
-  }
-
-  handle = f;
-  active = 1;
-
-  return 0;
-}
-
-int close_disk()
-{
-  if (!active) {
-    fprintf(stderr, "close_disk: no open disk\n");
-    return -1;
-  }
-  
-  close(handle);
-
-  active = handle = 0;
-
-  return 0;
-}
-
-int block_write(int block, char *buf)
-{
-  if (!active) {
-    fprintf(stderr, "block_write: disk not active\n");
-    return -1;
-  }
-
-  if ((block < 0) || (block >= DISK_BLOCKS)) {
-    fprintf(stderr, "block_write: block index out of bounds\n");
-    return -1;
-  }
-
-  if (lseek(handle, block * BLOCK_SIZE, SEEK_SET) < 0) {
-    perror("block_write: failed to lseek");
-    return -1;
-  }
-
-  if (write(handle, buf, BLOCK_SIZE) < 0) {
-    perror("block_write: failed to write");
-    return -1;
-  }
-
-  return 0;
-}
-
-int block_read(int block, char *buf)
-{
-  if (!active) {
-    fprintf(stderr, "block_read: disk not active\n");
-    return -1;
-  }
-
-  if ((block < 0) || (block >= DISK_BLOCKS)) {
-    fprintf(stderr, "block_read: block index out of bounds\n");
-    return -1;
-  }
-
-  if (lseek(handle, block * BLOCK_SIZE, SEEK_SET) < 0) {
-    perror("block_read: failed to lseek");
-    return -1;
-  }
-
-  if (read(handle, buf, BLOCK_SIZE) < 0) {
-    perror("block_read: failed to read");
-    return -1;
-  }
-
-  return 0;
-}
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "disk.h"
+
+/******************************************************************************/
+#define DISK_IOV_MAX 64 /* buffers handed to one preadv/pwritev */
+
+#define COUNT(counter, n) __atomic_add_fetch(&(counter), (n), __ATOMIC_RELAXED)
+
+/******************************************************************************/
+int make_disk(char *name)
+{
+  return make_disk_geometry(name, DEFAULT_DISK_BLOCKS, DEFAULT_BLOCK_SIZE);
+}
+
+int make_disk_geometry(char *name, int blocks, int size)
+{
+  int f;
+
+  if (!name) {
+    fprintf(stderr, "make_disk: invalid file name\n");
+    return -1;
+  }
+
+  if ((blocks <= 0) || (size < MIN_BLOCK_SIZE) || (size > MAX_BLOCK_SIZE)
+      || (size & (size - 1))) {
+    fprintf(stderr, "make_disk: invalid geometry\n");
+    return -1;
+  }
+
+  if ((f = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+    perror("make_disk: cannot open file");
+    return -1;
+  }
+
+  // a sparse file: blocks nobody writes read back as zeros and take no space
+  if (ftruncate(f, (off_t) blocks * size) < 0) {
+    perror("make_disk: cannot size file");
+    close(f);
+    return -1;
+  }
+
+  close(f);
+
+  return 0;
+}
+
+int open_disk(Disk *disk, char *name)
+{
+  return open_disk_mode(disk, name, DISK_FILE);
+}
+
+int open_disk_mode(Disk *disk, char *name, int mode)
+{
+  int f;
+  struct stat st;
+
+  if (!name) {
+    fprintf(stderr, "open_disk: invalid file name\n");
+    return -1;
+  }
+
+  if (disk->active) {
+    fprintf(stderr, "open_disk: disk is already open\n");
+    return -1;
+  }
+
+  if ((f = open(name, O_RDWR, 0644)) < 0) {
+    perror("open_disk: cannot open file");
+    return -1;
+  }
+
+  if (fstat(f, &st) < 0 || st.st_size < MIN_BLOCK_SIZE) {
+    fprintf(stderr, "open_disk: file is too small to be a disk\n");
+    close(f);
+    return -1;
+  }
+  disk->size = st.st_size;
+
+  // until the caller knows better, assume the default block size
+  disk->block_size = DEFAULT_BLOCK_SIZE;
+  disk->blocks = disk->size / disk->block_size;
+
+  if (mode == DISK_MMAP) {
+    // the whole file is mapped, so any geometry that fits in it works
+    disk->map = mmap(NULL, (size_t) disk->size,
+        PROT_READ | PROT_WRITE, MAP_SHARED, f, 0);
+    if (disk->map == MAP_FAILED) {
+      perror("open_disk: cannot map file");
+      disk->map = NULL;
+      close(f);
+      return -1;
+    }
+    if ((disk->dirty = calloc(disk->blocks, 1)) == NULL) {
+      fprintf(stderr, "open_disk: out of memory\n");
+      munmap(disk->map, (size_t) disk->size);
+      disk->map = NULL;
+      close(f);
+      return -1;
+    }
+  }
+
+  disk->handle = f;
+  disk->active = 1;
+
+  return 0;
+}
+
+int close_disk(Disk *disk)
+{
+  if (!disk->active) {
+    fprintf(stderr, "close_disk: no open disk\n");
+    return -1;
+  }
+
+  if (disk->map) {
+    sync_disk(disk);
+    munmap(disk->map, (size_t) disk->size);
+    free(disk->dirty);
+    disk->map = disk->dirty = NULL;
+  }
+  close(disk->handle);
+
+  disk->active = disk->handle = 0;
+  disk->blocks = DEFAULT_DISK_BLOCKS;
+  disk->block_size = DEFAULT_BLOCK_SIZE;
+
+  return 0;
+}
+
+int set_disk_geometry(Disk *disk, int blocks, int size)
+{
+  char *d;
+
+  if (!disk->active) {
+    fprintf(stderr, "set_disk_geometry: no open disk\n");
+    return -1;
+  }
+
+  if ((blocks <= 0) || (size < MIN_BLOCK_SIZE) || (size > MAX_BLOCK_SIZE)
+      || (size & (size - 1)) || ((off_t) blocks * size > disk->size)) {
+    fprintf(stderr, "set_disk_geometry: invalid geometry\n");
+    return -1;
+  }
+
+  // dirty marks are per block, so they can't carry over
+  if (disk->map) {
+    if (sync_disk(disk) < 0)
+      return -1;
+    if ((d = realloc(disk->dirty, blocks)) == NULL) {
+      fprintf(stderr, "set_disk_geometry: out of memory\n");
+      return -1;
+    }
+    disk->dirty = d;
+    memset(disk->dirty, 0, blocks);
+  }
+
+  disk->blocks = blocks;
+  disk->block_size = size;
+
+  return 0;
+}
+
+int sync_disk(Disk *disk)
+{
+  int start, end;
+  size_t lo, page = sysconf(_SC_PAGESIZE);
+
+  if (!disk->active) {
+    fprintf(stderr, "sync_disk: no open disk\n");
+    return -1;
+  }
+
+  COUNT(disk->syncs, 1);
+  if (!disk->map) {
+    COUNT(disk->syscalls, 1);
+    if (fsync(disk->handle) < 0) {
+      perror("sync_disk: failed to fsync");
+      return -1;
+    }
+    return 0;
+  }
+
+  // one msync per run of dirty blocks
+  for (start = 0; start < disk->blocks; start = end) {
+    if (!disk->dirty[start]) {
+      end = start + 1;
+      continue;
+    }
+    for (end = start; end < disk->blocks && disk->dirty[end]; end++)
+      disk->dirty[end] = 0;
+    // msync wants a page aligned address, blocks may be smaller than pages
+    lo = (size_t) start * disk->block_size / page * page;
+    COUNT(disk->syscalls, 1);
+    if (msync(disk->map + lo, (size_t) end * disk->block_size - lo,
+          MS_SYNC) < 0) {
+      perror("sync_disk: failed to msync");
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/* moves the blocks starting at block between the disk and iov, whose
+ * lengths must add up to a whole number of blocks. Positional calls, one
+ * per DISK_IOV_MAX buffers, picking up where a short transfer stopped */
+static int rw_blocks(Disk *disk, const char *who, int block,
+    const struct iovec *iov, int iovcnt, int write)
+{
+  struct iovec vec[DISK_IOV_MAX];
+  size_t total = 0;
+  off_t off;
+  ssize_t n;
+  int i, cnt;
+
+  if (!disk->active) {
+    fprintf(stderr, "%s: disk not active\n", who);
+    return -1;
+  }
+
+  for (i = 0; i < iovcnt; i++)
+    total += iov[i].iov_len;
+  if ((block < 0) || (total % disk->block_size)
+      || (total / disk->block_size > (size_t) (disk->blocks - block))) {
+    fprintf(stderr, "%s: block index out of bounds\n", who);
+    return -1;
+  }
+  off = (off_t) block * disk->block_size;
+  if (write)
+    COUNT(disk->blocks_written, total / disk->block_size);
+  else
+    COUNT(disk->blocks_read, total / disk->block_size);
+
+  if (disk->map) {
+    for (i = 0; i < iovcnt; off += iov[i].iov_len, i++) {
+      // buf may already be the mapped block itself
+      if ((char *) iov[i].iov_base == disk->map + off)
+        continue;
+      if (write)
+        memcpy(disk->map + off, iov[i].iov_base, iov[i].iov_len);
+      else
+        memcpy(iov[i].iov_base, disk->map + off, iov[i].iov_len);
+    }
+    if (write)
+      block_dirty(disk, block, total / disk->block_size);
+    return 0;
+  }
+
+  while (iovcnt > 0) {
+    cnt = iovcnt < DISK_IOV_MAX ? iovcnt : DISK_IOV_MAX;
+    memcpy(vec, iov, cnt * sizeof(struct iovec));
+    iov += cnt;
+    iovcnt -= cnt;
+
+    for (i = 0; i < cnt; ) {
+      COUNT(disk->syscalls, 1);
+      if (write)
+        n = cnt - i == 1
+          ? pwrite(disk->handle, vec[i].iov_base, vec[i].iov_len, off)
+          : pwritev(disk->handle, vec + i, cnt - i, off);
+      else
+        n = cnt - i == 1
+          ? pread(disk->handle, vec[i].iov_base, vec[i].iov_len, off)
+          : preadv(disk->handle, vec + i, cnt - i, off);
+
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0) {
+        fprintf(stderr, "%s: failed to %s: %s\n", who, 
+            write ? "write" : "read", strerror(errno));
+        return -1;
+      }
+      if (n == 0) {
+        fprintf(stderr, "%s: unexpected end of file\n", who);
+        return -1;
+      }
+
+      // skip what made it, then retry from the middle of a buffer
+      off += n;
+      while (i < cnt && (size_t) n >= vec[i].iov_len)
+        n -= vec[i++].iov_len;
+      if (i < cnt) {
+        vec[i].iov_base = (char *) vec[i].iov_base + n;
+        vec[i].iov_len -= n;
+      }
+    }
+  }
+
+  return 0;
+}
+
+int block_write(Disk *disk, int block, char *buf)
+{
+  return blocks_write(disk, block, 1, buf);
+}
+
+int block_read(Disk *disk, int block, char *buf)
+{
+  return blocks_read(disk, block, 1, buf);
+}
+
+int blocks_write(Disk *disk, int block, int count, char *buf)
+{
+  struct iovec iov = { buf, (size_t) count * disk->block_size };
+
+  if (count < 0) {
+    fprintf(stderr, "blocks_write: negative block count\n");
+    return -1;
+  }
+  return rw_blocks(disk, "blocks_write", block, &iov, 1, 1);
+}
+
+int blocks_read(Disk *disk, int block, int count, char *buf)
+{
+  struct iovec iov = { buf, (size_t) count * disk->block_size };
+
+  if (count < 0) {
+    fprintf(stderr, "blocks_read: negative block count\n");
+    return -1;
+  }
+  return rw_blocks(disk, "blocks_read", block, &iov, 1, 0);
+}
+
+int blocks_writev(Disk *disk, int block, const struct iovec *iov,
+    int iovcnt)
+{
+  return rw_blocks(disk, "blocks_writev", block, iov, iovcnt, 1);
+}
+
+int blocks_readv(Disk *disk, int block, const struct iovec *iov,
+    int iovcnt)
+{
+  return rw_blocks(disk, "blocks_readv", block, iov, iovcnt, 0);
+}
+
+char *block_map(Disk *disk, int block)
+{
+  if (!disk->map || (block < 0) || (block >= disk->blocks))
+    return NULL;
+
+  return disk->map + (size_t) block * disk->block_size;
+}
+
+void block_dirty(Disk *disk, int block, int count)
+{
+  if (!disk->map)
+    return;
+
+  for (; count > 0 && block < disk->blocks; count--, block++)
+    if (block >= 0)
+      __atomic_store_n(&disk->dirty[block], 1, __ATOMIC_RELAXED);
+}
+
+void block_advise(Disk *disk, int block, int count)
+{
+  if (!disk->map || (block < 0) || (count <= 0))
+    return;
+
+  if (block + count > disk->blocks)
+    count = disk->blocks - block;
+  madvise(disk->map + (size_t) block * disk->block_size,
+      (size_t) count * disk->block_size, MADV_WILLNEED);
+}
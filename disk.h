@@ -1,19 +1,74 @@
-#ifndef _DISK_H_
-#define _DISK_H_
-
-/******************************************************************************/
-#define DISK_BLOCKS  8192      /* number of blocks on the disk                */
-#define BLOCK_SIZE   4096      /* block size on "disk"                        */
-
-/******************************************************************************/
-int make_disk(char *name);     /* create an empty, virtual disk file          */
-int open_disk(char *name);     /* open a virtual disk (file)                  */
-int close_disk();              /* close a previously opened disk (file)       */
-
-int block_write(int block, char *buf);
-                               /* write a block of size BLOCK_SIZE to disk    */
-int block_read(int block, char *buf);
-                               /* read a block of size BLOCK_SIZE from disk   */
-/******************************************************************************/
-
+#ifndef _DISK_H_
+#define _DISK_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/******************************************************************************/
+#define DEFAULT_DISK_BLOCKS 8192  /* geometry make_disk uses                  */
+#define DEFAULT_BLOCK_SIZE  4096
+#define MIN_BLOCK_SIZE      512   /* block sizes are powers of two in between */
+#define MAX_BLOCK_SIZE      65536
+
+/* how open_disk_mode accesses the disk file                                  */
+#define DISK_FILE    0         /* lseek + read/write for every block          */
+#define DISK_MMAP    1         /* map the whole file MAP_SHARED               */
+
+/* Disk -- one open virtual disk. Zero it before the first open_disk; the
+ * same struct can be opened again after close_disk                           */
+typedef struct {
+  int active;                  /* is the virtual disk open (active)           */
+  int handle;                  /* file handle to virtual disk                 */
+  char *map;                   /* whole disk when opened DISK_MMAP            */
+  char *dirty;                 /* mapped blocks changed since sync            */
+  off_t size;                  /* size of the disk file in bytes              */
+  int blocks;                  /* geometry, set by open_disk and
+                                  set_disk_geometry                           */
+  int block_size;
+  uint64_t syscalls;           /* counters, bumped atomically: calls into
+                                  the OS moving or syncing blocks, io_uring
+                                  included                                    */
+  uint64_t blocks_read;        /* blocks moved by them                        */
+  uint64_t blocks_written;
+  uint64_t syncs;              /* sync_disk calls                             */
+} Disk;
+
+/******************************************************************************/
+int make_disk(char *name);     /* create an empty, virtual disk file          */
+int make_disk_geometry(char *name, int blocks, int size);
+                               /* same, holding blocks blocks of size bytes   */
+int open_disk(Disk *disk, char *name);
+                               /* open a virtual disk (file)                  */
+int open_disk_mode(Disk *disk, char *name, int mode);
+                               /* same, choosing DISK_FILE or DISK_MMAP       */
+int close_disk(Disk *disk);    /* close a previously opened disk (file)       */
+int set_disk_geometry(Disk *disk, int blocks, int size);
+                               /* address the open disk as blocks blocks of
+                                  size bytes; must fit in the file            */
+int sync_disk(Disk *disk);     /* flush written blocks to stable storage      */
+
+int block_write(Disk *disk, int block, char *buf);
+                               /* write a block of size block_size to disk    */
+int block_read(Disk *disk, int block, char *buf);
+                               /* read a block of size block_size from disk   */
+int blocks_write(Disk *disk, int block, int count, char *buf);
+                               /* write count consecutive blocks in one call  */
+int blocks_read(Disk *disk, int block, int count, char *buf);
+                               /* read count consecutive blocks in one call   */
+int blocks_writev(Disk *disk, int block, const struct iovec *iov, int iovcnt);
+                               /* write consecutive blocks from scattered
+                                  buffers adding up to whole blocks           */
+int blocks_readv(Disk *disk, int block, const struct iovec *iov, int iovcnt);
+                               /* read consecutive blocks into scattered
+                                  buffers adding up to whole blocks           */
+char *block_map(Disk *disk, int block);
+                               /* address of a block inside the mapping, NULL
+                                  unless the disk was opened with DISK_MMAP   */
+void block_dirty(Disk *disk, int block, int count);
+                               /* note mapped blocks changed in place         */
+void block_advise(Disk *disk, int block, int count);
+                               /* hint that mapped blocks are read next       */
+/******************************************************************************/
+
 #endif
\ No newline at end of file
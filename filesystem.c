@@ -1,604 +1,5327 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/uio.h>
 
 #include "filesystem.h"
+#include "cache.h"
+#include "lz.h"
 #include "descriptor.c"
 
-extern Descriptor descriptors[];
-int descriptor_size = 0;
+static int transfer(fs_t * fs, Descriptor * desc, struct iovec * iov,
+        int iovcnt, int write);
+static void index_block(Descriptor * desc, int block_num, int block);
+static int seek_block(fs_t * fs, Descriptor * desc, int block_num);
+static int fill_hole(fs_t * fs, Descriptor * desc, int block);
+static void reseat(fs_t * fs, Descriptor * desc);
+static int open_file(fs_t * fs, char * name);
+static int close_file(fs_t * fs, int fildes);
+static int delete_file(fs_t * fs, char * name);
+static int remove_directory(fs_t * fs, char * name);
+static int read_directory(fs_t * fs, char * name, int pos, Attribute * entry);
+static int seek_file(fs_t * fs, Descriptor * desc, off_t offset);
+static int seek_data(fs_t * fs, Descriptor * desc, off_t offset, int whence);
+static int truncate_file(fs_t * fs, int idx, off_t length);
+static int fallocate_file(fs_t * fs, int idx, off_t length);
+static int write_file(fs_t * fs, Descriptor * desc, struct iovec * iov,
+        int iovcnt);
+static int clone_file(fs_t * fs, char * src, char * dst);
+static int take_snapshot(fs_t * fs, char * name);
+static int copy_tree(fs_t * fs, Directory * from, Directory * to);
+static int drop_tree(fs_t * fs, Directory * d);
+static int tree_busy(fs_t * fs, Directory * d);
+static Directory * enter(fs_t * fs, Directory * d, int idx);
+static void forget_directory(fs_t * fs, Directory * d);
+static int valid_leaf(const char * leaf);
+static void append_entry(Directory * d, const char * name, int type, int head,
+        int size);
+static int append_file(fs_t * fs, Directory * to, const char * name,
+        Directory * from, int slot);
+static int unshare(fs_t * fs, Descriptor * desc, int last, off_t from,
+        off_t to);
+static int last_block(fs_t * fs, Attribute * attr);
+static int holes_after(fs_t * fs, int block);
+static int block_before(fs_t * fs, Attribute * attr, int block_num, int * num);
+static int grow_file(fs_t * fs, int idx, off_t length);
+static int read_only(Descriptor * desc, const char * call);
+static int too_large(off_t offset, size_t nbyte, const char * call);
+static int flush_buffer(fs_t * fs, Descriptor * desc);
+static int flush_buffers(fs_t * fs);
+static int transfer_inline(fs_t * fs, Descriptor * desc, struct iovec * iov,
+        size_t nbyte, int write);
+static int truncate_inline(fs_t * fs, Descriptor * desc, off_t length);
+static int materialize(fs_t * fs, Descriptor * desc);
+static int resize_data(fs_t * fs, Directory * d, int slot, int size);
+static int dir_blocks(fs_t * fs, Directory * d, int count);
+static void free_directory(Directory * d);
+static int flush_file(fs_t * fs, Attribute * attr);
+static int has_buffered(fs_t * fs, Descriptor * desc);
+static int file_buffered(fs_t * fs, Descriptor * desc);
+static int buffer_blocks(fs_t * fs, Descriptor * desc, size_t nbyte);
+static int take_error(Descriptor * desc);
+static int hold_blocks(fs_t * fs, Descriptor * desc, int blocks);
+static int transfer_at(fs_t * fs, fs_io_t * io);
+static int is_file(Attribute * attr);
+static int transfer_packed(fs_t * fs, Descriptor * desc, struct iovec * iov,
+        size_t nbyte, int write);
+static int cluster_bytes(Attribute * attr, int cluster);
+static int cluster_blocks(fs_t * fs, Descriptor * desc, int cluster,
+        int * blocks, int max);
+static int load_cluster(fs_t * fs, Descriptor * desc, int cluster);
+static int pack_cluster(fs_t * fs, Descriptor * desc);
+static int grow_clusters(fs_t * fs, Descriptor * desc, off_t length);
+static void dirty_cluster(fs_t * fs, Descriptor * desc);
+static int read_chain(fs_t * fs, int block, size_t nbyte);
+static size_t read_ahead_bytes(fs_t * fs, Descriptor * desc, int pos,
+        size_t nbyte);
+static AioQueue * get_aio(fs_t * fs);
+static void put_aio(fs_t * fs, AioQueue * q);
+static void stop_io(fs_t * fs);
+static fs_t * new_fs();
+static void free_fs(fs_t * fs);
+static int load_fs(fs_t * fs, char * disk_name, int mode);
+static int check_fat(fs_t * fs);
+static int journal_size(fs_t * fs);
+static int open_journal(fs_t * fs);
+static int journal_add(fs_t * fs, int block, char * buf);
+static int write_journal(fs_t * fs);
+static int log_metadata(fs_t * fs);
+static int log_blocks(fs_t * fs, int more);
+static int replay_journal(fs_t * fs);
+static int clear_journal(fs_t * fs);
+static int commit(fs_t * fs);
+static void release_freed(fs_t * fs);
+static int reclaim_space(fs_t * fs);
+static int avail_blocks(fs_t * fs);
+static int write_fildes(fs_t * fs, int fildes, const struct iovec * iov,
+        int iovcnt, size_t skip);
+static int resize_fildes(fs_t * fs, int fildes, off_t length,
+        int (* resize)(fs_t *, int, off_t));
+static void start_commits(fs_t * fs);
+static void stop_commits(fs_t * fs);
+static int load_sums(fs_t * fs);
+static void forget_sums(fs_t * fs);
+static void sum_metadata(fs_t * fs);
+static void * scrub_worker(void * arg);
+static void stop_scrub(fs_t * fs);
+static uint64_t stat_clock();
+static int stat_call(fs_t * fs, int op, uint64_t start, int ret,
+        size_t bytes);
 
 /* block size vars */
-const int SUPERBLOCK_BLOCK_SIZE
-    = (sizeof(Superblock) + BLOCK_SIZE - 1) / BLOCK_SIZE;
-const int FAT_BLOCK_SIZE 
-    = (sizeof(FAT) + BLOCK_SIZE - 1) / BLOCK_SIZE;
-const int DIRECTORY_BLOCK_SIZE 
-    = (sizeof(Directory) + BLOCK_SIZE - 1) / BLOCK_SIZE;
-
-/* disk structures ---------------------------------------------------------- */
-static char * disk;
-
-static Superblock * super;
-static FAT * fat;
-static Directory * dir;
-static char * data;
+const int SUPERBLOCK_BLOCK_SIZE = 1;    /* fits in the smallest block */
+const int DIRECTORY_BLOCK_SIZE = 1;     /* head of the directory chain */
+
+/* free-space bitmap -------------------------------------------------------- */
+/* one bit per FAT entry, set when the entry is anything but FAT_UNUSED.
+ * freemap_hint is the word where the next search starts; it never points
+ * past the lowest free block so allocation stays first-fit. A block freed
+ * since the last commit keeps its bit, and one in freeing, until the next
+ * commit is durable: the last one may still have it in use, and a crash
+ * before then goes back to that. Blocks in fresh were allocated since the
+ * last commit, which never saw them, so they are free again at once */
+#define FREEMAP_WORDS(fs) (((fs)->disk.blocks + 63) / 64)
+
+/* extent reservations: a growing file that had to start a new run of blocks
+ * holds on to the free blocks right after it, so other files allocating in
+ * the meantime don't interleave with it. A reservation belongs to whichever
+ * chain currently ends at block 'next - 1'. Reserved blocks are still free
+ * in the FAT and are handed out anyway once nothing else is left */
+#define EXTENT_RESERVE 64       /* blocks held ahead of a growing file */
+#define MAX_RESERVATIONS 16
+
+typedef struct {
+    int next;                   /* next block the owner will grow into */
+    int end;                    /* one past the last reserved block */
+} Reservation;
 /* -------------------------------------------------------------------------- */
 
-static int virt_disk_active = 0;
+/* copy-on-write ------------------------------------------------------------ */
+/* fs_clone and fs_snapshot share a file's chain rather than copy it, and
+ * count the extra reference in fat.refs. A block's FAT entry goes with it,
+ * so files only ever share the rest of a chain from some block on. Before a
+ * file writes a block or relinks it, unshare() copies every block it shares
+ * from its head through that one. shared counts the blocks with refs above
+ * 0; while it is 0 none of this costs anything */
+/* -------------------------------------------------------------------------- */
 
-int make_fs(char * disk_name)
-{
-	if (make_disk(disk_name) < 0)
-		return -1;
-	if (open_disk(disk_name) < 0)
-		return -1;
+/* sparse files ------------------------------------------------------------- */
+/* fat.holes records the blocks missing before the next block of a chain,
+ * so a hole costs nothing but a count in the block ahead of it. A
+ * descriptor in a hole stays in the block before it, 'hole' blocks past
+ * it. Writing into a hole links a new block in where the cursor is and
+ * splits the count around it. The block index only reaches as far as the
+ * first hole. holed counts the blocks followed by one; while it is 0 chain
+ * walks don't look at the hole counts */
+#define TABLE_BLOCKS(fs) ((fs)->fat_blocks + (fs)->ref_blocks \
+        + (fs)->hole_blocks + (fs)->sum_blocks)
+/* -------------------------------------------------------------------------- */
 
-    if (virt_disk_active != 1)
-        init_virt_disk();
+/* checksums ---------------------------------------------------------------- */
+/* the cache checks fat.sums as it reads blocks in and keeps it as it writes
+ * them back. Each commit sums the FAT and count blocks it writes and logs
+ * the changed checksum blocks along with them, so after a crash the table
+ * still matches the metadata and data of the last commit; a block written
+ * over since then fails its check. Only a crash between the parts of a
+ * commit logged in parts, or a mount through DISK_MMAP, forgets them all.
+ * The scrubber wakes every SCRUB_TICK ms and checks as many blocks as its
+ * rate has earned since */
+#define SUMS_DIRTY(fs) ((fs)->fat_dirty + (fs)->fat_blocks \
+        + (fs)->ref_blocks + (fs)->hole_blocks)
+#define SCRUB_TICK 10
+/* -------------------------------------------------------------------------- */
 
-    // reserve 0 to data_block_offset in FAT
-    for (int i = 0; i < super->data_block_offset; i++)
-        fat->table[i] = FAT_RESERVED;
+/* locking ------------------------------------------------------------------ */
+/* tree_lock covers the directory tree and the descriptor table. Calls that
+ * add, remove, open or close entries hold it exclusively; calls on an open
+ * descriptor hold it shared, so neither its entry nor its descriptor can
+ * move underneath them. Under it, in this order:
+ * file_locks: striped by a file's slot in its directory. Writers (which grow
+ *     or cut the chain and size) exclude readers of the same file
+ * alloc_lock: free space, i.e. the freemap, reservations and fat_dirty, and
+ *     every FAT entry change
+ * dcache_lock: loading directories, which fs_readdir does under a shared
+ *     tree_lock
+ * A descriptor must only be used by one thread at a time. Every lock is
+ * per mount, so calls on different mounts never wait on each other */
+#define FILE_LOCKS 64
+/* -------------------------------------------------------------------------- */
 
-    if (write_blocks(disk, 0, DISK_BLOCKS) < 0)
-        return -1;
-	
-    if (close_disk(disk_name) < 0)
-        exit(1);
+/* asynchronous I/O --------------------------------------------------------- */
+/* a read spanning several runs of the chain gets them all in flight at once
+ * on an AioQueue, READ_RUNS runs at most per batch. Queues are kept in a
+ * pool per mount and handed to one transfer at a time.
+ * fs_submit requests are run by FS_IO_THREADS workers, started on the first
+ * one, each doing what fs_read or fs_write would at the request's offset.
+ * A descriptor read sequentially also reads a window of blocks ahead of
+ * what was asked for, doubling from READAHEAD_MIN up to READAHEAD_MAX
+ * blocks with every read that starts where the last one ended */
+#define FS_AIO_DEPTH 32
+#define READ_RUNS 64
+#define FS_IO_THREADS 8
+#define READAHEAD_MIN 4
+#define READAHEAD_MAX 256
+/* -------------------------------------------------------------------------- */
 
-    return 0;
-}
+/* write buffers ------------------------------------------------------------ */
+/* appends smaller than WRITE_BUFFER bytes collect in a buffer of that size
+ * on their descriptor, and no block is allocated for them until it is
+ * written out: when it fills up, when the descriptor does anything but
+ * append, when any descriptor reads the file, and on fs_fsync, fs_close,
+ * fs_sync and fs_umount. The blocks a buffer will need are counted in
+ * pending_blocks as soon as it takes the data, so an append that wouldn't
+ * fit is written through instead and comes back short as before.
+ * buffered counts descriptors holding data */
+#define WRITE_BUFFER (64 << 10)
+/* -------------------------------------------------------------------------- */
 
-int mount_fs(char * disk_name)
-{
-    if (open_disk(disk_name) < 0)
-        return -1;
+/* inline data -------------------------------------------------------------- */
+/* a new file gets no block. While it holds at most INLINE_MAX bytes they're
+ * kept with its entry, in Directory.data, and stored after the entries in
+ * the directory's chain, so the small files of a directory share its blocks
+ * instead of taking one each. A write past INLINE_MAX gives the file a head
+ * block and moves them there for good. The blocks the chain will need for
+ * bytes written in between commits are counted in pending_blocks */
+#define INLINE_MAX(fs) ((fs)->disk.block_size / 4)
+/* -------------------------------------------------------------------------- */
 
-    if (virt_disk_active != 1)
-        init_virt_disk();
-    
-    if (read_blocks(disk, 0, DISK_BLOCKS) < 0)
-        return -1;
+/* compression -------------------------------------------------------------- */
+/* a compressed file is cut into clusters of CLUSTER_BLOCKS blocks. Each is
+ * stored either packed, its bytes through lz_compress after an int giving
+ * their packed length, in as few blocks as that takes and the rest of the
+ * cluster a hole; or as it is, in every block its bytes need, when packing
+ * wouldn't save one. A cluster with blocks is packed exactly when it has
+ * fewer than its bytes need, so the last one is packed again before the
+ * file grows past what its blocks hold. A cluster without blocks is a hole.
+ * A descriptor unpacks the cluster it reads or writes into zbuf, where
+ * writes collect until it is packed back into the file: when the
+ * descriptor moves to another cluster, and where buffered appends are
+ * written out. buffered counts descriptors with a dirty cluster too */
+#define CLUSTER_BYTES (64 << 10)
+#define CLUSTER_BLOCKS(fs) (CLUSTER_BYTES / (fs)->disk.block_size)
+/* -------------------------------------------------------------------------- */
 
-    return 0;
-}
+/* metadata journal --------------------------------------------------------- */
+/* the superblock, FAT blocks and directory blocks changed since the last
+ * commit are logged to the journal before any of them is written where it
+ * belongs, so a crash part way through leaves either the old metadata or a
+ * complete log of the new one, which the next mount copies into place.
+ * A commit covers everything done before it: fs_sync and fs_fsync calls
+ * that come in while one is being written wait for it and then share the
+ * next one, and a commit thread writes one every JOURNAL_INTERVAL seconds
+ * while anything is dirty.
+ * A commit with more blocks than the journal holds is logged in parts,
+ * each one written where it belongs before the next is logged, so a crash
+ * leaves the metadata as one of the parts left it.
+ * On disk: a JournalHeader block, the home block of each logged block
+ * packed into as many blocks as it takes, then the logged blocks. The
+ * checksum is over all of it, so a commit torn by a crash is ignored */
+#define JOURNAL_MAGIC 0x4c4e524a
+#define JOURNAL_DIR_BLOCKS 64   /* directory blocks one commit can log */
+#define JOURNAL_INTERVAL 5
+
+typedef struct {
+    int magic;
+    int sequence;
+    int count;                  /* blocks logged */
+    uint32_t checksum;
+    int more;                   /* another part of the commit follows */
+} JournalHeader;
+
+#define JOURNAL_LIST(fs) (((fs)->super->journal_blocks * (int) sizeof(int) \
+            + (fs)->disk.block_size - 1) / (fs)->disk.block_size)
+/* -------------------------------------------------------------------------- */
+
+/* statistics --------------------------------------------------------------- */
+/* every public call times itself into its fs_op_stats_t, and the layers
+ * below count what the calls turned into. Counters are bumped with relaxed
+ * atomics and read one by one, so a snapshot taken while calls are running
+ * may be slightly out of step with itself */
+#define STAT_ADD(counter, n) \
+    __atomic_add_fetch(&(counter), (n), __ATOMIC_RELAXED)
+
+static const char * op_names[FS_OPS] = {
+    "open", "close", "create", "delete", "mkdir", "rmdir", "readdir",
+    "read", "write", "lseek", "truncate", "fallocate", "sync", "clone",
+    "snapshot"
+};
+/* -------------------------------------------------------------------------- */
+
+/* directory cache ---------------------------------------------------------- */
+/* every directory that has been looked at since mount, indexed by the head
+ * block of its chain. Path resolution only goes to the disk for a directory
+ * the first time it is walked through */
+
+/* entries of a version 0 image's root, before names got longer */
+typedef struct {
+    char name[16];
+    int size;
+    int offset;
+} OldAttribute;
+
+/* each directory also indexes its entries by name: an open-addressed hash
+ * table from name to slot in attributes, linear probing, DIR_SLOT_EMPTY
+ * marks unused buckets */
+#define DIR_SLOT_EMPTY -1
+/* -------------------------------------------------------------------------- */
+
+/* fs -- everything about one mounted image. Nothing is shared between
+ * mounts, so a process can have any number of them open at once
+ * disk, cache: the open disk and its block cache
+ * super, fat: the only disk structures held in memory for the whole mount,
+ *             each in its own block-sized buffer. Directories and file
+ *             data go through the cache. fat_dirty[i] is set when FAT block
+ *             i needs writing back, fat_dirty[fat_blocks + i] when block i
+ *             of the reference counts does, and after those the hole
+ *             counts' and the checksums' blocks
+ * ref_blocks, hole_blocks, sum_blocks: blocks of reference and hole counts
+ *             and of checksums, fat_blocks each or 0 without them
+ * shared: blocks with reference counts above 0, see above
+ * holed: blocks with hole counts above 0, see above
+ * metadata_mapped: super and fat point into a DISK_MMAP disk
+ * dir, dcache: the root directory and the directory cache, see above
+ * freemap ... alloc_mode: free space, see above
+ * descriptors: descriptor table, grown on demand. Free slots are chained
+ *              through next_free starting at descriptor_free, so fs_open
+ *              reuses them in O(1)
+ * journal_*: the commit being built, see above. journal_capacity is how
+ *            many blocks it can log, 0 without a journal. The directory
+ *            blocks come first, the journal_pinned of them pinned in the
+ *            cache until logged. journal_torn is set when the commit the
+ *            mount replayed wasn't its last part
+ * commits_*: commit() calls, see there
+ * stats: see above. The disk and cache fields stay 0, those counters are
+ *        kept in the disk and cache themselves
+ * aio_pool: idle AioQueues, see above
+ * io_pending, io_done: fs_submit requests waiting for a worker, and those
+ *                      finished but not reaped yet. io_outstanding counts
+ *                      both plus the ones being worked on
+ * scrub_*: the scrubber thread, see above
+ */
+struct fs {
+    Disk disk;
+    Cache cache;
 
+    Superblock * super;
+    FAT fat;
+    int fat_blocks;             /* depends on the geometry */
+    int ref_blocks;
+    int hole_blocks;
+    int sum_blocks;
+    char * fat_dirty;
+    int shared;
+    int holed;
+    int metadata_mapped;
+    Directory * dir;
+    Directory ** dcache;
 
-int umount_fs(char * disk_name)
+    uint64_t * freemap;
+    int freemap_hint;
+    int freemap_free;           /* free blocks not in freeing */
+    uint64_t * resmap;
+    uint64_t * fresh;
+    uint64_t * freeing;
+    int freeing_count;          /* blocks in freeing */
+    Reservation reservations[MAX_RESERVATIONS];
+    int reservation_clock;
+    int alloc_mode;
+
+    Descriptor * descriptors;
+    int descriptor_capacity;
+    int descriptor_free;
+    int descriptor_size;        /* number of open descriptors */
+
+    pthread_rwlock_t tree_lock;
+    pthread_rwlock_t file_locks[FILE_LOCKS];
+    pthread_mutex_t alloc_lock;
+    pthread_mutex_t dcache_lock;
+
+    int pending_blocks;         /* under alloc_lock */
+    int buffered;
+
+    int journal_capacity;
+    int journal_count;
+    int journal_open;
+    int journal_pinned;
+    int journal_sequence;
+    int journal_torn;
+    int * journal_home;
+    struct iovec * journal_iov;
+    char * journal_buf;         /* header and home list */
+
+    pthread_mutex_t commit_lock;    /* guards everything below */
+    pthread_cond_t commit_cond;
+    pthread_cond_t commit_wake;
+    long commits_started;
+    long commits_done;
+    int committing;
+    int commit_status;
+    pthread_t commit_thread;
+    int commit_running;
+    int commit_stopping;
+
+    fs_stats_t stats;
+
+    pthread_mutex_t aio_lock;
+    AioQueue ** aio_pool;
+    int aio_pool_size;
+
+    pthread_mutex_t io_lock;    /* guards everything below */
+    pthread_cond_t io_work;
+    pthread_cond_t io_done_cond;
+    fs_io_t * io_pending, * io_pending_tail;
+    fs_io_t * io_done, * io_done_tail;
+    int io_outstanding;
+    pthread_t * io_threads;
+    int io_nthreads;
+    int io_stopping;
+
+    pthread_mutex_t scrub_lock;     /* guards everything below */
+    pthread_cond_t scrub_wake;
+    pthread_t scrub_thread;
+    int scrub_running;
+    int scrub_stopping;
+    int scrub_rate;
+};
+
+/* lock_file -- takes the lock for desc's file, shared unless write. Its
+ * slot only moves under an exclusive tree_lock, unlike its head block,
+ * which unshare() may replace while the lock is held */
+static pthread_rwlock_t * lock_file(fs_t * fs, Descriptor * desc, int write)
 {
-    if (write_blocks(disk, 0, DISK_BLOCKS) < 0)
-        return -1;
+    unsigned int slot = desc->attr - desc->parent->attributes;
+    pthread_rwlock_t * lock =
+        &fs->file_locks[(desc->parent->head * 31u + slot) % FILE_LOCKS];
 
-    if (close_disk(disk_name) < 0)
-        return -1;
+    if (write)
+        pthread_rwlock_wrlock(lock);
+    else
+        pthread_rwlock_rdlock(lock);
+    return lock;
+}
+
+/* mark_dirty -- several writers may do this at once under a shared tree_lock */
+static void mark_dirty(Directory * d)
+{
+    __atomic_store_n(&d->dirty, 1, __ATOMIC_RELAXED);
+}
 
-    free(disk);
+/* -------------------------------------------------------------------------- */
 
-    return 0;
+int make_fs(char * disk_name)
+{
+    return make_fs_geometry(disk_name, DEFAULT_DISK_BLOCKS, DEFAULT_BLOCK_SIZE);
 }
 
-int fs_open(char * name)
+int make_fs_geometry(char * disk_name, int blocks, int size)
 {
-    int idx = 0;
-    Descriptor * desc;
-    Attribute * attr;
+    fs_t * fs;
+    int ret;
 
-    if (descriptor_size == MAX_OPEN_FILES)
+    // room for the FAT, its reference and hole counts and checksums, the
+    // root and at least one data block
+    long fat_bytes = (long) blocks * sizeof(int);
+    if (blocks <= 0 || size <= 0
+            || blocks - 4 * ((fat_bytes + size - 1) / size)
+            < SUPERBLOCK_BLOCK_SIZE + DIRECTORY_BLOCK_SIZE + 1)
     {
-        printf("fs_open: can't open more files\n");
+        printf("make_fs: %d blocks is too small a disk\n", blocks);
         return -1;
     }
 
-    while (idx < dir->size && strcmp(name, dir->attributes[idx].name) != 0)
+    if (make_disk_geometry(disk_name, blocks, size) < 0)
+        return -1;
+    if ((fs = new_fs()) == NULL)
+        return -1;
+    if (open_disk(&fs->disk, disk_name) < 0
+            || set_disk_geometry(&fs->disk, blocks, size) < 0
+            || init_virt_disk(fs) < 0)
     {
-        idx++;
+        free_fs(fs);
+        return -1;
     }
 
-    if (idx == dir->size)
+    // reserve 0 to data_block_offset in FAT, the directory is a chain
+    for (int i = 0; i < fs->super->data_block_offset; i++)
+        fs->fat.table[i] = FAT_RESERVED;
+    fs->fat.table[fs->super->directory_offset] = FAT_EOF;
+    memset(fs->fat_dirty, 1, fs->fat_blocks);
+    build_freemap(fs);
+    if (load_root(fs) < 0)
     {
-        printf("fs_open: file not found: %s\n", name);
+        free_fs(fs);
         return -1;
     }
-    attr = &dir->attributes[idx];
+    fs->dir->dirty = 1;
 
-    // find an empty descriptor spot
-    idx = 0;
-    while (idx < descriptor_size 
-            && descriptors[idx].descriptor != DESCRIPTOR_UNUSED)
+    ret = flush_metadata(fs);
+    if (ret == 0)
+        ret = clear_journal(fs);
+    free_fs(fs);
+    return ret;
+}
+
+fs_t * fs_mount(char * disk_name)
+{
+    return fs_mount_mode(disk_name, DISK_FILE);
+}
+
+fs_t * fs_mount_mode(char * disk_name, int mode)
+{
+    fs_t * fs = new_fs();
+
+    if (fs != NULL && load_fs(fs, disk_name, mode) < 0)
     {
-        idx++;
+        free_fs(fs);
+        return NULL;
     }
-    desc = &descriptors[idx];
+    if (fs != NULL)
+        start_commits(fs);
+    return fs;
+}
 
-    // finally, create a descriptor
-    desc->descriptor = idx;
-    desc->ptr = disk + attr->offset * BLOCK_SIZE;
-    desc->attr = attr;
-    descriptor_size++;
+int fs_umount(fs_t * fs)
+{
+    int ret;
 
-    return desc->descriptor;
+    if (fs == NULL)
+        return -1;
+
+    // whatever is still open goes away with the mount, once the requests
+    // submitted on it are done and its buffered writes are out
+    stop_io(fs);
+    stop_commits(fs);
+    stop_scrub(fs);
+    ret = flush_buffers(fs);
+    fs->super->mounted = 0;
+    if (flush_metadata(fs) < 0 || clear_journal(fs) < 0)
+        ret = -1;
+    free_fs(fs);
+    return ret;
 }
 
-int fs_close(int fildes)
+/* new_fs -- an empty fs_t, with nothing opened or loaded yet */
+static fs_t * new_fs()
 {
-    int idx = get_fildes_index(fildes);
-    if (idx < 0)
+    fs_t * fs = calloc(1, sizeof(fs_t));
+
+    if (fs == NULL)
     {
-        printf("fs_close: file with descriptor %d doesn't exist\n", fildes);
-        return -1;
+        printf("fs_mount: out of memory\n");
+        return NULL;
     }
-    descriptor_size--;
-
-    if (descriptor_size == 0)
-        return 0;
+    fs->alloc_mode = ALLOC_EXTENT;
+    fs->descriptor_free = -1;
+    pthread_rwlock_init(&fs->tree_lock, NULL);
+    for (int i = 0; i < FILE_LOCKS; i++)
+        pthread_rwlock_init(&fs->file_locks[i], NULL);
+    pthread_mutex_init(&fs->alloc_lock, NULL);
+    pthread_mutex_init(&fs->dcache_lock, NULL);
+    pthread_mutex_init(&fs->aio_lock, NULL);
+    pthread_mutex_init(&fs->io_lock, NULL);
+    pthread_cond_init(&fs->io_work, NULL);
+    pthread_cond_init(&fs->io_done_cond, NULL);
+    pthread_mutex_init(&fs->commit_lock, NULL);
+    pthread_cond_init(&fs->commit_cond, NULL);
+    pthread_cond_init(&fs->commit_wake, NULL);
+    pthread_mutex_init(&fs->scrub_lock, NULL);
+    pthread_cond_init(&fs->scrub_wake, NULL);
+    return fs;
+}
 
-    descriptors[idx] = descriptors[descriptor_size];
+/* free_fs -- frees whatever part of fs has been set up. The disk is closed
+ * last since its geometry sizes everything freed before it */
+static void free_fs(fs_t * fs)
+{
+    stop_io(fs);
+    stop_commits(fs);
+    stop_scrub(fs);
+    for (int i = 0; i < fs->aio_pool_size; i++)
+        aio_close(fs->aio_pool[i]);
+    free(fs->aio_pool);
+    free_descriptors(fs);
+    free_directories(fs);
+    free_virt_disk(fs);
+    if (fs->disk.active)
+        close_disk(&fs->disk);
 
-    return 0;
+    pthread_rwlock_destroy(&fs->tree_lock);
+    for (int i = 0; i < FILE_LOCKS; i++)
+        pthread_rwlock_destroy(&fs->file_locks[i]);
+    pthread_mutex_destroy(&fs->alloc_lock);
+    pthread_mutex_destroy(&fs->dcache_lock);
+    pthread_mutex_destroy(&fs->aio_lock);
+    pthread_mutex_destroy(&fs->io_lock);
+    pthread_cond_destroy(&fs->io_work);
+    pthread_cond_destroy(&fs->io_done_cond);
+    pthread_mutex_destroy(&fs->commit_lock);
+    pthread_cond_destroy(&fs->commit_cond);
+    pthread_cond_destroy(&fs->commit_wake);
+    pthread_mutex_destroy(&fs->scrub_lock);
+    pthread_cond_destroy(&fs->scrub_wake);
+    free(fs);
 }
 
-int fs_create(char * name)
+/* load_fs -- opens disk_name into fs and reads in its metadata */
+static int load_fs(fs_t * fs, char * disk_name, int mode)
 {
-    int found = 0;
-    int dir_idx = 0;
-    int name_idx = 0;
-    int fat_idx = super->fat_offset;
-    Attribute * attrib;
+    char first[MIN_BLOCK_SIZE];
+    Superblock * sb = (Superblock *) first;
 
-    if (dir->size == MAX_FILES)
-    {
-        printf("Max file count reached (64)\n");
+    if (open_disk_mode(&fs->disk, disk_name, mode) < 0)
         return -1;
-    }
 
-    while (name[name_idx] != '\0')
-        name_idx++;
+    // the superblock fits in the smallest block; read it that way to learn
+    // the real geometry
+    if (set_disk_geometry(&fs->disk, 1, MIN_BLOCK_SIZE) < 0
+            || read_blocks(fs, first, 0, 1) < 0)
+        return -1;
+    if (set_disk_geometry(&fs->disk,
+                sb->block_count ? sb->block_count : DEFAULT_DISK_BLOCKS,
+                sb->block_size ? sb->block_size : DEFAULT_BLOCK_SIZE) < 0)
+        return -1;
 
-    if (name_idx >= MAX_FILENAME)
-    {
-        printf("Filename can't be longer than 15 characters.\n");
+    if (init_virt_disk(fs) < 0)
         return -1;
+
+    // a mapped disk's superblock and FAT are used in place, which turns the
+    // reads below (and the writes at unmount) into no-ops
+    if (block_map(&fs->disk, 0) != NULL)
+    {
+        free(fs->super);
+        free(fs->fat.table);
+        fs->super = (Superblock *) block_map(&fs->disk, 0);
+        fs->fat.table = (int *) block_map(&fs->disk, fs->super->fat_offset);
+        fs->metadata_mapped = 1;
     }
 
-    while (!found && dir_idx < dir->size)
+    // everything else is read on demand. Whatever a crash left in the
+    // journal goes into place first, the superblock possibly included
+    if (read_blocks(fs, (char *) fs->super, 0, SUPERBLOCK_BLOCK_SIZE) < 0
+            || replay_journal(fs) < 0
+            || read_blocks(fs, (char *) fs->super, 0, SUPERBLOCK_BLOCK_SIZE) < 0
+            || open_journal(fs) < 0)
+        return -1;
+    // images from before reference counts have none, and share nothing;
+    // those from before hole counts have no holes, and those from before
+    // checksums aren't checked
+    if (fs->super->refs_offset == 0)
     {
-        if (strcmp(dir->attributes[dir_idx].name, name) == 0)
-            found = 1;
-        else
-            dir_idx++;
+        fs->ref_blocks = 0;
+        fs->fat.refs = NULL;
     }
-    if (found)
+    else
+        fs->fat.refs = (int *) ((char *) fs->fat.table
+                + (long) fs->fat_blocks * fs->disk.block_size);
+    if (fs->super->holes_offset == 0)
     {
-        printf("File already exists\n");
-        return -1;
+        fs->hole_blocks = 0;
+        fs->fat.holes = NULL;
     }
-
-    // find an empty FAT entry
-    fat_idx = find_avail_alloc_entry();
-    if (fat_idx < 0)
+    else
+        fs->fat.holes = (int *) ((char *) fs->fat.table + (long)
+                (fs->fat_blocks + fs->ref_blocks) * fs->disk.block_size);
+    if (fs->super->sums_offset == 0)
     {
-        printf("Not enough space\n");
-        return -1;
+        fs->sum_blocks = 0;
+        fs->fat.sums = NULL;
     }
-
-    // finally, create a file attrib entry
-    attrib = &dir->attributes[dir->size];
-    memcpy(attrib->name, name, MAX_FILENAME);
-    attrib->size = 0;
-    attrib->offset = fat_idx;
-
-    fat->table[fat_idx] = FAT_EOF;
-
-    dir->size++;
+    else
+        fs->fat.sums = (uint32_t *) ((char *) fs->fat.table + (long)
+                (fs->fat_blocks + fs->ref_blocks + fs->hole_blocks)
+                * fs->disk.block_size);
+    if (read_blocks(fs, (char *) fs->fat.table, fs->super->fat_offset,
+                TABLE_BLOCKS(fs)) < 0 || load_sums(fs) < 0
+            || check_fat(fs) < 0)
+        return -1;
+    for (int i = 0; fs->fat.refs != NULL && i < fs->disk.blocks; i++)
+        fs->shared += fs->fat.refs[i] > 0;
+    for (int i = 0; fs->fat.holes != NULL && i < fs->disk.blocks; i++)
+        fs->holed += fs->fat.holes[i] > 0;
+    // images from before the geometry was recorded get it at the next flush
+    fs->super->block_size = fs->disk.block_size;
+    fs->super->block_count = fs->disk.blocks;
+    build_freemap(fs);
+    if (load_root(fs) < 0)
+        return -1;
 
     return 0;
 }
 
-int fs_delete(char * name)
+/* check_fat -- refuses a FAT with an entry that is neither one of the FAT_
+ * values nor a block of the data area, or with a chain that runs into
+ * itself, so walking a chain always ends */
+static int check_fat(fs_t * fs)
 {
-    int idx = 0;    /* index of file with matching name */
-   
-    /* find file within descriptors (is it open?) */
-    while (idx < descriptor_size 
-            && strcmp(name, descriptors[idx].attr->name) != 0)
-    {
-        idx++;
-    }
+    int end = fs->super->journal_blocks > 0 ? fs->super->journal_offset
+            : fs->disk.blocks,
+        ret = 0,
+        block,
+        next;
+    char * seen;
 
-    if (idx < descriptor_size)
+    for (int i = 0; i < fs->disk.blocks; i++)
     {
-        printf("fs_delete: can't delete, file is open: %s\n", name);
-        return -1;
-    }
-
-    /* find file within dir structure */
-    idx = 0;
-    while (idx < dir->size && strcmp(name, dir->attributes[idx].name) != 0)
-    {
-        idx++;
+        next = fs->fat.table[i];
+        if (next != FAT_UNUSED && next != FAT_EOF && next != FAT_RESERVED
+                && (next < fs->super->data_block_offset || next >= end))
+        {
+            printf("fs_mount: FAT entry %d is corrupt\n", i);
+            return -1;
+        }
     }
 
-    if (idx == dir->size)
+    // each chain is followed until it ends or joins one followed before:
+    // 1 marks the blocks of the one being followed, 2 those of earlier ones
+    if ((seen = calloc((unsigned) fs->disk.blocks, 1)) == NULL)
     {
-        printf("fs_delete: file not found: %s\n", name);
+        printf("fs_mount: out of memory\n");
         return -1;
     }
-
-    // finally "delete" the file
-    dir->size--;
-    free_alloc_chain(dir->attributes[idx].offset);
-    if (dir->size == 0)
+    for (int i = 0; i < fs->disk.blocks && ret == 0; i++)
     {
-        return 0;
+        for (block = i; seen[block] == 0 && fs->fat.table[block] > 0;
+                block = fs->fat.table[block])
+            seen[block] = 1;
+        if (seen[block] == 1)
+        {
+            printf("fs_mount: FAT chain through block %d loops\n", block);
+            ret = -1;
+        }
+        for (block = i; seen[block] == 1; block = fs->fat.table[block])
+            seen[block] = 2;
     }
-    dir->attributes[idx] = dir->attributes[dir->size];
-    return 0;
+    free(seen);
+    return ret;
 }
 
-int fs_read(int fildes, void * buf, size_t nbyte)
+int fs_sync(fs_t * fs)
 {
-    size_t block_offset,    /* current block's offset */
-           bytes_to_read    /* bytes readable from the block, up to nbytes */,
-           bytes_r = 0;     /* bytes read from recursive calls, if any */
-    int fat_idx,
-        idx = get_fildes_index(fildes);
-    char * destination = (char *) buf;
+    uint64_t start = stat_clock();
 
-    if (idx < 0)
+    if (fs == NULL)
         return -1;
+    return stat_call(fs, FS_OP_SYNC, start, commit(fs), 0);
+}
 
-    block_offset = (long unsigned)(descriptors[idx].ptr - disk) / BLOCK_SIZE;
-    bytes_to_read = (long unsigned)disk + (block_offset + 1) * BLOCK_SIZE 
-        - (long unsigned)(descriptors[idx].ptr);
-   
-    // only read up to filesize
-    if (nbyte > (size_t)descriptors[idx].attr->size)
-        nbyte = (size_t)descriptors[idx].attr->size;
+int fs_fsync(fs_t * fs, int fildes)
+{
+    uint64_t start = stat_clock();
+    int ret = -1, idx;
+    pthread_rwlock_t * lock;
 
-    // only read up to nbytes
-    if (bytes_to_read > nbyte)
-        bytes_to_read = nbyte;
-    
-    nbyte -= bytes_to_read;
+    pthread_rwlock_rdlock(&fs->tree_lock);
+    if (get_fildes_index(fs, fildes) >= 0)
+        ret = 0;
+    pthread_rwlock_unlock(&fs->tree_lock);
 
-    memcpy(destination, descriptors[idx].ptr, bytes_to_read);
-    descriptors[idx].ptr += bytes_to_read;
-    destination += bytes_to_read;
+    // a commit is for the whole mount, this file included
+    if (ret == 0)
+        ret = commit(fs);
 
-    if (nbyte == 0)
-        return bytes_to_read;
-   
-    // the entire block has been read: find next block
-    if (descriptors[idx].ptr == disk + (block_offset + 1) * BLOCK_SIZE)
+    // as is any write of this file's a commit didn't get out
+    pthread_rwlock_rdlock(&fs->tree_lock);
+    if ((idx = get_fildes_index(fs, fildes)) >= 0)
     {
-        fat_idx = fat->table[block_offset];
-
-        // no more blocks: return bytes of what's been read
-        if (fat_idx == FAT_EOF)
-            return bytes_to_read;
-
-        descriptors[idx].ptr = disk + fat_idx * BLOCK_SIZE;
+        lock = lock_file(fs, &fs->descriptors[idx], 1);
+        if (take_error(&fs->descriptors[idx]))
+            ret = -1;
+        pthread_rwlock_unlock(lock);
     }
-
-    bytes_r = fs_read(fildes, destination, nbyte);
-    return bytes_to_read + bytes_r;
+    pthread_rwlock_unlock(&fs->tree_lock);
+    return stat_call(fs, FS_OP_SYNC, start, ret, 0);
 }
 
-int fs_write(int fildes, void * buf, size_t nbyte)
+int fs_open(fs_t * fs, char * name)
 {
-    size_t block_offset,    /* current block's offset */
-           bytes_to_fill,   /* bytes that can fit in the block, up to nbytes */
-           bytes_r = 0;     /* bytes written from recursive calls, if any */
-    int fat_idx,
-        bytes_delta,
-        idx = get_fildes_index(fildes);
-    char * source = (char *) buf;
+    uint64_t start = stat_clock();
+    int ret;
 
-    if (idx < 0)
-        return -1;
+    pthread_rwlock_wrlock(&fs->tree_lock);
+    ret = open_file(fs, name);
+    pthread_rwlock_unlock(&fs->tree_lock);
+    return stat_call(fs, FS_OP_OPEN, start, ret, 0);
+}
 
-    block_offset = (long unsigned)(descriptors[idx].ptr - disk) / BLOCK_SIZE;
-    bytes_to_fill = (long unsigned)disk + (block_offset + 1) * BLOCK_SIZE 
-        - (long unsigned)(descriptors[idx].ptr);
+int fs_close(fs_t * fs, int fildes)
+{
+    uint64_t start = stat_clock();
+    int ret;
 
-    // write only up to nbytes
-    if (bytes_to_fill > nbyte)
-        bytes_to_fill = nbyte;
-        
-    nbyte -= bytes_to_fill;
+    pthread_rwlock_wrlock(&fs->tree_lock);
+    ret = close_file(fs, fildes);
+    pthread_rwlock_unlock(&fs->tree_lock);
+    return stat_call(fs, FS_OP_CLOSE, start, ret, 0);
+}
 
-    // write to virt disk and advance pointer forward
-    memcpy(descriptors[idx].ptr, source, bytes_to_fill);
-    descriptors[idx].ptr += bytes_to_fill;
+int fs_create(fs_t * fs, char * name)
+{
+    uint64_t start = stat_clock();
+    int ret;
 
-    /* if at EOF block AND writing past file limit, increase filesize */
-    if (block_offset == (size_t)get_eof_block_idx(fildes))
-    {
-        bytes_delta = bytes_to_fill - descriptors[idx].attr->size % BLOCK_SIZE;
-        if (bytes_delta > 0)
-            descriptors[idx].attr->size += bytes_delta;
-    }
+    pthread_rwlock_wrlock(&fs->tree_lock);
+    ret = create_entry(fs, name, ATTR_FILE);
+    pthread_rwlock_unlock(&fs->tree_lock);
+    return stat_call(fs, FS_OP_CREATE, start, ret, 0);
+}
 
-    // file ptr is at end of block: move it to next available block
-    if (descriptors[idx].ptr == disk + (block_offset + 1) * BLOCK_SIZE)
-    {
-        fat_idx = fat->table[block_offset];
-        if (fat_idx == FAT_EOF)
-        {
-            fat_idx = find_avail_alloc_entry();
+int fs_mkdir(fs_t * fs, char * name)
+{
+    uint64_t start = stat_clock();
+    int ret;
 
-            // no more blocks avail, ret bytes written up to now
-            if (fat_idx < 0)
-                return bytes_to_fill;
+    pthread_rwlock_wrlock(&fs->tree_lock);
+    ret = create_entry(fs, name, ATTR_DIR);
+    pthread_rwlock_unlock(&fs->tree_lock);
+    return stat_call(fs, FS_OP_MKDIR, start, ret, 0);
+}
 
-            // extend current FAT idx to the next chain
-            fat->table[block_offset] = fat_idx;
-            fat->table[fat_idx] = FAT_EOF;
-            descriptors[idx].ptr = disk + fat_idx * BLOCK_SIZE;
-        }
-    }
+int fs_delete(fs_t * fs, char * name)
+{
+    uint64_t start = stat_clock();
+    int ret;
 
-    if (nbyte > 0)
-        bytes_r = fs_write(fildes, source + bytes_to_fill, nbyte);
-    return bytes_to_fill + bytes_r;
+    pthread_rwlock_wrlock(&fs->tree_lock);
+    ret = delete_file(fs, name);
+    pthread_rwlock_unlock(&fs->tree_lock);
+    return stat_call(fs, FS_OP_DELETE, start, ret, 0);
 }
 
-int fs_get_filesize(int fildes)
+int fs_rmdir(fs_t * fs, char * name)
 {
-    int idx = get_fildes_index(fildes);
-    if (idx < 0)
-        return -1;
-    return descriptors[idx].attr->size;
+    uint64_t start = stat_clock();
+    int ret;
+
+    pthread_rwlock_wrlock(&fs->tree_lock);
+    ret = remove_directory(fs, name);
+    pthread_rwlock_unlock(&fs->tree_lock);
+    return stat_call(fs, FS_OP_RMDIR, start, ret, 0);
 }
 
-int fs_lseek(int fildes, off_t offset)
+int fs_readdir(fs_t * fs, char * name, int pos, Attribute * entry)
 {
-    int blocks, 
-        fat_idx,
-        idx = get_fildes_index(fildes);
+    uint64_t start = stat_clock();
+    int ret;
 
-    if (idx < 0)
-        return -1;
-    if (descriptors[idx].attr->size < offset)
-        return -1;
-    if (offset < 0)
-        return -1;
+    pthread_rwlock_rdlock(&fs->tree_lock);
+    ret = read_directory(fs, name, pos, entry);
+    pthread_rwlock_unlock(&fs->tree_lock);
+    return stat_call(fs, FS_OP_READDIR, start, ret, 0);
+}
 
-    // seek to beginning if offset = 0
-    if (offset == 0)
-    {
-        descriptors[idx].ptr 
-            = disk + descriptors[idx].attr->offset * BLOCK_SIZE;
-        return 0;
-    }
+int fs_read(fs_t * fs, int fildes, void * buf, size_t nbyte)
+{
+    struct iovec iov = { buf, nbyte };
+    return fs_readv(fs, fildes, &iov, 1);
+}
+
+int fs_write(fs_t * fs, int fildes, void * buf, size_t nbyte)
+{
+    struct iovec iov = { buf, nbyte };
+    return fs_writev(fs, fildes, &iov, 1);
+}
 
-    blocks = get_file_blocksize(fildes);
+int fs_readv(fs_t * fs, int fildes, const struct iovec * iov, int iovcnt)
+{
+    uint64_t start = stat_clock();
+    int ret = -1, idx, flush;
+    pthread_rwlock_t * lock;
+    Descriptor * desc;
 
-    // file's FAT table index for its final block
-    fat_idx = descriptors[idx].attr->offset;
-    for (int i = 0; i < blocks - 1; i++)
+    pthread_rwlock_rdlock(&fs->tree_lock);
+    if ((idx = get_fildes_index(fs, fildes)) >= 0)
     {
-        fat_idx = fat->table[fat_idx];
+        // buffered appends to the file have to be readable
+        desc = &fs->descriptors[idx];
+        flush = has_buffered(fs, desc);
+        lock = lock_file(fs, desc, flush);
+        if (!flush || flush_file(fs, desc->attr) == 0)
+            ret = transfer(fs, desc, (struct iovec *) iov, iovcnt, 0);
+        pthread_rwlock_unlock(lock);
     }
-
-    // seek to that location
-    descriptors[idx].ptr = disk + fat_idx * BLOCK_SIZE + offset % BLOCK_SIZE;
-
-    return 0;
+    pthread_rwlock_unlock(&fs->tree_lock);
+    return stat_call(fs, FS_OP_READ, start, ret, ret > 0 ? ret : 0);
 }
 
-int fs_truncate(int fildes, off_t length)
+int fs_writev(fs_t * fs, int fildes, const struct iovec * iov, int iovcnt)
 {
-    int blocks,
-        fat_idx,
-        eof_idx,
-        idx = get_fildes_index(fildes);
-    char * file_ptr;
+    uint64_t start = stat_clock();
+    size_t nbyte = 0;
+    int ret, more;
 
-    if (idx < 0)
-        return -1;
-    if (descriptors[idx].attr->size < length)
-        return -1;
-   
-    // truncated file's block footprint
-    blocks = (length + BLOCK_SIZE - 1) / BLOCK_SIZE;
-   
-    // find truncated file's FAT table index for its final block
-    fat_idx = descriptors[idx].attr->offset;
-    for (int i = 1; i < blocks - 1; i++)
+    for (int i = 0; i < iovcnt; i++)
+        nbyte += iov[i].iov_len;
+    ret = write_fildes(fs, fildes, iov, iovcnt, 0);
+    // blocks freed since the last commit may be all the space there is
+    if ((ret < 0 || (size_t) ret < nbyte) && reclaim_space(fs))
     {
-        fat_idx = fat->table[fat_idx];
+        more = write_fildes(fs, fildes, iov, iovcnt, ret > 0 ? ret : 0);
+        if (more >= 0)
+            ret = (ret > 0 ? ret : 0) + more;
     }
-
-    // truncated length is EOF? ret 0
-    if (fat->table[fat_idx] == FAT_EOF)
-        return 0;
-
-    // else, set truncated block's end as EOF and free the rest
-    eof_idx = fat_idx;
-    fat_idx = fat->table[fat_idx];
-    free_alloc_chain(fat_idx);
-    fat->table[eof_idx] = FAT_EOF;
-    memset(disk + eof_idx * BLOCK_SIZE + length % BLOCK_SIZE, 0, 
-            BLOCK_SIZE - (length % BLOCK_SIZE));
-    descriptors[idx].attr->size = length;
-
-    // ptr to final byte of truncated file
-    file_ptr = disk + eof_idx * BLOCK_SIZE 
-        + descriptors[idx].attr->size % BLOCK_SIZE;
-
-    // trim the rest of the EOF block
-    memset(file_ptr + 1, 0, 
-            BLOCK_SIZE - descriptors[idx].attr->size & BLOCK_SIZE);
-
-    // reset file ptr if it's pointing past the truncated end
-    if (file_ptr < descriptors[idx].ptr)
-        return fs_lseek(fildes, descriptors[idx].attr->size);
-    return 0;
+    return stat_call(fs, FS_OP_WRITE, start, ret, ret > 0 ? ret : 0);
 }
 
-
-
-
-
-/* helpers ------------------------------------------------------------------ */
-
-void print_disk_struct()
+/* write_fildes -- fs_writev past the first 'skip' bytes */
+static int write_fildes(fs_t * fs, int fildes, const struct iovec * iov,
+        int iovcnt, size_t skip)
 {
-    Attribute * attrib = &dir->attributes[0];
-
-    printf("----------\n");
-    printf("Superblock: fat=%d dir=%d data=%d \n", 
-            super->fat_offset, 
-            super->directory_offset, 
-            super->data_block_offset);
+    struct iovec * rest = (struct iovec *) iov;
+    int ret = -1, idx;
+    pthread_rwlock_t * lock;
 
-    printf("FAT (first 20): ");
-    for (int i = 0; i < 20; i++)
+    for (; iovcnt > 0 && skip >= iov->iov_len; iov++, iovcnt--)
+        skip -= iov->iov_len;
+    if (skip > 0)
     {
-        printf("%d ", fat->table[i]);
+        if ((rest = malloc(iovcnt * sizeof(struct iovec))) == NULL)
+            return -1;
+        memcpy(rest, iov, iovcnt * sizeof(struct iovec));
+        rest[0].iov_base = (char *) rest[0].iov_base + skip;
+        rest[0].iov_len -= skip;
     }
-    if (dir->size == 0)
-        printf("\nNo files present\n");
     else
-        printf("\nFirst file: name=%s size=%d offset=%d\n",
-                attrib->name,
-                attrib->size,
-                attrib->offset);
-    printf("First 50 bytes of data block: |");
-    for (int i = 0; i < 50; i++)
+        rest = (struct iovec *) iov;
+
+    pthread_rwlock_rdlock(&fs->tree_lock);
+    if ((idx = get_fildes_index(fs, fildes)) >= 0)
     {
-        printf("%c", data[i]);
+        lock = lock_file(fs, &fs->descriptors[idx], 1);
+        ret = write_file(fs, &fs->descriptors[idx], rest, iovcnt);
+        pthread_rwlock_unlock(lock);
     }
-    printf("|\n");
-    printf("----------\n");
+    pthread_rwlock_unlock(&fs->tree_lock);
+    if (rest != iov)
+        free(rest);
+    return ret;
 }
 
-int write_blocks(char * buf, int block_offset, int block_count)
+int fs_get_filesize(fs_t * fs, int fildes)
 {
-    int block_end = block_count + block_offset;
-    while (block_offset < block_end)
+    int ret = -1, idx;
+    pthread_rwlock_t * lock;
+
+    pthread_rwlock_rdlock(&fs->tree_lock);
+    if ((idx = get_fildes_index(fs, fildes)) >= 0)
     {
-        if (block_write(block_offset, buf) < 0)
-            return -1;
-        buf += BLOCK_SIZE;
-        block_offset++;
+        lock = lock_file(fs, &fs->descriptors[idx], 0);
+        ret = fs->descriptors[idx].attr->size
+            + file_buffered(fs, &fs->descriptors[idx]);
+        pthread_rwlock_unlock(lock);
     }
-    return block_offset;
+    pthread_rwlock_unlock(&fs->tree_lock);
+    return ret;
 }
-int read_blocks(char * buf, int block_offset, int block_count)
+
+int fs_lseek(fs_t * fs, int fildes, off_t offset)
 {
-    int block_end = block_count + block_offset;
-    while (block_offset < block_end)
+    uint64_t start = stat_clock();
+    int ret = -1, idx;
+    pthread_rwlock_t * lock;
+    Descriptor * desc;
+
+    pthread_rwlock_rdlock(&fs->tree_lock);
+    if ((idx = get_fildes_index(fs, fildes)) >= 0)
     {
-        if (block_read(block_offset, buf) < 0)
-            return -1;
-        buf += BLOCK_SIZE;
-        block_offset++;
+        desc = &fs->descriptors[idx];
+        lock = lock_file(fs, desc, desc->wbuf_len > 0);
+        if (flush_buffer(fs, desc) == 0)
+            ret = seek_file(fs, desc, offset);
+        pthread_rwlock_unlock(lock);
     }
-    return block_offset;
+    pthread_rwlock_unlock(&fs->tree_lock);
+    return stat_call(fs, FS_OP_LSEEK, start, ret, 0);
 }
 
-void init_virt_disk()
+int fs_lseek_data(fs_t * fs, int fildes, off_t offset, int whence)
 {
-    disk = malloc(DISK_BLOCKS * BLOCK_SIZE);
-    memset (disk, 0, DISK_BLOCKS * BLOCK_SIZE);
+    uint64_t start = stat_clock();
+    int ret = -1, idx, flush;
+    pthread_rwlock_t * lock;
+    Descriptor * desc;
 
-    // init superblock
-    super = (Superblock*) disk;
-    super->fat_offset = SUPERBLOCK_BLOCK_SIZE;
-    super->directory_offset = SUPERBLOCK_BLOCK_SIZE + FAT_BLOCK_SIZE;
-    super->data_block_offset = 
-        SUPERBLOCK_BLOCK_SIZE + FAT_BLOCK_SIZE  + DIRECTORY_BLOCK_SIZE;
-    
-    fat = (FAT *) (disk + super->fat_offset * BLOCK_SIZE);
-    dir = (Directory*) (disk + super->directory_offset * BLOCK_SIZE);
-    data = disk + super->data_block_offset * BLOCK_SIZE;
-    
-    // mark filesystem blocks as reserved
-    for (int i = 0; i < super->data_block_offset; i++)
+    pthread_rwlock_rdlock(&fs->tree_lock);
+    if ((idx = get_fildes_index(fs, fildes)) >= 0)
     {
-        fat->table[i] = FAT_RESERVED;
+        // data anyone still buffers for the file is data too
+        desc = &fs->descriptors[idx];
+        flush = has_buffered(fs, desc);
+        lock = lock_file(fs, desc, flush);
+        if (!flush || flush_file(fs, desc->attr) == 0)
+            ret = seek_data(fs, desc, offset, whence);
+        pthread_rwlock_unlock(lock);
     }
-
-    virt_disk_active = 1;
+    pthread_rwlock_unlock(&fs->tree_lock);
+    return stat_call(fs, FS_OP_LSEEK, start, ret, 0);
 }
 
-int free_alloc_chain(int head)
+int fs_truncate(fs_t * fs, int fildes, off_t length)
 {
-    int idx;
-
-    /* this shouldn't happen */
-    if (head > DISK_BLOCKS || head == FAT_RESERVED)
-        return -1;
+    uint64_t start = stat_clock();
+    int ret = resize_fildes(fs, fildes, length, truncate_file);
 
-    idx = fat->table[head];
-    memset(disk + head * BLOCK_SIZE, 0, BLOCK_SIZE);
+    if (ret < 0 && reclaim_space(fs))
+        ret = resize_fildes(fs, fildes, length, truncate_file);
+    return stat_call(fs, FS_OP_TRUNCATE, start, ret, 0);
+}
 
-    /* either unused or probably hit the end of the chain */
-    if (idx == FAT_UNUSED)
-    {
-        return 0;
-    }
+int fs_fallocate(fs_t * fs, int fildes, off_t length)
+{
+    uint64_t start = stat_clock();
+    int ret = resize_fildes(fs, fildes, length, fallocate_file);
 
-    fat->table[head] = FAT_UNUSED;
-    if (idx != FAT_EOF)
-        return free_alloc_chain(idx);
-    else
-        return 0;
+    if (ret < 0 && reclaim_space(fs))
+        ret = resize_fildes(fs, fildes, length, fallocate_file);
+    return stat_call(fs, FS_OP_FALLOCATE, start, ret, 0);
 }
 
-int find_avail_alloc_entry()
+/* resize_fildes -- fs_truncate and fs_fallocate, with the one that does
+ * the work. Appends anyone buffers for the file go in first */
+static int resize_fildes(fs_t * fs, int fildes, off_t length,
+        int (* resize)(fs_t *, int, off_t))
 {
-    int fat_idx = super->data_block_offset;
-    while (fat_idx < DISK_BLOCKS
-            && fat->table[fat_idx] != FAT_UNUSED)
+    int ret = -1, idx;
+    pthread_rwlock_t * lock;
+
+    pthread_rwlock_rdlock(&fs->tree_lock);
+    if ((idx = get_fildes_index(fs, fildes)) >= 0)
     {
-        fat_idx++;
+        lock = lock_file(fs, &fs->descriptors[idx], 1);
+        if (flush_file(fs, fs->descriptors[idx].attr) == 0)
+            ret = resize(fs, idx, length);
+        pthread_rwlock_unlock(lock);
     }
-    
-    if (fat_idx == DISK_BLOCKS)
-        return -1;
-    return fat_idx;
+    pthread_rwlock_unlock(&fs->tree_lock);
+    return ret;
 }
-int get_fildes_index(int fildes)
+
+int fs_clone(fs_t * fs, char * src, char * dst)
 {
-    int i = 0;
+    uint64_t start = stat_clock();
+    int ret;
 
-    if (descriptor_size == 0)
-        return -1;
+    pthread_rwlock_wrlock(&fs->tree_lock);
+    ret = clone_file(fs, src, dst);
+    pthread_rwlock_unlock(&fs->tree_lock);
+    return stat_call(fs, FS_OP_CLONE, start, ret, 0);
+}
 
-    while (i < descriptor_size && descriptors[i].descriptor != fildes)
-    {
-        i++;
-    }
+int fs_snapshot(fs_t * fs, char * name)
+{
+    uint64_t start = stat_clock();
+    int ret;
 
-    if (i == descriptor_size)
-        return -1;
-    return i;
+    pthread_rwlock_wrlock(&fs->tree_lock);
+    ret = take_snapshot(fs, name);
+    pthread_rwlock_unlock(&fs->tree_lock);
+    return stat_call(fs, FS_OP_SNAPSHOT, start, ret, 0);
 }
-int get_file_blocksize(int fildes)
+
+int fs_set_block_index(fs_t * fs, int fildes, int enable)
 {
-    int idx = get_fildes_index(fildes);
+    int idx;
+    Descriptor * desc;
 
-    if (idx < 0)
+    pthread_rwlock_rdlock(&fs->tree_lock);
+    if ((idx = get_fildes_index(fs, fildes)) < 0)
+    {
+        pthread_rwlock_unlock(&fs->tree_lock);
         return -1;
+    }
+    desc = &fs->descriptors[idx];
 
-    return (descriptors[idx].attr->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    free(desc->index);
+    desc->index = NULL;
+    desc->index_size = desc->index_capacity = 0;
+
+    // filled in as the chain gets walked, starting with the head block
+    if (enable)
+        index_block(desc, 0, desc->attr->offset);
+    pthread_rwlock_unlock(&fs->tree_lock);
+    return 0;
 }
-int get_eof_block_idx(int fildes)
-{
-    int block_idx,
-        idx = get_fildes_index(fildes);
 
-    if (idx < 0)
-        return -1;
+int fs_set_compression(fs_t * fs, int fildes, int enable)
+{
+    int ret = -1, idx;
+    pthread_rwlock_t * lock;
+    Descriptor * desc;
 
-    block_idx = descriptors[idx].attr->offset;
-    while (fat->table[block_idx] != FAT_EOF)
+    pthread_rwlock_rdlock(&fs->tree_lock);
+    if ((idx = get_fildes_index(fs, fildes)) >= 0)
     {
-        block_idx = fat->table[block_idx];
+        desc = &fs->descriptors[idx];
+        lock = lock_file(fs, desc, 1);
+        // the bytes of a file without blocks are stored as they are either
+        // way, so that's when it can change
+        if (fs->fat.holes == NULL)
+            printf("fs_set_compression: this image can't compress files\n");
+        else if (desc->attr->offset >= 0)
+            printf("fs_set_compression: file already has blocks\n");
+        else if (!read_only(desc, "fs_set_compression"))
+        {
+            desc->attr->type = enable ? ATTR_COMPRESSED : ATTR_FILE;
+            mark_dirty(desc->parent);
+            ret = 0;
+        }
+        pthread_rwlock_unlock(lock);
+    }
+    pthread_rwlock_unlock(&fs->tree_lock);
+    return ret;
+}
+
+int fs_set_checksums(fs_t * fs, int enable)
+{
+    if (fs == NULL || fs->fat.sums == NULL || fs->cache.mapped)
+    {
+        printf("fs_set_checksums: this image keeps no checksums\n");
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&fs->tree_lock);
+    if (enable)
+        cache_set_sums(&fs->cache, fs->fat.sums, SUMS_DIRTY(fs));
+    else if (fs->cache.sums != NULL)
+    {
+        // blocks written from now on would leave theirs stale
+        cache_set_sums(&fs->cache, NULL, NULL);
+        pthread_mutex_lock(&fs->alloc_lock);
+        forget_sums(fs);
+        pthread_mutex_unlock(&fs->alloc_lock);
+    }
+    pthread_rwlock_unlock(&fs->tree_lock);
+    return 0;
+}
+
+int fs_scrub(fs_t * fs, int rate)
+{
+    if (fs == NULL || rate < 0)
+        return -1;
+    stop_scrub(fs);
+    if (rate == 0)
+        return 0;
+    if (fs->fat.sums == NULL || fs->cache.mapped)
+    {
+        printf("fs_scrub: this image keeps no checksums\n");
+        return -1;
+    }
+
+    fs->scrub_rate = rate;
+    fs->scrub_stopping = 0;
+    if (pthread_create(&fs->scrub_thread, NULL, scrub_worker, fs) != 0)
+    {
+        printf("fs_scrub: couldn't start the scrubber\n");
+        return -1;
+    }
+    fs->scrub_running = 1;
+    return 0;
+}
+
+/* scrub_worker -- goes round the blocks in use, checking the ones that
+ * aren't cached at scrub_rate a second */
+static void * scrub_worker(void * arg)
+{
+    fs_t * fs = arg;
+    struct timespec until;
+    double due = 0;
+    int block = 0,
+        steps;
+    char * buf = malloc(fs->disk.block_size);
+
+    pthread_mutex_lock(&fs->scrub_lock);
+    while (buf != NULL && !fs->scrub_stopping)
+    {
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += SCRUB_TICK * 1000000L;
+        if (until.tv_nsec >= 1000000000L)
+        {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+        while (!fs->scrub_stopping && pthread_cond_timedwait(
+                    &fs->scrub_wake, &fs->scrub_lock, &until) == 0)
+            ;
+        pthread_mutex_unlock(&fs->scrub_lock);
+
+        // a shared tree_lock keeps commits, which write checksums around
+        // the cache, out of the way
+        for (due += fs->scrub_rate * SCRUB_TICK / 1000.0; due >= 1; due--)
+        {
+            pthread_rwlock_rdlock(&fs->tree_lock);
+            pthread_mutex_lock(&fs->alloc_lock);
+            for (steps = 0; steps < fs->disk.blocks
+                    && (fs->fat.table[block] == FAT_UNUSED
+                        || fs->fat.table[block] == FAT_RESERVED); steps++)
+                block = (block + 1) % fs->disk.blocks;
+            pthread_mutex_unlock(&fs->alloc_lock);
+            if (steps < fs->disk.blocks
+                    && cache_scrub(&fs->cache, block, buf) >= 0)
+                STAT_ADD(fs->stats.scrub_blocks, 1);
+            block = (block + 1) % fs->disk.blocks;
+            pthread_rwlock_unlock(&fs->tree_lock);
+        }
+        pthread_mutex_lock(&fs->scrub_lock);
+    }
+    pthread_mutex_unlock(&fs->scrub_lock);
+    free(buf);
+    return NULL;
+}
+static void stop_scrub(fs_t * fs)
+{
+    if (!fs->scrub_running)
+        return;
+    pthread_mutex_lock(&fs->scrub_lock);
+    fs->scrub_stopping = 1;
+    pthread_cond_broadcast(&fs->scrub_wake);
+    pthread_mutex_unlock(&fs->scrub_lock);
+    pthread_join(fs->scrub_thread, NULL);
+    fs->scrub_running = 0;
+}
+
+/* io_worker -- runs fs_submit requests until the mount goes away */
+static void * io_worker(void * arg)
+{
+    fs_t * fs = arg;
+    fs_io_t * io;
+
+    pthread_mutex_lock(&fs->io_lock);
+    while (1)
+    {
+        while (fs->io_pending == NULL && !fs->io_stopping)
+            pthread_cond_wait(&fs->io_work, &fs->io_lock);
+        if ((io = fs->io_pending) == NULL)
+            break;
+        if ((fs->io_pending = io->next) == NULL)
+            fs->io_pending_tail = NULL;
+        pthread_mutex_unlock(&fs->io_lock);
+
+        io->result = transfer_at(fs, io);
+
+        pthread_mutex_lock(&fs->io_lock);
+        io->next = NULL;
+        if (fs->io_done_tail)
+            fs->io_done_tail->next = io;
+        else
+            fs->io_done = io;
+        fs->io_done_tail = io;
+        pthread_cond_broadcast(&fs->io_done_cond);
+    }
+    pthread_mutex_unlock(&fs->io_lock);
+    return NULL;
+}
+
+/* stop_io -- lets the workers finish what was submitted, then joins them */
+static void stop_io(fs_t * fs)
+{
+    pthread_mutex_lock(&fs->io_lock);
+    fs->io_stopping = 1;
+    pthread_cond_broadcast(&fs->io_work);
+    pthread_mutex_unlock(&fs->io_lock);
+
+    for (int i = 0; i < fs->io_nthreads; i++)
+        pthread_join(fs->io_threads[i], NULL);
+    free(fs->io_threads);
+    fs->io_threads = NULL;
+    fs->io_nthreads = 0;
+}
+
+int fs_submit(fs_t * fs, fs_io_t ** ios, int n)
+{
+    pthread_mutex_lock(&fs->io_lock);
+    if (fs->io_threads == NULL && !fs->io_stopping)
+    {
+        fs->io_threads = malloc(FS_IO_THREADS * sizeof(pthread_t));
+        while (fs->io_threads != NULL && fs->io_nthreads < FS_IO_THREADS
+                && pthread_create(&fs->io_threads[fs->io_nthreads], NULL,
+                    io_worker, fs) == 0)
+            fs->io_nthreads++;
+    }
+    if (fs->io_nthreads == 0)
+    {
+        pthread_mutex_unlock(&fs->io_lock);
+        printf("fs_submit: can't start I/O threads\n");
+        return -1;
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+        ios[i]->next = NULL;
+        if (fs->io_pending_tail)
+            fs->io_pending_tail->next = ios[i];
+        else
+            fs->io_pending = ios[i];
+        fs->io_pending_tail = ios[i];
+    }
+    fs->io_outstanding += n;
+    pthread_cond_broadcast(&fs->io_work);
+    pthread_mutex_unlock(&fs->io_lock);
+    return n;
+}
+
+int fs_reap(fs_t * fs, fs_io_t ** done, int min, int max)
+{
+    int got = 0;
+
+    pthread_mutex_lock(&fs->io_lock);
+    // there is no waiting for requests that were never submitted
+    if (min > fs->io_outstanding)
+        min = fs->io_outstanding;
+    while (got < max)
+    {
+        if (fs->io_done != NULL)
+        {
+            done[got++] = fs->io_done;
+            if ((fs->io_done = fs->io_done->next) == NULL)
+                fs->io_done_tail = NULL;
+            fs->io_outstanding--;
+        }
+        else if (got < min)
+            pthread_cond_wait(&fs->io_done_cond, &fs->io_lock);
+        else
+            break;
+    }
+    pthread_mutex_unlock(&fs->io_lock);
+    return got;
+}
+
+int fs_stats(fs_t * fs, fs_stats_t * stats)
+{
+    const uint64_t * from;
+    uint64_t * to = (uint64_t *) stats;
+
+    if (fs == NULL || stats == NULL)
+        return -1;
+
+    // every field is a uint64_t
+    from = (const uint64_t *) &fs->stats;
+    for (size_t i = 0; i < sizeof(fs_stats_t) / sizeof(uint64_t); i++)
+        to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+    for (int i = 0; i < FS_OPS; i++)
+    {
+        stats->ops[i].calls = 0;
+        for (int b = 0; b < FS_STAT_BUCKETS; b++)
+            stats->ops[i].calls += stats->ops[i].hist[b];
+    }
+    stats->disk_syscalls = __atomic_load_n(&fs->disk.syscalls,
+            __ATOMIC_RELAXED);
+    stats->disk_blocks_read = __atomic_load_n(&fs->disk.blocks_read,
+            __ATOMIC_RELAXED);
+    stats->disk_blocks_written = __atomic_load_n(&fs->disk.blocks_written,
+            __ATOMIC_RELAXED);
+    stats->disk_syncs = __atomic_load_n(&fs->disk.syncs, __ATOMIC_RELAXED);
+    stats->cache_hits = __atomic_load_n(&fs->cache.hits, __ATOMIC_RELAXED);
+    stats->cache_misses = __atomic_load_n(&fs->cache.misses,
+            __ATOMIC_RELAXED);
+    stats->checksum_errors = __atomic_load_n(&fs->cache.sum_errors,
+            __ATOMIC_RELAXED);
+    return 0;
+}
+
+void fs_stats_reset(fs_t * fs)
+{
+    uint64_t * counters = (uint64_t *) &fs->stats,
+             * others[] = {
+                 &fs->disk.syscalls, &fs->disk.blocks_read,
+                 &fs->disk.blocks_written, &fs->disk.syncs,
+                 &fs->cache.hits, &fs->cache.misses, &fs->cache.sum_errors
+             };
+
+    for (size_t i = 0; i < sizeof(fs_stats_t) / sizeof(uint64_t); i++)
+        __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+    for (size_t i = 0; i < sizeof(others) / sizeof(others[0]); i++)
+        __atomic_store_n(others[i], 0, __ATOMIC_RELAXED);
+}
+
+uint64_t fs_stats_percentile(const fs_op_stats_t * op, double p)
+{
+    uint64_t want = p * op->calls,
+             seen = 0;
+
+    if (want == 0)
+        want = 1;
+    // the top of the bucket the call ranked 'want' fell in
+    for (int i = 0; i < FS_STAT_BUCKETS - 1; i++)
+    {
+        seen += op->hist[i];
+        if (seen >= want)
+            return (uint64_t) 2 << i < op->max_ns
+                ? (uint64_t) 2 << i : op->max_ns;
+    }
+    return op->max_ns;
+}
+
+int fs_stats_dump(fs_t * fs, FILE * out)
+{
+    uint64_t lookups;
+    fs_stats_t st;
+
+    if (fs_stats(fs, &st) < 0)
+        return -1;
+
+    fprintf(out, "{\"ops\": {");
+    for (int i = 0; i < FS_OPS; i++)
+    {
+        fs_op_stats_t * op = &st.ops[i];
+        fprintf(out, "%s\n  \"%s\": {\"calls\": %" PRIu64
+                ", \"errors\": %" PRIu64 ", \"bytes\": %" PRIu64
+                ", \"total_ns\": %" PRIu64 ", \"max_ns\": %" PRIu64
+                ", \"p50_ns\": %" PRIu64 ", \"p99_ns\": %" PRIu64
+                ", \"hist\": [", i ? "," : "", op_names[i], op->calls,
+                op->errors, op->bytes, op->total_ns, op->max_ns,
+                fs_stats_percentile(op, 0.5), fs_stats_percentile(op, 0.99));
+        for (int b = 0; b < FS_STAT_BUCKETS; b++)
+            fprintf(out, "%s%" PRIu64, b ? ", " : "", op->hist[b]);
+        fprintf(out, "]}");
+    }
+
+    lookups = st.cache_hits + st.cache_misses;
+    fprintf(out, "},\n \"disk\": {\"syscalls\": %" PRIu64
+            ", \"blocks_read\": %" PRIu64 ", \"blocks_written\": %" PRIu64
+            ", \"syncs\": %" PRIu64 "},\n", st.disk_syscalls,
+            st.disk_blocks_read, st.disk_blocks_written, st.disk_syncs);
+    fprintf(out, " \"cache\": {\"hits\": %" PRIu64 ", \"misses\": %" PRIu64
+            ", \"hit_rate\": %.4f},\n", st.cache_hits, st.cache_misses,
+            lookups ? (double) st.cache_hits / lookups : 0.0);
+    fprintf(out, " \"bytes_copied\": %" PRIu64 ",\n", st.bytes_copied);
+    fprintf(out, " \"chain\": {\"walks\": %" PRIu64 ", \"steps\": %" PRIu64
+            "},\n", st.chain_walks, st.chain_steps);
+    fprintf(out, " \"alloc\": {\"scans\": %" PRIu64 ", \"steps\": %" PRIu64
+            "},\n", st.alloc_scans, st.alloc_steps);
+    fprintf(out, " \"journal\": {\"commits\": %" PRIu64
+            ", \"blocks\": %" PRIu64 "},\n", st.commits, st.commit_blocks);
+    fprintf(out, " \"cow\": {\"blocks\": %" PRIu64 "},\n", st.cow_blocks);
+    fprintf(out, " \"clusters\": {\"packed\": %" PRIu64 ", \"raw\": %" PRIu64
+            "},\n", st.clusters_packed, st.clusters_raw);
+    fprintf(out, " \"checksums\": {\"errors\": %" PRIu64
+            ", \"scrubbed\": %" PRIu64 "}}\n", st.checksum_errors,
+            st.scrub_blocks);
+    return ferror(out) ? -1 : 0;
+}
+
+/* stat_clock -- now, in ns, for timing calls */
+static uint64_t stat_clock()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * (uint64_t) 1000000000 + ts.tv_nsec;
+}
+
+/* stat_call -- accounts for a call of kind op that started at 'start',
+ * returned ret and moved 'bytes'. Returns ret */
+static int stat_call(fs_t * fs, int op, uint64_t start, int ret,
+        size_t bytes)
+{
+    fs_op_stats_t * s = &fs->stats.ops[op];
+    uint64_t ns = stat_clock() - start,
+             max = __atomic_load_n(&s->max_ns, __ATOMIC_RELAXED);
+    int bucket = 63 - __builtin_clzll(ns | 1);
+
+    if (bucket >= FS_STAT_BUCKETS)
+        bucket = FS_STAT_BUCKETS - 1;
+    // calls is the histogram's total, worked out by fs_stats
+    if (ret < 0)
+        STAT_ADD(s->errors, 1);
+    if (bytes > 0)
+        STAT_ADD(s->bytes, bytes);
+    STAT_ADD(s->total_ns, ns);
+    STAT_ADD(s->hist[bucket], 1);
+    while (ns > max && !__atomic_compare_exchange_n(&s->max_ns, &max, ns, 1,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    return ret;
+}
+
+/* open_file, close_file, ... -- the bodies of the calls above, run with
+ * the locks they need already held */
+static int open_file(fs_t * fs, char * name)
+{
+    int idx = 0;
+    char leaf[MAX_FILENAME];
+    Descriptor * desc;
+    Directory * parent;
+    Attribute * attr;
+
+    parent = resolve_parent(fs, name, leaf);
+    idx = parent ? dir_lookup(parent, leaf) : -1;
+    if (idx < 0)
+    {
+        printf("fs_open: file not found: %s\n", name);
+        return -1;
+    }
+    attr = &parent->attributes[idx];
+    if (!is_file(attr))
+    {
+        printf("fs_open: is a directory: %s\n", name);
+        return -1;
+    }
+
+    // find an empty descriptor spot
+    parent->open_counts[idx]++;
+    idx = alloc_descriptor(fs);
+    if (idx < 0)
+    {
+        parent->open_counts[attr - parent->attributes]--;
+        printf("fs_open: can't open more files\n");
+        return -1;
+    }
+    desc = &fs->descriptors[idx];
+
+    // finally, create a descriptor
+    desc->descriptor = idx;
+    desc->offset = 0;
+    desc->block = attr->offset;
+    desc->block_num = 0;
+    desc->hole = 0;
+    desc->index = NULL;
+    desc->index_size = desc->index_capacity = 0;
+    desc->ra_offset = desc->ra_window = desc->ra_next = 0;
+    desc->wbuf = NULL;
+    desc->wbuf_len = desc->wbuf_blocks = desc->wbuf_error = 0;
+    desc->cow_private = 0;
+    desc->zbuf = NULL;
+    desc->zbuf_cluster = -1;
+    desc->zbuf_dirty = 0;
+    desc->attr = attr;
+    desc->parent = parent;
+    fs->descriptor_size++;
+
+    return desc->descriptor;
+}
+
+static int close_file(fs_t * fs, int fildes)
+{
+    Descriptor * desc;
+    int idx = get_fildes_index(fs, fildes),
+        ret;
+    if (idx < 0)
+    {
+        printf("fs_close: file with descriptor %d doesn't exist\n", fildes);
+        return -1;
+    }
+    desc = &fs->descriptors[idx];
+    // closed either way, but a write that didn't make it is reported
+    ret = flush_buffer(fs, desc);
+    if (take_error(desc))
+        ret = -1;
+    if (pack_cluster(fs, desc) < 0)
+        ret = -1;
+    free(desc->wbuf);
+    free(desc->zbuf);
+    free(desc->index);
+    desc->parent->open_counts[desc->attr - desc->parent->attributes]--;
+    fs->descriptor_size--;
+
+    // put the slot back on the free list
+    desc->descriptor = DESCRIPTOR_UNUSED;
+    desc->next_free = fs->descriptor_free;
+    fs->descriptor_free = idx;
+
+    return ret;
+}
+
+static int delete_file(fs_t * fs, char * name)
+{
+    int idx;    /* index of file with matching name */
+    char leaf[MAX_FILENAME];
+    Directory * parent = resolve_parent(fs, name, leaf);
+
+    idx = parent ? dir_lookup(parent, leaf) : -1;
+    if (idx < 0)
+    {
+        printf("fs_delete: file not found: %s\n", name);
+        return -1;
+    }
+
+    if (!is_file(&parent->attributes[idx]))
+    {
+        printf("fs_delete: is a directory: %s\n", name);
+        return -1;
+    }
+
+    if (parent->open_counts[idx] > 0)
+    {
+        printf("fs_delete: can't delete, file is open: %s\n", name);
+        return -1;
+    }
+
+    if (parent->readonly)
+    {
+        printf("fs_delete: read-only snapshot: %s\n", name);
+        return -1;
+    }
+
+    // finally "delete" the file
+    free_alloc_chain(fs, parent->attributes[idx].offset);
+    dir_remove_entry(fs, parent, idx);
+    return 0;
+}
+
+static int remove_directory(fs_t * fs, char * name)
+{
+    int idx;
+    char leaf[MAX_FILENAME];
+    Directory * parent = resolve_parent(fs, name, leaf),
+              * victim;
+
+    idx = parent ? dir_lookup(parent, leaf) : -1;
+    if (idx < 0 || is_file(&parent->attributes[idx]))
+    {
+        printf("fs_rmdir: directory not found: %s\n", name);
+        return -1;
+    }
+    if (parent->readonly)
+    {
+        printf("fs_rmdir: read-only snapshot: %s\n", name);
+        return -1;
+    }
+
+    victim = enter(fs, parent, idx);
+    if (victim == NULL)
+        return -1;
+
+    // a snapshot goes all at once, unless something in it is open
+    if (parent->attributes[idx].type == ATTR_SNAPSHOT
+            && tree_busy(fs, victim))
+    {
+        printf("fs_rmdir: a file in the snapshot is open: %s\n", name);
+        return -1;
+    }
+    if (parent->attributes[idx].type == ATTR_SNAPSHOT
+            && drop_tree(fs, victim) < 0)
+        return -1;
+    if (victim->size > 0)
+    {
+        printf("fs_rmdir: directory not empty: %s\n", name);
+        return -1;
+    }
+
+    // drop it from the cache, then give back its chain and entry
+    forget_directory(fs, victim);
+    free_alloc_chain(fs, parent->attributes[idx].offset);
+    dir_remove_entry(fs, parent, idx);
+    return 0;
+}
+
+static int read_directory(fs_t * fs, char * name, int pos, Attribute * entry)
+{
+    int idx;
+    char leaf[MAX_FILENAME];
+    Directory * d = resolve_parent(fs, name, leaf);
+
+    // an empty leaf means the path named the directory itself, e.g. "/"
+    if (d != NULL && leaf[0] != '\0')
+    {
+        idx = dir_lookup(d, leaf);
+        d = idx >= 0 && !is_file(&d->attributes[idx])
+            ? enter(fs, d, idx) : NULL;
+    }
+    if (d == NULL)
+    {
+        printf("fs_readdir: directory not found: %s\n", name);
+        return -1;
+    }
+
+    if (pos < 0 || pos >= d->size)
+        return 0;
+    *entry = d->attributes[pos];
+    return 1;
+}
+
+static int clone_file(fs_t * fs, char * src, char * dst)
+{
+    char leaf[MAX_FILENAME], dst_leaf[MAX_FILENAME];
+    Directory * from = resolve_parent(fs, src, leaf),
+              * to;
+    Attribute * attr;
+    int idx;
+
+    idx = from ? dir_lookup(from, leaf) : -1;
+    if (idx < 0 || !is_file(&from->attributes[idx]))
+    {
+        printf("fs_clone: file not found: %s\n", src);
+        return -1;
+    }
+    if (fs->fat.refs == NULL && from->attributes[idx].offset >= 0)
+    {
+        printf("fs_clone: this image can't share blocks\n");
+        return -1;
+    }
+    to = resolve_parent(fs, dst, dst_leaf);
+    if (to == NULL || !valid_leaf(dst_leaf))
+    {
+        printf("fs_clone: invalid name: %s\n", dst);
+        return -1;
+    }
+    if (to->readonly)
+    {
+        printf("fs_clone: read-only snapshot: %s\n", dst);
+        return -1;
+    }
+    if (dir_lookup(to, dst_leaf) >= 0)
+    {
+        printf("fs_clone: file already exists: %s\n", dst);
+        return -1;
+    }
+
+    // buffered appends don't have blocks to share yet, and making room in
+    // 'to' may move src's entry
+    if (flush_file(fs, &from->attributes[idx]) < 0
+            || dir_reserve(fs, to, to->size + 1) < 0
+            || append_file(fs, to, dst_leaf, from, idx) < 0)
+        return -1;
+    attr = &from->attributes[idx];
+
+    // nothing in src is its own any more
+    for (int i = 0; i < fs->descriptor_capacity; i++)
+    {
+        if (fs->descriptors[i].descriptor != DESCRIPTOR_UNUSED
+                && fs->descriptors[i].attr == attr)
+            fs->descriptors[i].cow_private = 0;
+    }
+    return 0;
+}
+
+static int take_snapshot(fs_t * fs, char * name)
+{
+    char leaf[MAX_FILENAME];
+    Directory * parent, * snap;
+
+    if (fs->fat.refs == NULL)
+    {
+        printf("fs_snapshot: this image can't share blocks\n");
+        return -1;
+    }
+
+    // buffered appends don't have blocks to share yet
+    if (flush_buffers(fs) < 0 || create_entry(fs, name, ATTR_SNAPSHOT) < 0)
+        return -1;
+    parent = resolve_parent(fs, name, leaf);
+    snap = enter(fs, parent, dir_lookup(parent, leaf));
+    if (snap == NULL || copy_tree(fs, fs->dir, snap) < 0)
+    {
+        printf("fs_snapshot: couldn't copy the tree into %s\n", name);
+        return -1;
+    }
+
+    // nothing in any open file is its own any more
+    for (int i = 0; i < fs->descriptor_capacity; i++)
+        fs->descriptors[i].cow_private = 0;
+    return 0;
+}
+
+/* copy_tree -- fills the new directory 'to' with what 'from' holds: the same
+ * files, sharing their blocks, and a copy of each directory. Snapshots are
+ * left out, the one being taken included */
+static int copy_tree(fs_t * fs, Directory * from, Directory * to)
+{
+    Directory * sub;
+    Attribute attr;
+    int head;
+
+    for (int i = 0; i < from->size; i++)
+    {
+        attr = from->attributes[i];
+        if (attr.type == ATTR_SNAPSHOT)
+            continue;
+        if (dir_reserve(fs, to, to->size + 1) < 0)
+            return -1;
+
+        if (is_file(&attr))
+        {
+            if (append_file(fs, to, attr.name, from, i) < 0)
+                return -1;
+            continue;
+        }
+        if ((head = alloc_entry(fs, -1)) < 0
+                || cache_zero(&fs->cache, head) < 0)
+            return -1;
+        append_entry(to, attr.name, attr.type, head, attr.size);
+
+        if (attr.type == ATTR_DIR
+                && ((sub = enter(fs, to, to->size - 1)) == NULL
+                    || copy_tree(fs, enter(fs, from, i), sub) < 0))
+            return -1;
+    }
+    return 0;
+}
+
+/* append_file -- adds a file 'name' to 'to' holding what the file at
+ * from's 'slot' does: sharing its chain, or a copy of its bytes if it has no
+ * blocks. dir_reserve has made room for it */
+static int append_file(fs_t * fs, Directory * to, const char * name,
+        Directory * from, int slot)
+{
+    Attribute * attr = &from->attributes[slot];
+
+    if (attr->offset >= 0)
+    {
+        pthread_mutex_lock(&fs->alloc_lock);
+        set_refs(fs, attr->offset, fs->fat.refs[attr->offset] + 1);
+        pthread_mutex_unlock(&fs->alloc_lock);
+        append_entry(to, name, attr->type, attr->offset, attr->size);
+        return 0;
+    }
+
+    append_entry(to, name, attr->type, FAT_EOF, 0);
+    if (resize_data(fs, to, to->size - 1, attr->size) < 0)
+    {
+        dir_remove_entry(fs, to, to->size - 1);
+        return -1;
+    }
+    if (attr->size > 0)
+        memcpy(to->data[to->size - 1], from->data[slot], attr->size);
+    to->attributes[to->size - 1].size = attr->size;
+    return 0;
+}
+
+/* drop_tree -- deletes everything in d, directories and all */
+static int drop_tree(fs_t * fs, Directory * d)
+{
+    Directory * sub;
+
+    for (int i = 0; i < d->size; i++)
+    {
+        if (!is_file(&d->attributes[i]))
+        {
+            if ((sub = enter(fs, d, i)) == NULL || drop_tree(fs, sub) < 0)
+                return -1;
+            forget_directory(fs, sub);
+        }
+        resize_data(fs, d, i, 0);
+        free_alloc_chain(fs, d->attributes[i].offset);
+    }
+    d->size = 0;
+    d->dirty = 1;
+    return build_dir_index(d);
+}
+
+/* tree_busy -- whether a file anywhere under d is open. Only looks at the
+ * directories that have been loaded, the others can't have open files */
+static int tree_busy(fs_t * fs, Directory * d)
+{
+    Directory * sub;
+
+    for (int i = 0; i < d->size; i++)
+    {
+        if (is_file(&d->attributes[i]))
+        {
+            if (d->open_counts[i] > 0)
+                return 1;
+        }
+        else if ((sub = fs->dcache[d->attributes[i].offset]) != NULL
+                && tree_busy(fs, sub))
+            return 1;
+    }
+    return 0;
+}
+
+static int seek_file(fs_t * fs, Descriptor * desc, off_t offset)
+{
+    // past EOF is a hole, on images that have them
+    if (desc->attr->size < offset && fs->fat.holes == NULL)
+        return -1;
+    if (offset < 0 || offset > INT_MAX)
+        return -1;
+    // a file without blocks only has the offset
+    if (desc->attr->offset < 0)
+    {
+        desc->offset = offset;
+        return 0;
+    }
+
+    // block holding the byte just before offset, see Descriptor
+    if (seek_block(fs, desc,
+                offset ? (offset - 1) / fs->disk.block_size : 0) < 0)
+        return -1;
+    desc->offset = offset;
+
+    return 0;
+}
+
+/* seek_data -- seek_file() to the first byte at or after offset that is
+ * data or in a hole, as whence says. Looks from a copy of the descriptor,
+ * so it stays put if there's none */
+static int seek_data(fs_t * fs, Descriptor * desc, off_t offset, int whence)
+{
+    Descriptor probe = *desc;
+    int bs = fs->disk.block_size,
+        size = desc->attr->size,
+        cluster = offset / CLUSTER_BYTES,
+        block,
+        num;
+    off_t found = offset;
+
+    if (offset < 0 || offset >= size
+            || (whence != FS_SEEK_DATA && whence != FS_SEEK_HOLE))
+        return -1;
+
+    // a file without blocks is all data
+    probe.index_capacity = -1;
+    if (desc->attr->offset < 0)
+        found = whence == FS_SEEK_DATA ? offset : size;
+    else if (desc->attr->type == ATTR_COMPRESSED)
+    {
+        // the first cluster that has a block, or doesn't
+        while ((off_t) cluster * CLUSTER_BYTES < size
+                && (cluster_blocks(fs, &probe, cluster, &block, 1) > 0)
+                == (whence == FS_SEEK_HOLE))
+            cluster++;
+        if ((off_t) cluster * CLUSTER_BYTES > offset)
+            found = (off_t) cluster * CLUSTER_BYTES;
+    }
+    else if (seek_block(fs, &probe, offset / bs) < 0)
+        return -1;
+    else if (whence == FS_SEEK_DATA && probe.hole > 0)
+    {
+        // the block after the hole, if the file doesn't end in it
+        block = probe.block;
+        num = probe.block_num - probe.hole;
+        if (fs->fat.table[block] < 0)
+            return -1;
+        found = (off_t) (num + 1 + holes_after(fs, block)) * bs;
+    }
+    else if (whence == FS_SEEK_HOLE && probe.hole == 0)
+    {
+        // the end of the run of blocks without holes between them
+        block = probe.block;
+        num = probe.block_num;
+        while (holes_after(fs, block) == 0 && fs->fat.table[block] >= 0
+                && (off_t) (num + 1) * bs < size)
+        {
+            block = fs->fat.table[block];
+            num++;
+        }
+        found = (off_t) (num + 1) * bs;
+    }
+
+    if (found > size)
+        found = size;
+    if (whence == FS_SEEK_DATA && found >= size)
+        return -1;
+    return seek_file(fs, desc, found) < 0 ? -1 : found;
+}
+
+static int truncate_file(fs_t * fs, int idx, off_t length)
+{
+    int blocks,
+        fat_idx,
+        eof_idx,
+        eof_num,
+        cluster = length / CLUSTER_BYTES,
+        packed = 0;
+    Attribute * attr = fs->descriptors[idx].attr;
+
+    if (read_only(&fs->descriptors[idx], "fs_truncate"))
+        return -1;
+    if (length < 0 || too_large(length, 0, "fs_truncate"))
+        return -1;
+    if (attr->type == ATTR_COMPRESSED && flush_file(fs, attr) < 0)
+        return -1;
+    if (attr->size < length)
+        return grow_file(fs, idx, length);
+    if (attr->offset < 0)
+        return truncate_inline(fs, &fs->descriptors[idx], length);
+
+    // a compressed cluster the cut goes through is unpacked before its
+    // blocks are cut like any others, and packed again afterwards
+    if (attr->type == ATTR_COMPRESSED && length % CLUSTER_BYTES)
+    {
+        Descriptor * desc = &fs->descriptors[idx];
+        if (load_cluster(fs, desc, cluster) < 0)
+            return -1;
+        memset(desc->zbuf + length % CLUSTER_BYTES, 0,
+                CLUSTER_BYTES - length % CLUSTER_BYTES);
+        packed = 1;
+    }
+
+    // truncated file's block footprint, the head block always stays
+    blocks = (length + fs->disk.block_size - 1) / fs->disk.block_size;
+    if (blocks == 0)
+        blocks = 1;
+
+    // its new last block gets a new FAT entry and the end of it zeroed
+    if (unshare(fs, &fs->descriptors[idx], blocks - 1, 0, 0) < 0)
+        return -1;
+
+    // the file's final block, which is followed by a hole if the cut is
+    // in one
+    eof_idx = block_before(fs, attr, blocks - 1, &eof_num);
+
+    // set truncated block's end as EOF and free the rest
+    fat_idx = fs->fat.table[eof_idx];
+    if (fat_idx != FAT_EOF || holes_after(fs, eof_idx) > 0)
+    {
+        if (fat_idx != FAT_EOF)
+            free_alloc_chain(fs, fat_idx);
+        pthread_mutex_lock(&fs->alloc_lock);
+        set_fat_entry(fs, eof_idx, FAT_EOF);
+        if (holes_after(fs, eof_idx) > 0)
+            set_holes(fs, eof_idx, 0);
+        pthread_mutex_unlock(&fs->alloc_lock);
+    }
+
+    // trim the rest of the EOF block
+    if (eof_num == blocks - 1
+            && (length % fs->disk.block_size || length == 0))
+    {
+        char * block = cache_get(&fs->cache, eof_idx, CACHE_WRITE);
+        if (block == NULL)
+            return -1;
+        memset(block + length % fs->disk.block_size, 0,
+                fs->disk.block_size - length % fs->disk.block_size);
+        cache_put(&fs->cache, eof_idx);
+    }
+    attr->size = length;
+    mark_dirty(fs->descriptors[idx].parent);
+
+    // every descriptor on this file may point into the freed blocks
+    for (int i = 0; i < fs->descriptor_capacity; i++)
+    {
+        Descriptor * desc = &fs->descriptors[i];
+        if (desc->descriptor == DESCRIPTOR_UNUSED || desc->attr != attr)
+            continue;
+        if (desc->index_size > eof_num + 1)
+            desc->index_size = eof_num + 1;
+        if (desc->cow_private > eof_num + 1)
+        {
+            desc->cow_private = eof_num + 1;
+            desc->cow_tail = eof_idx;
+        }
+        if (desc->offset > length)
+        {
+            desc->block = attr->offset;
+            desc->block_num = desc->hole = 0;
+            desc->offset = 0;
+            seek_file(fs, desc, length);
+        }
+        if (desc->zbuf_cluster >= cluster && !(packed && i == idx))
+            desc->zbuf_cluster = -1;
+    }
+    if (packed)
+    {
+        dirty_cluster(fs, &fs->descriptors[idx]);
+        return pack_cluster(fs, &fs->descriptors[idx]);
+    }
+    return 0;
+}
+
+/* grow_file -- truncate_file() to a larger length, which leaves a hole at
+ * the end of the file. Images without holes get zeroed blocks instead, as
+ * do files that still fit in their directory */
+static int grow_file(fs_t * fs, int idx, off_t length)
+{
+    Descriptor * desc = &fs->descriptors[idx];
+
+    if (fs->fat.holes == NULL
+            || (desc->attr->offset < 0 && length <= INLINE_MAX(fs)))
+        return fallocate_file(fs, idx, length);
+    if (desc->attr->offset < 0 && materialize(fs, desc) < 0)
+        return -1;
+    if (desc->attr->type == ATTR_COMPRESSED)
+        return grow_clusters(fs, desc, length);
+
+    // past the old EOF the last block is zeros already, see truncate_file()
+    desc->attr->size = length;
+    mark_dirty(desc->parent);
+    return 0;
+}
+
+static int fallocate_file(fs_t * fs, int idx, off_t length)
+{
+    int need,
+        eof_idx,
+        eof_num;
+    Attribute * attr = fs->descriptors[idx].attr;
+
+    if (read_only(&fs->descriptors[idx], "fs_fallocate"))
+        return -1;
+    if (too_large(length, 0, "fs_fallocate"))
+        return -1;
+    if (length <= attr->size)
+        return 0;
+    if (attr->type == ATTR_COMPRESSED && flush_file(fs, attr) < 0)
+        return -1;
+
+    // zeros a file without blocks has room for go in its directory too
+    if (attr->offset < 0 && length <= INLINE_MAX(fs))
+    {
+        Directory * parent = fs->descriptors[idx].parent;
+        if (resize_data(fs, parent, attr - parent->attributes, length) < 0)
+            return -1;
+        attr->size = length;
+        mark_dirty(parent);
+        return 0;
+    }
+    if (attr->offset < 0 && materialize(fs, &fs->descriptors[idx]) < 0)
+        return -1;
+    // there's no telling what a compressed file's blocks will hold
+    if (attr->type == ATTR_COMPRESSED)
+        return grow_clusters(fs, &fs->descriptors[idx], length);
+
+    // the last block is zeroed past EOF and linked on from. Blocks go
+    // after it, filling any hole the file ends in; holes before it stay
+    if (unshare(fs, &fs->descriptors[idx], last_block(fs, attr), 0, 0) < 0)
+        return -1;
+    eof_idx = block_before(fs, attr, INT_MAX, &eof_num);
+    need = (length + fs->disk.block_size - 1) / fs->disk.block_size
+        - (eof_num + 1);
+
+    // zero what's left of the current last block
+    if (eof_num == last_block(fs, attr)
+            && (attr->size == 0 || attr->size % fs->disk.block_size))
+    {
+        char * block = cache_get(&fs->cache, eof_idx, CACHE_WRITE);
+        if (block == NULL)
+            return -1;
+        memset(block + attr->size % fs->disk.block_size, 0,
+                fs->disk.block_size - attr->size % fs->disk.block_size);
+        cache_put(&fs->cache, eof_idx);
+    }
+
+    pthread_mutex_lock(&fs->alloc_lock);
+    if (need > avail_blocks(fs))
+    {
+        pthread_mutex_unlock(&fs->alloc_lock);
+        printf("fs_fallocate: not enough space\n");
+        return -1;
+    }
+
+    // hold the whole range up front so it comes out as one extent
+    if (need > 0 && fs->alloc_mode == ALLOC_EXTENT)
+    {
+        int start = eof_idx + 1;
+        if (start >= fs->disk.blocks || block_taken(fs, start))
+            start = find_free_run(fs, start, need);
+        if (start >= 0)
+        {
+            reserve_run(fs, start, need);
+            set_fat_entry(fs, start, FAT_EOF);
+            set_fat_entry(fs, eof_idx, start);
+            eof_idx = start;
+            cache_zero(&fs->cache, eof_idx);
+            need--;
+        }
+    }
+    pthread_mutex_unlock(&fs->alloc_lock);
+
+    // blocks may still hold whatever a deleted file left there
+    for (int i = 0; i < need && eof_idx >= 0; i++)
+    {
+        // someone else got the space between the check and here
+        if ((eof_idx = alloc_entry(fs, eof_idx)) >= 0)
+            cache_zero(&fs->cache, eof_idx);
+    }
+    reseat(fs, &fs->descriptors[idx]);
+    if (eof_idx < 0)
+        return -1;
+
+    attr->size = length;
+    mark_dirty(fs->descriptors[idx].parent);
+    return 0;
+}
+
+static int write_file(fs_t * fs, Descriptor * desc, struct iovec * iov,
+        int iovcnt)
+{
+    size_t nbyte = 0;
+    int blocks,
+        others;
+
+    if (read_only(desc, "fs_write") || take_error(desc))
+        return -1;
+    for (int i = 0; i < iovcnt; i++)
+        nbyte += iov[i].iov_len;
+    // buffered appends go after offset
+    if (too_large((off_t) desc->offset + desc->wbuf_len, nbyte, "fs_write"))
+        return -1;
+
+    // bytes a file without blocks keeps go straight to its directory
+    if (desc->attr->offset < 0
+            && desc->offset + nbyte <= (size_t) INLINE_MAX(fs))
+        return transfer(fs, desc, iov, iovcnt, 1);
+    if (desc->attr->offset < 0 && materialize(fs, desc) < 0)
+        return -1;
+
+    // a small append goes to the buffer, after whatever is already there.
+    // Not one after a hole, which has to be filled in first, nor one to a
+    // compressed file, which has its cluster for that. Only one descriptor
+    // on a file buffers at a time, so its appends stay in order
+    others = file_buffered(fs, desc) - desc->wbuf_len;
+    if (nbyte < WRITE_BUFFER && desc->offset == desc->attr->size
+            && desc->hole == 0 && desc->attr->type != ATTR_COMPRESSED
+            && others == 0)
+    {
+        if (desc->wbuf_len + nbyte > WRITE_BUFFER
+                && flush_buffer(fs, desc) < 0)
+            return -1;
+        // the size the file ends up with is checked before saying yes
+        if ((blocks = buffer_blocks(fs, desc, desc->wbuf_len + nbyte)) < 0)
+            return -1;
+        if (desc->wbuf == NULL)
+            desc->wbuf = malloc(WRITE_BUFFER);
+        if (desc->wbuf != NULL && hold_blocks(fs, desc, blocks) == 0)
+        {
+            if (desc->wbuf_len == 0)
+                __atomic_add_fetch(&fs->buffered, 1, __ATOMIC_RELAXED);
+            for (int i = 0; i < iovcnt; i++)
+            {
+                memcpy(desc->wbuf + desc->wbuf_len, iov[i].iov_base,
+                        iov[i].iov_len);
+                desc->wbuf_len += iov[i].iov_len;
+            }
+            STAT_ADD(fs->stats.bytes_copied, nbyte);
+            return nbyte;
+        }
+    }
+
+    if ((others > 0 ? flush_file(fs, desc->attr)
+                : flush_buffer(fs, desc)) < 0)
+        return -1;
+    return transfer(fs, desc, iov, iovcnt, 1);
+}
+
+/* buffer_blocks -- how many blocks desc's file grows by with nbyte more
+ * bytes at its end. -1 if it would grow too large */
+static int buffer_blocks(fs_t * fs, Descriptor * desc, size_t nbyte)
+{
+    off_t bs = fs->disk.block_size,
+          have = (desc->attr->size + bs - 1) / bs;
+
+    if (too_large(desc->attr->size, nbyte, "fs_write"))
+        return -1;
+
+    // a file always owns at least its head block
+    if (have == 0)
+        have = 1;
+    have = (desc->attr->size + (off_t) nbyte + bs - 1) / bs - have;
+    return have > 0 ? have : 0;
+}
+
+/* hold_blocks -- counts blocks as taken by desc's buffer, which now needs
+ * 'blocks' of them in all. -1 if the disk doesn't have that many left */
+static int hold_blocks(fs_t * fs, Descriptor * desc, int blocks)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&fs->alloc_lock);
+    if (blocks - desc->wbuf_blocks > avail_blocks(fs))
+        ret = -1;
+    else
+    {
+        fs->pending_blocks += blocks - desc->wbuf_blocks;
+        desc->wbuf_blocks = blocks;
+    }
+    pthread_mutex_unlock(&fs->alloc_lock);
+    return ret;
+}
+
+/* flush_buffer -- writes out desc's buffered appends. Only now do they get
+ * blocks, so the ones they need are held as a single run first. -1 if they
+ * didn't all make it */
+static int flush_buffer(fs_t * fs, Descriptor * desc)
+{
+    struct iovec iov = { desc->wbuf, desc->wbuf_len };
+    int blocks = desc->wbuf_blocks,
+        tail;
+
+    if (desc->wbuf_len == 0)
+        return 0;
+    // the last block of the chain is about to be linked on from
+    if (unshare(fs, desc, last_block(fs, desc->attr), 0, 0) < 0)
+        return -1;
+    hold_blocks(fs, desc, 0);
+    __atomic_sub_fetch(&fs->buffered, 1, __ATOMIC_RELAXED);
+    desc->wbuf_len = 0;
+
+    if (blocks > 1 && fs->alloc_mode == ALLOC_EXTENT
+            && fs->fat.table[desc->block] == FAT_EOF)
+    {
+        tail = reserve_ahead(fs, desc->block, blocks);
+        // the run starts elsewhere and is already linked in
+        if (tail != desc->block && cache_zero(&fs->cache, tail) < 0)
+            return -1;
+    }
+    return transfer(fs, desc, &iov, 1, 1) == (int) iov.iov_len ? 0 : -1;
+}
+
+/* take_error -- whether a flush of desc's buffer for the whole mount
+ * failed since the last call on it that reported one. This one does */
+static int take_error(Descriptor * desc)
+{
+    if (!desc->wbuf_error)
+        return 0;
+    desc->wbuf_error = 0;
+    return 1;
+}
+
+/* has_buffered -- whether reading desc's file means flushing buffered
+ * appends or a dirty cluster first, either desc's or those of another
+ * descriptor on it */
+static int has_buffered(fs_t * fs, Descriptor * desc)
+{
+    return desc->wbuf_len > 0 || desc->zbuf_dirty
+        || (__atomic_load_n(&fs->buffered, __ATOMIC_RELAXED) > 0
+            && get_open_count(desc->parent,
+                desc->attr - desc->parent->attributes) > 1);
+}
+
+/* file_buffered -- how many bytes of appends desc's file has buffered,
+ * by desc or another descriptor on it */
+static int file_buffered(fs_t * fs, Descriptor * desc)
+{
+    int ret = desc->wbuf_len;
+
+    if (__atomic_load_n(&fs->buffered, __ATOMIC_RELAXED) == 0
+            || get_open_count(desc->parent,
+                desc->attr - desc->parent->attributes) < 2)
+        return ret;
+    for (int i = 0; i < fs->descriptor_capacity; i++)
+    {
+        if (fs->descriptors[i].descriptor != DESCRIPTOR_UNUSED
+                && fs->descriptors[i].attr == desc->attr
+                && &fs->descriptors[i] != desc)
+            ret += fs->descriptors[i].wbuf_len;
+    }
+    return ret;
+}
+
+/* flush_file -- flush_buffer and pack_cluster for every descriptor open on
+ * attr's file */
+static int flush_file(fs_t * fs, Attribute * attr)
+{
+    int ret = 0;
+
+    for (int i = 0; i < fs->descriptor_capacity; i++)
+    {
+        if (fs->descriptors[i].descriptor == DESCRIPTOR_UNUSED
+                || fs->descriptors[i].attr != attr)
+            continue;
+        // the descriptor's owner hears about it too, see take_error()
+        if (flush_buffer(fs, &fs->descriptors[i]) < 0
+                || pack_cluster(fs, &fs->descriptors[i]) < 0)
+        {
+            fs->descriptors[i].wbuf_error = 1;
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+/* unshare -- copies each block desc's file shares with others, from its
+ * head through the last one at or before logical block 'last', so it can
+ * write them and relink the last. A copy links on to the rest of
+ * the shared chain. Copies of blocks that bytes 'from' up to 'to' cover
+ * whole are only zeroed, the caller is about to overwrite them. Every
+ * descriptor on the file is repointed at the copies */
+static int unshare(fs_t * fs, Descriptor * desc, int last, off_t from,
+        off_t to)
+{
+    Descriptor ** others = NULL;
+    Attribute * attr = desc->attr;
+    int bs = fs->disk.block_size,
+        n = desc->cow_private,
+        prev = n > 0 ? desc->cow_tail : -1,
+        nothers = -1,
+        block,
+        copy,
+        next,
+        ok;
+    char * src, * dst;
+
+    if (fs->fat.refs == NULL || last < n
+            || __atomic_load_n(&fs->shared, __ATOMIC_RELAXED) == 0)
+        return 0;
+    if (last > last_block(fs, attr))
+        last = last_block(fs, attr);
+
+    // once a block has been copied the next one has a reference from the
+    // copy too, so it's copied as well, and so on through 'last'. n counts
+    // the holes in between as well
+    block = prev >= 0 ? fs->fat.table[prev] : attr->offset;
+    for (; n <= last && block >= 0; n += 1 + holes_after(fs, block),
+            prev = block, block = fs->fat.table[block])
+    {
+        if (__atomic_load_n(&fs->fat.refs[block], __ATOMIC_RELAXED) == 0)
+            continue;
+
+        // the other descriptors on the file, a copy's original among
+        // them, see transfer_at()
+        if (nothers < 0)
+        {
+            int count = get_open_count(desc->parent,
+                    attr - desc->parent->attributes)
+                - (desc->index_capacity >= 0);
+            if (count > 0 && (others = malloc(count * sizeof *others)) == NULL)
+                return -1;
+            nothers = 0;
+            for (int i = 0; nothers < count && i < fs->descriptor_capacity;
+                    i++)
+            {
+                if (fs->descriptors[i].descriptor != DESCRIPTOR_UNUSED
+                        && fs->descriptors[i].attr == attr
+                        && &fs->descriptors[i] != desc)
+                    others[nothers++] = &fs->descriptors[i];
+            }
+        }
+
+        // linked in where the shared block was, and to nothing yet
+        if ((copy = alloc_entry(fs, prev)) < 0)
+        {
+            printf("unshare: not enough space to copy shared blocks\n");
+            free(others);
+            return -1;
+        }
+        if (from <= (off_t) n * bs && (off_t) (n + 1) * bs <= to)
+            ok = cache_zero(&fs->cache, copy) == 0;
+        else
+        {
+            src = cache_get(&fs->cache, block, CACHE_READ);
+            dst = src ? cache_get(&fs->cache, copy, CACHE_OVERWRITE) : NULL;
+            if ((ok = dst != NULL))
+            {
+                memcpy(dst, src, bs);
+                cache_put(&fs->cache, copy);
+            }
+            if (src != NULL)
+                cache_put(&fs->cache, block);
+        }
+
+        pthread_mutex_lock(&fs->alloc_lock);
+        if (!ok)
+        {
+            // back the way it was
+            if (prev >= 0)
+                set_fat_entry(fs, prev, block);
+            set_fat_entry(fs, copy, FAT_UNUSED);
+            pthread_mutex_unlock(&fs->alloc_lock);
+            free(others);
+            return -1;
+        }
+        next = fs->fat.table[block];
+        set_fat_entry(fs, copy, next);
+        if (holes_after(fs, block) > 0)
+            set_holes(fs, copy, holes_after(fs, block));
+        if (fs->fat.refs[block] > 0)
+        {
+            set_refs(fs, block, fs->fat.refs[block] - 1);
+            if (next >= 0)
+                set_refs(fs, next, fs->fat.refs[next] + 1);
+        }
+        else
+        {
+            // the others let go of it meanwhile, so nothing else uses it
+            cache_discard(&fs->cache, block);
+            set_fat_entry(fs, block, FAT_UNUSED);
+        }
+        pthread_mutex_unlock(&fs->alloc_lock);
+        STAT_ADD(fs->stats.cow_blocks, 1);
+
+        if (prev < 0)
+        {
+            attr->offset = copy;
+            mark_dirty(desc->parent);
+        }
+        for (int i = -1; i < nothers; i++)
+        {
+            Descriptor * d = i < 0 ? desc : others[i];
+            if (n < d->index_size)
+                d->index[n] = copy;
+            if (d->block == block)
+                d->block = copy;
+        }
+        block = copy;
+    }
+
+    free(others);
+    desc->cow_private = n;
+    desc->cow_tail = prev;
+    return 0;
+}
+
+/* block_before -- the last block of attr's file at or before logical block
+ * block_num, and in *num its own logical number */
+static int block_before(fs_t * fs, Attribute * attr, int block_num, int * num)
+{
+    int block = attr->offset,
+        n = 0,
+        steps = 0;
+
+    while (fs->fat.table[block] >= 0
+            && n + 1 + holes_after(fs, block) <= block_num)
+    {
+        n += 1 + holes_after(fs, block);
+        block = fs->fat.table[block];
+        steps++;
+    }
+    STAT_ADD(fs->stats.chain_walks, 1);
+    STAT_ADD(fs->stats.chain_steps, steps);
+    *num = n;
+    return block;
+}
+
+/* holes_after -- how many blocks are missing after 'block' in its chain */
+static int holes_after(fs_t * fs, int block)
+{
+    if (__atomic_load_n(&fs->holed, __ATOMIC_RELAXED) == 0)
+        return 0;
+    return fs->fat.holes[block];
+}
+
+/* last_block -- logical number of the last block of attr's file */
+static int last_block(fs_t * fs, Attribute * attr)
+{
+    return attr->size > 0 ? (attr->size - 1) / fs->disk.block_size : 0;
+}
+
+/* read_only -- whether desc's file is in a snapshot, which is kept as it
+ * was. Says so for 'call' if it is */
+static int read_only(Descriptor * desc, const char * call)
+{
+    if (!desc->parent->readonly)
+        return 0;
+    printf("%s: file is in a read-only snapshot\n", call);
+    return 1;
+}
+
+/* too_large -- whether nbyte bytes at offset would end past the INT_MAX
+ * bytes a file can hold. Says so for 'call' if they would */
+static int too_large(off_t offset, size_t nbyte, const char * call)
+{
+    if (nbyte <= INT_MAX && offset <= INT_MAX - (off_t) nbyte)
+        return 0;
+    printf("%s: file too large\n", call);
+    return 1;
+}
+
+/* is_file -- whether attr is a file, compressed or not, rather than a
+ * directory */
+static int is_file(Attribute * attr)
+{
+    return attr->type == ATTR_FILE || attr->type == ATTR_COMPRESSED;
+}
+
+/* flush_buffers -- flush_buffer and pack_cluster for every open
+ * descriptor */
+static int flush_buffers(fs_t * fs)
+{
+    int ret = 0;
+
+    for (int i = 0; i < fs->descriptor_capacity; i++)
+    {
+        if (fs->descriptors[i].descriptor == DESCRIPTOR_UNUSED)
+            continue;
+        // the descriptor's owner hears about it too, see take_error()
+        if (flush_buffer(fs, &fs->descriptors[i]) < 0
+                || pack_cluster(fs, &fs->descriptors[i]) < 0)
+        {
+            fs->descriptors[i].wbuf_error = 1;
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+/* truncate_inline -- truncate_file() for a file without blocks */
+static int truncate_inline(fs_t * fs, Descriptor * desc, off_t length)
+{
+    Attribute * attr = desc->attr;
+
+    resize_data(fs, desc->parent, attr - desc->parent->attributes, length);
+    attr->size = length;
+    mark_dirty(desc->parent);
+    for (int i = 0; i < fs->descriptor_capacity; i++)
+    {
+        if (fs->descriptors[i].descriptor != DESCRIPTOR_UNUSED
+                && fs->descriptors[i].attr == attr
+                && fs->descriptors[i].offset > length)
+            fs->descriptors[i].offset = length;
+    }
+    return 0;
+}
+
+/* materialize -- gives desc's file, which has no blocks, a head block and
+ * moves its bytes there out of its directory */
+static int materialize(fs_t * fs, Descriptor * desc)
+{
+    Directory * d = desc->parent;
+    Attribute * attr = desc->attr;
+    int slot = attr - d->attributes,
+        head = alloc_entry(fs, -1);
+    char * block;
+
+    if (head < 0)
+    {
+        printf("fs_write: not enough space\n");
+        return -1;
+    }
+    if ((block = cache_get(&fs->cache, head, CACHE_ZERO)) == NULL)
+    {
+        free_alloc_chain(fs, head);
+        return -1;
+    }
+    if (attr->size > 0)
+        memcpy(block, d->data[slot], attr->size);
+    cache_put(&fs->cache, head);
+    resize_data(fs, d, slot, 0);
+    attr->offset = head;
+    mark_dirty(d);
+
+    // every descriptor on the file is in the head block, or one seeked
+    // past EOF in the hole after it
+    for (int i = -1; i < fs->descriptor_capacity; i++)
+    {
+        Descriptor * other = i < 0 ? desc : &fs->descriptors[i];
+        if (i >= 0 && (other->descriptor == DESCRIPTOR_UNUSED
+                    || other->attr != attr))
+            continue;
+        if (other->index_size > 0)
+            other->index[0] = head;
+        other->block = head;
+        other->block_num = other->hole = 0;
+        seek_block(fs, other, other->offset
+                ? (other->offset - 1) / fs->disk.block_size : 0);
+    }
+    return 0;
+}
+
+/* resize_data -- makes the bytes of the file without blocks at d's 'slot'
+ * 'size' long, zero-filling any new ones. Growing them holds the blocks
+ * d's chain will need to store them; -1 if the disk doesn't have those */
+static int resize_data(fs_t * fs, Directory * d, int slot, int size)
+{
+    int old = d->attributes[slot].size,
+        need;
+    char * data = d->data[slot];
+
+    if (!is_file(&d->attributes[slot])
+            || d->attributes[slot].offset >= 0 || size == old)
+        return 0;
+
+    pthread_mutex_lock(&fs->alloc_lock);
+    d->data_bytes += size - old;
+    need = dir_blocks(fs, d, d->size) - d->blocks - d->held;
+    if (need > 0 && need > avail_blocks(fs))
+    {
+        d->data_bytes -= size - old;
+        pthread_mutex_unlock(&fs->alloc_lock);
+        return -1;
+    }
+    if (need > 0)
+    {
+        fs->pending_blocks += need;
+        d->held += need;
+    }
+    pthread_mutex_unlock(&fs->alloc_lock);
+
+    if (size == 0)
+    {
+        free(data);
+        data = NULL;
+    }
+    else if ((data = realloc(data, size)) == NULL)
+    {
+        pthread_mutex_lock(&fs->alloc_lock);
+        d->data_bytes -= size - old;
+        pthread_mutex_unlock(&fs->alloc_lock);
+        return -1;
+    }
+    else if (size > old)
+        memset(data + old, 0, size - old);
+    d->data[slot] = data;
+    return 0;
+}
+
+
+
+/* helpers ------------------------------------------------------------------ */
+
+/* transfer_at -- an fs_submit request: transfer() on a copy of the
+ * descriptor, so requests on the same file can run side by side and leave
+ * its offset alone. The copy borrows the block index without growing it,
+ * and unpacks clusters of a compressed file into a zbuf of its own */
+static int transfer_at(fs_t * fs, fs_io_t * io)
+{
+    int ret = -1, idx, flush;
+    pthread_rwlock_t * lock;
+    struct iovec iov = { io->buf, io->nbyte };
+    Descriptor desc;
+
+    pthread_rwlock_rdlock(&fs->tree_lock);
+    if ((idx = get_fildes_index(fs, io->fildes)) >= 0)
+    {
+        flush = has_buffered(fs, &fs->descriptors[idx]);
+        lock = lock_file(fs, &fs->descriptors[idx], io->write || flush);
+        desc = fs->descriptors[idx];
+        desc.index_capacity = -1;
+        desc.zbuf = NULL;
+        desc.zbuf_cluster = -1;
+        desc.zbuf_dirty = 0;
+        if ((!flush || flush_file(fs, desc.attr) == 0)
+                && !(io->write && (read_only(&desc, "fs_submit")
+                        || too_large(io->offset, io->nbyte, "fs_submit")))
+                && seek_file(fs, &desc, io->offset) == 0)
+            ret = transfer(fs, &desc, &iov, 1, io->write);
+        if (pack_cluster(fs, &desc) < 0)
+            ret = -1;
+        free(desc.zbuf);
+        pthread_rwlock_unlock(lock);
+    }
+    pthread_rwlock_unlock(&fs->tree_lock);
+    return ret;
+}
+
+void print_disk_struct(fs_t * fs)
+{
+    Attribute * attrib = &fs->dir->attributes[0];
+    char * data = cache_get(&fs->cache, fs->super->data_block_offset,
+            CACHE_READ);
+
+    printf("----------\n");
+    printf("Superblock: fat=%d dir=%d data=%d \n", 
+            fs->super->fat_offset,
+            fs->super->directory_offset,
+            fs->super->data_block_offset);
+
+    printf("FAT (first 20): ");
+    for (int i = 0; i < 20; i++)
+    {
+        printf("%d ", fs->fat.table[i]);
+    }
+    if (fs->dir->size == 0)
+        printf("\nNo files present\n");
+    else
+        printf("\nFirst file: name=%s size=%d offset=%d\n",
+                attrib->name,
+                attrib->size,
+                attrib->offset);
+    printf("First 50 bytes of data block: |");
+    for (int i = 0; data != NULL && i < 50; i++)
+    {
+        printf("%c", data[i]);
+    }
+    if (data != NULL)
+        cache_put(&fs->cache, fs->super->data_block_offset);
+    printf("|\n");
+
+    // a small first file is in the directory rather than a data block
+    if (fs->dir->size > 0 && fs->dir->data[0] != NULL)
+        printf("First file's data, in its directory: |%.*s|\n",
+                attrib->size, fs->dir->data[0]);
+    printf("----------\n");
+}
+
+/* copy_iov -- copies len bytes between block_ptr and the iovecs at *iov,
+ * *iov_off bytes into the first one, and advances both past them */
+static void copy_iov(struct iovec ** iov, size_t * iov_off, char * block_ptr, 
+        size_t len, int write)
+{
+    while (len > 0)
+    {
+        size_t n = (*iov)->iov_len - *iov_off;
+        if (n > len)
+            n = len;
+
+        if (write)
+            memcpy(block_ptr, (char *) (*iov)->iov_base + *iov_off, n);
+        else
+            memcpy((char *) (*iov)->iov_base + *iov_off, block_ptr, n);
+
+        block_ptr += n;
+        *iov_off += n;
+        len -= n;
+        if (*iov_off == (*iov)->iov_len)
+        {
+            (*iov)++;
+            *iov_off = 0;
+        }
+    }
+}
+
+/* zero_iov -- zero-fills the next len bytes of the iovecs at *iov, *iov_off
+ * bytes into the first one, and advances both past them */
+static void zero_iov(struct iovec ** iov, size_t * iov_off, size_t len)
+{
+    while (len > 0)
+    {
+        size_t n = (*iov)->iov_len - *iov_off;
+        if (n > len)
+            n = len;
+
+        memset((char *) (*iov)->iov_base + *iov_off, 0, n);
+        *iov_off += n;
+        len -= n;
+        if (*iov_off == (*iov)->iov_len)
+        {
+            (*iov)++;
+            *iov_off = 0;
+        }
+    }
+}
+
+/* transfer -- moves bytes between the iovecs and the file at desc's cursor.
+ * Walks the chain once, a run of physically adjacent blocks at a time, and
+ * copies through the block cache. Writes allocate blocks as they go, in
+ * holes too, and grow the file; reads stop at EOF and read holes as zeros.
+ * Returns the number of bytes transferred */
+static int transfer(fs_t * fs, Descriptor * desc, struct iovec * iov,
+        int iovcnt, int write)
+{
+    size_t nbyte = 0,       /* bytes left to transfer */
+           done = 0,        /* bytes transferred so far */
+           iov_off = 0;     /* progress within iov[0] */
+    int block_idx,          /* block the cursor is in */
+        run_end,            /* last block of the current contiguous run */
+        fresh,              /* first block of the run allocated by this call */
+        grew = 0,           /* whether the chain got blocks at its end */
+        pos;                /* cursor position within block_idx */
+
+    for (int i = 0; i < iovcnt; i++)
+        nbyte += iov[i].iov_len;
+
+    // a file without blocks is in its directory until it outgrows it
+    if (desc->attr->offset < 0 && write
+            && desc->offset + nbyte > (size_t) INLINE_MAX(fs)
+            && materialize(fs, desc) < 0)
+        return -1;
+    if (desc->attr->offset < 0)
+        return transfer_inline(fs, desc, iov, nbyte, write);
+    if (desc->attr->type == ATTR_COMPRESSED)
+        return transfer_packed(fs, desc, iov, nbyte, write);
+
+    // a file writes only blocks of its own, and only relinks its own last
+    if (write && nbyte > 0 && unshare(fs, desc,
+                (desc->offset + nbyte - 1) / fs->disk.block_size,
+                desc->offset, desc->offset + nbyte) < 0)
+        return -1;
+
+    // only read up to filesize
+    if (!write)
+    {
+        if (desc->offset >= desc->attr->size)
+            return 0;
+        if (nbyte > (size_t)(desc->attr->size - desc->offset))
+            nbyte = desc->attr->size - desc->offset;
+    }
+
+    block_idx = desc->block;
+    pos = desc->offset - desc->block_num * fs->disk.block_size;
+
+    // a read picking up where the last one stopped widens the read-ahead
+    // window, any other read closes it
+    if (!write && desc->offset == desc->ra_offset)
+    {
+        desc->ra_window = desc->ra_window ? desc->ra_window * 2
+            : READAHEAD_MIN;
+        if (desc->ra_window > READAHEAD_MAX)
+            desc->ra_window = READAHEAD_MAX;
+    }
+    else if (!write)
+        desc->ra_window = desc->ra_next = 0;
+
+    while (nbyte > 0)
+    {
+        size_t run_bytes;
+        char * block_ptr;
+
+        // cursor sits at the end of a block: step into the next one, or
+        // further into the hole after it
+        fresh = fs->disk.blocks;
+        if (pos == fs->disk.block_size)
+        {
+            int next = fs->fat.table[block_idx];
+            desc->block_num++;
+            if (next >= 0 && desc->hole == holes_after(fs, block_idx))
+            {
+                block_idx = next;
+                desc->hole = 0;
+                index_block(desc, desc->block_num, block_idx);
+            }
+            else
+                desc->hole++;
+            pos = 0;
+        }
+
+        // a write into a hole, the one at EOF included, gets a new block
+        // there; a read of one reads zeros
+        if (desc->hole > 0 && write)
+        {
+            if ((fresh = fill_hole(fs, desc, block_idx)) < 0)
+            {
+                // back on the end of the block before, see Descriptor
+                if (pos == 0)
+                {
+                    desc->block_num--;
+                    desc->hole--;
+                }
+                break;
+            }
+            block_idx = fresh;
+        }
+        else if (desc->hole > 0)
+        {
+            size_t len = fs->disk.block_size - pos;
+            if (len > nbyte)
+                len = nbyte;
+            zero_iov(&iov, &iov_off, len);
+            pos += len;
+            nbyte -= len;
+            done += len;
+            desc->offset += len;
+            continue;
+        }
+
+        // extend the run across physically adjacent blocks of the chain,
+        // up to a hole. New blocks only run on into other new ones
+        run_end = block_idx;
+        run_bytes = fs->disk.block_size - pos;
+        while (run_bytes < nbyte)
+        {
+            int next = fs->fat.table[run_end];
+            if (next == FAT_EOF && write)
+            {
+                next = alloc_entry(fs, run_end);
+                grew |= next >= 0;
+                // a block elsewhere ends the run, and the pass that writes
+                // it can't tell it's new: zero it now. Counted in 'fresh'
+                // it could make the run's old blocks look new as well
+                if (next >= 0 && next != run_end + 1)
+                {
+                    if (cache_zero(&fs->cache, next) < 0)
+                        nbyte = run_bytes;
+                    break;
+                }
+                if (next >= 0 && next < fresh)
+                    fresh = next;
+            }
+            else if (run_end >= fresh)
+                break;
+            if (next != run_end + 1 || holes_after(fs, run_end) != 0)
+                break;
+            run_end = next;
+            run_bytes += fs->disk.block_size;
+            index_block(desc, desc->block_num + run_end - block_idx, run_end);
+        }
+
+        // copy the run block by block, leaving the cursor in its last one
+        while (1)
+        {
+            size_t len = fs->disk.block_size - pos;
+            int mode = CACHE_READ;
+            if (len > nbyte)
+                len = nbyte;
+
+            // don't read in what's about to be overwritten
+            if (write && len == (size_t) fs->disk.block_size)
+                mode = CACHE_OVERWRITE;
+            else if (write)
+                mode = block_idx >= fresh ? CACHE_ZERO : CACHE_WRITE;
+
+            // get the blocks the rest of the read needs, and the window
+            // past them, in flight at once. The next batch goes out once
+            // the cursor is halfway through this one
+            if (!write && desc->block_num >= desc->ra_next)
+            {
+                int got = read_chain(fs, block_idx,
+                        read_ahead_bytes(fs, desc, pos, nbyte));
+                desc->ra_next = desc->block_num
+                    + (desc->ra_window && got > 1 ? got / 2 : got);
+            }
+
+            block_ptr = cache_get(&fs->cache, block_idx, mode);
+            if (block_ptr == NULL)
+                break;
+            copy_iov(&iov, &iov_off, block_ptr + pos, len, write);
+            cache_put(&fs->cache, block_idx);
+
+            pos += len;
+            nbyte -= len;
+            done += len;
+            desc->offset += len;
+            if (block_idx == run_end || nbyte == 0)
+                break;
+            block_idx++;
+            desc->block_num++;
+            pos = 0;
+        }
+        if (block_ptr == NULL)
+            break;
+    }
+
+    desc->block = block_idx;
+    if (grew)
+        reseat(fs, desc);
+    STAT_ADD(fs->stats.bytes_copied, done);
+    if (!write)
+        desc->ra_offset = desc->offset;
+    if (write && desc->offset > desc->attr->size)
+    {
+        desc->attr->size = desc->offset;
+        mark_dirty(desc->parent);
+    }
+
+    return done;
+}
+
+/* transfer_inline -- transfer() for a file without blocks, whose nbyte
+ * bytes from desc's cursor on fit in its directory */
+static int transfer_inline(fs_t * fs, Descriptor * desc, struct iovec * iov,
+        size_t nbyte, int write)
+{
+    Directory * d = desc->parent;
+    int slot = desc->attr - d->attributes;
+    size_t iov_off = 0;
+
+    if (!write && desc->offset >= desc->attr->size)
+        return 0;
+    if (!write && nbyte > (size_t) (desc->attr->size - desc->offset))
+        nbyte = desc->attr->size - desc->offset;
+    if (nbyte == 0)
+        return 0;
+
+    if (write && desc->offset + nbyte > (size_t) desc->attr->size)
+    {
+        if (resize_data(fs, d, slot, desc->offset + nbyte) < 0)
+        {
+            printf("fs_write: not enough space\n");
+            return -1;
+        }
+        desc->attr->size = desc->offset + nbyte;
+    }
+    copy_iov(&iov, &iov_off, d->data[slot] + desc->offset, nbyte, write);
+    desc->offset += nbyte;
+    STAT_ADD(fs->stats.bytes_copied, nbyte);
+    if (write)
+        mark_dirty(d);
+    return nbyte;
+}
+
+/* transfer_packed -- transfer() for a compressed file with blocks, a
+ * cluster at a time through desc's zbuf. Reads of a cluster stored as it
+ * is come straight from the cache instead. Writes only change zbuf, after
+ * the other descriptors on the file have packed theirs */
+static int transfer_packed(fs_t * fs, Descriptor * desc, struct iovec * iov,
+        size_t nbyte, int write)
+{
+    Attribute * attr = desc->attr;
+    int bs = fs->disk.block_size,
+        blocks[CLUSTER_BYTES / MIN_BLOCK_SIZE],
+        cluster,
+        pos,
+        need,
+        n;
+    size_t done = 0,
+           iov_off = 0,
+           len;
+    char * block_ptr;
+
+    if (!write)
+    {
+        if (desc->offset >= attr->size)
+            return 0;
+        if (nbyte > (size_t) (attr->size - desc->offset))
+            nbyte = attr->size - desc->offset;
+    }
+    for (int i = 0; write && i < fs->descriptor_capacity; i++)
+    {
+        Descriptor * other = &fs->descriptors[i];
+        if (other->descriptor != DESCRIPTOR_UNUSED && other->attr == attr
+                && other != desc && pack_cluster(fs, other) < 0)
+            return -1;
+    }
+    // an empty write past the end still moves the end, as in transfer()
+    if (write && nbyte == 0 && desc->offset > attr->size
+            && grow_clusters(fs, desc, desc->offset) < 0)
+        return -1;
+
+    while (nbyte > 0)
+    {
+        cluster = desc->offset / CLUSTER_BYTES;
+        pos = desc->offset % CLUSTER_BYTES;
+        len = nbyte;
+        if (len > (size_t) (CLUSTER_BYTES - pos))
+            len = CLUSTER_BYTES - pos;
+        if (write && desc->offset + len > (size_t) attr->size
+                && grow_clusters(fs, desc, desc->offset + len) < 0)
+            break;
+
+        if (desc->zbuf_cluster != cluster && !write)
+        {
+            need = (cluster_bytes(attr, cluster) + bs - 1) / bs;
+            if ((n = cluster_blocks(fs, desc, cluster, blocks, need)) < 0)
+                break;
+            if (n == 0)
+            {
+                zero_iov(&iov, &iov_off, len);
+                goto next;
+            }
+            if (n == need)
+            {
+                // stored as it is, block by block from where pos falls
+                read_chain(fs, blocks[pos / bs], pos % bs + len);
+                for (size_t left = len; left > 0; pos += n, left -= n)
+                {
+                    n = bs - pos % bs;
+                    if ((size_t) n > left)
+                        n = left;
+                    block_ptr = cache_get(&fs->cache, blocks[pos / bs],
+                            CACHE_READ);
+                    if (block_ptr == NULL)
+                        break;
+                    copy_iov(&iov, &iov_off, block_ptr + pos % bs, n, 0);
+                    cache_put(&fs->cache, blocks[pos / bs]);
+                }
+                if (block_ptr == NULL)
+                    break;
+                goto next;
+            }
+        }
+
+        // a write over all of it doesn't need what was there
+        if (desc->zbuf_cluster != cluster)
+        {
+            if (pack_cluster(fs, desc) < 0)
+                break;
+            if (write && len == CLUSTER_BYTES)
+            {
+                if (desc->zbuf == NULL
+                        && (desc->zbuf = malloc(2 * CLUSTER_BYTES)) == NULL)
+                    break;
+                desc->zbuf_cluster = cluster;
+            }
+            else if (load_cluster(fs, desc, cluster) < 0)
+                break;
+        }
+        copy_iov(&iov, &iov_off, desc->zbuf + pos, len, write);
+        if (write)
+            dirty_cluster(fs, desc);
+next:
+        nbyte -= len;
+        done += len;
+        desc->offset += len;
+    }
+
+    // the cursor has been all over the clusters
+    seek_file(fs, desc, desc->offset);
+    STAT_ADD(fs->stats.bytes_copied, done);
+    return done;
+}
+
+/* cluster_bytes -- how many of the bytes of attr's file are in 'cluster',
+ * none for one past its end */
+static int cluster_bytes(Attribute * attr, int cluster)
+{
+    off_t len = attr->size - (off_t) cluster * CLUSTER_BYTES;
+
+    if (len <= 0)
+        return 0;
+    return len < CLUSTER_BYTES ? len : CLUSTER_BYTES;
+}
+
+/* cluster_blocks -- the blocks stored in 'cluster' of desc's file, up to
+ * max of them, into blocks, moving desc's cursor to its first one. Returns
+ * how many there are */
+static int cluster_blocks(fs_t * fs, Descriptor * desc, int cluster,
+        int * blocks, int max)
+{
+    int n = 0,
+        block;
+
+    if (max == 0)
+        return 0;
+    if (seek_block(fs, desc, cluster * CLUSTER_BLOCKS(fs)) < 0)
+        return -1;
+    if (desc->hole > 0)
+        return 0;
+
+    // they're all next to each other in the chain, up to a hole
+    block = desc->block;
+    while (1)
+    {
+        blocks[n++] = block;
+        if (n == max || holes_after(fs, block) > 0
+                || (block = fs->fat.table[block]) < 0)
+            return n;
+    }
+}
+
+/* load_cluster -- unpacks 'cluster' of desc's file into its zbuf, which
+ * holds nothing dirty */
+static int load_cluster(fs_t * fs, Descriptor * desc, int cluster)
+{
+    int bs = fs->disk.block_size,
+        need = (cluster_bytes(desc->attr, cluster) + bs - 1) / bs,
+        blocks[CLUSTER_BYTES / MIN_BLOCK_SIZE],
+        length,
+        got,
+        n;
+    char * packed, * block_ptr;
+
+    if (desc->zbuf == NULL
+            && (desc->zbuf = malloc(2 * CLUSTER_BYTES)) == NULL)
+        return -1;
+    desc->zbuf_cluster = -1;
+    if ((n = cluster_blocks(fs, desc, cluster, blocks, need)) < 0)
+        return -1;
+
+    // a packed cluster is read in after the room for the unpacked one
+    packed = n < need ? desc->zbuf + CLUSTER_BYTES : desc->zbuf;
+    if (n > 1)
+        read_chain(fs, blocks[0], (size_t) n * bs);
+    for (int i = 0; i < n; i++)
+    {
+        if ((block_ptr = cache_get(&fs->cache, blocks[i], CACHE_READ)) == NULL)
+            return -1;
+        memcpy(packed + i * bs, block_ptr, bs);
+        cache_put(&fs->cache, blocks[i]);
+    }
+
+    got = n * bs;
+    if (n > 0 && n < need)
+    {
+        memcpy(&length, packed, sizeof(int));
+        if (length < 0 || length > n * bs - (int) sizeof(int)
+                || (got = lz_decompress(packed + sizeof(int), length,
+                        desc->zbuf, CLUSTER_BYTES)) < 0)
+        {
+            printf("fs_read: cluster %d of %s is damaged\n", cluster,
+                    desc->attr->name);
+            return -1;
+        }
+    }
+    memset(desc->zbuf + got, 0, CLUSTER_BYTES - got);
+    desc->zbuf_cluster = cluster;
+    return 0;
+}
+
+/* pack_cluster -- writes desc's zbuf back into its cluster if it's dirty,
+ * packed if that saves a block. The blocks already there are reused, holes
+ * in the way filled and the blocks left over dropped, so descriptors
+ * elsewhere in the file stay where they are */
+static int pack_cluster(fs_t * fs, Descriptor * desc)
+{
+    Attribute * attr = desc->attr;
+    int bs = fs->disk.block_size,
+        per = CLUSTER_BLOCKS(fs),
+        cluster = desc->zbuf_cluster,
+        first = cluster * per,
+        len = cluster_bytes(attr, cluster),
+        need = (len + bs - 1) / bs,
+        blocks[CLUSTER_BYTES / MIN_BLOCK_SIZE],
+        prev = -1,
+        length = -1,
+        count = need,
+        block,
+        next;
+    char * data = desc->zbuf,
+         * block_ptr;
+
+    if (!desc->zbuf_dirty)
+        return 0;
+    desc->zbuf_dirty = 0;
+    __atomic_sub_fetch(&fs->buffered, 1, __ATOMIC_RELAXED);
+    // truncated away meanwhile
+    if (len == 0)
+        return 0;
+
+    if (need > 1)
+        length = lz_compress(desc->zbuf, len, desc->zbuf + CLUSTER_BYTES
+                + sizeof(int), (need - 1) * bs - (int) sizeof(int));
+    if (length >= 0)
+    {
+        data = desc->zbuf + CLUSTER_BYTES;
+        memcpy(data, &length, sizeof(int));
+        count = (length + (int) sizeof(int) + bs - 1) / bs;
+        memset(data + sizeof(int) + length, 0,
+                count * bs - sizeof(int) - length);
+        STAT_ADD(fs->stats.clusters_packed, 1);
+    }
+    else
+        STAT_ADD(fs->stats.clusters_raw, 1);
+
+    // the cluster's blocks are rewritten and relinked
+    if (unshare(fs, desc, first + per - 1, (off_t) first * bs,
+                (off_t) (first + per) * bs) < 0)
+        goto fail;
+    if (first > 0 && seek_block(fs, desc, first - 1) == 0)
+        prev = desc->block;
+    for (int i = 0; i < count; i++)
+    {
+        if (seek_block(fs, desc, first + i) < 0)
+            goto fail;
+        if (desc->hole > 0)
+        {
+            if ((block = fill_hole(fs, desc, desc->block)) < 0)
+                goto fail;
+            desc->block = block;
+        }
+        blocks[i] = desc->block;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        int n = len - i * bs < bs && data == desc->zbuf ? len - i * bs : bs;
+        if ((block_ptr = cache_get(&fs->cache, blocks[i], CACHE_OVERWRITE))
+                == NULL)
+            goto fail;
+        memcpy(block_ptr, data + i * bs, n);
+        memset(block_ptr + n, 0, bs - n);
+        cache_put(&fs->cache, blocks[i]);
+    }
+
+    // drop what follows them up to the end of the cluster, its holes
+    // joining the one after the last block kept
+    pthread_mutex_lock(&fs->alloc_lock);
+    block = blocks[count - 1];
+    while ((next = fs->fat.table[block]) >= 0
+            && first + count + holes_after(fs, block) < first + per)
+    {
+        int hole = holes_after(fs, block) + 1 + holes_after(fs, next);
+        set_fat_entry(fs, block, fs->fat.table[next]);
+        set_holes(fs, block, fs->fat.table[next] >= 0 ? hole : 0);
+        cache_discard(&fs->cache, next);
+        set_fat_entry(fs, next, FAT_UNUSED);
+    }
+    pthread_mutex_unlock(&fs->alloc_lock);
+
+    // descriptors in the cluster start over from its first block, and
+    // their indexes end at its last one
+    for (int i = -1; i < fs->descriptor_capacity; i++)
+    {
+        Descriptor * d = i < 0 ? desc : &fs->descriptors[i];
+        int at = d->block_num - d->hole;
+        if (i >= 0 && (d->descriptor == DESCRIPTOR_UNUSED
+                    || d->attr != attr || d == desc))
+            continue;
+        if (d->index_size > first + count)
+            d->index_size = first + count;
+        if (d != desc && d->zbuf_cluster == cluster)
+            d->zbuf_cluster = -1;
+        // the blocks a copy of this cluster went into are desc's own now,
+        // see unshare()
+        if (d->cow_private > first)
+        {
+            d->cow_private = d == desc && prev >= 0 ? first : 0;
+            d->cow_tail = prev;
+        }
+        if (at >= first && at < first + per)
+        {
+            d->block = blocks[0];
+            d->block_num = first;
+            d->hole = 0;
+            seek_block(fs, d, d->offset ? (d->offset - 1) / bs : 0);
+        }
+    }
+    return 0;
+
+fail:
+    printf("fs_write: compressed data didn't fit on the disk\n");
+    desc->zbuf_cluster = -1;
+    return -1;
+}
+
+/* grow_clusters -- grows desc's compressed file to 'length' bytes. Its last
+ * cluster, if stored as it is, would look packed with fewer blocks than
+ * its bytes then need, so it's packed again for the new length */
+static int grow_clusters(fs_t * fs, Descriptor * desc, off_t length)
+{
+    Attribute * attr = desc->attr;
+    Descriptor probe = *desc;
+    int bs = fs->disk.block_size,
+        cluster = attr->size > 0 ? (attr->size - 1) / CLUSTER_BYTES : 0,
+        have = (cluster_bytes(attr, cluster) + bs - 1) / bs,
+        need = length - (off_t) cluster * CLUSTER_BYTES < CLUSTER_BYTES
+            ? length - (off_t) cluster * CLUSTER_BYTES : CLUSTER_BYTES,
+        blocks[CLUSTER_BYTES / MIN_BLOCK_SIZE],
+        n = 0;
+
+    // a dirty one gets packed at the new length anyway
+    need = (need + bs - 1) / bs;
+    probe.index_capacity = -1;
+    if (desc->zbuf_cluster != cluster || !desc->zbuf_dirty)
+        n = cluster_blocks(fs, &probe, cluster, blocks, need);
+    if (n < 0)
+        return -1;
+    if (n >= have && n < need && desc->zbuf_cluster != cluster
+            && (pack_cluster(fs, desc) < 0
+                || load_cluster(fs, desc, cluster) < 0))
+        return -1;
+
+    attr->size = length;
+    mark_dirty(desc->parent);
+    if (n < have || n >= need)
+        return 0;
+    dirty_cluster(fs, desc);
+    return pack_cluster(fs, desc);
+}
+
+/* dirty_cluster -- notes that desc's zbuf has writes to pack */
+static void dirty_cluster(fs_t * fs, Descriptor * desc)
+{
+    if (desc->zbuf_dirty)
+        return;
+    desc->zbuf_dirty = 1;
+    __atomic_add_fetch(&fs->buffered, 1, __ATOMIC_RELAXED);
+}
+
+/* fill_hole -- links a new block into the hole after 'block', at desc's
+ * cursor, which moves into it. What is left of the hole either side of it
+ * stays a hole. Descriptors further on in the hole are moved on from it */
+static int fill_hole(fs_t * fs, Descriptor * desc, int block)
+{
+    Directory * d = desc->parent;
+    int next = fs->fat.table[block],
+        hole = desc->hole,
+        fresh = alloc_entry(fs, block);
+
+    if (fresh < 0)
+        return -1;
+    if (next >= 0 || hole > 1)
+    {
+        pthread_mutex_lock(&fs->alloc_lock);
+        if (next >= 0)
+        {
+            set_fat_entry(fs, fresh, next);
+            set_holes(fs, fresh, holes_after(fs, block) - hole);
+        }
+        set_holes(fs, block, hole - 1);
+        pthread_mutex_unlock(&fs->alloc_lock);
+    }
+
+    // transfer() has desc's cursor, and a copy from transfer_at has its
+    // original in the table
+    for (int i = -1; i < fs->descriptor_capacity; i++)
+    {
+        Descriptor * other = i < 0 ? desc : &fs->descriptors[i];
+        if (i >= 0 && (desc->index_capacity >= 0 && get_open_count(d,
+                        desc->attr - d->attributes) < 2))
+            break;
+        if (i >= 0 && (other->descriptor == DESCRIPTOR_UNUSED
+                    || other->attr != desc->attr || other == desc))
+            continue;
+        // what follows 'block' is the new one now, see unshare()
+        if (other->cow_private > 0 && other->cow_tail == block)
+            other->cow_private = desc->block_num;
+        if (i >= 0 && other->block == block && other->hole >= hole)
+        {
+            other->block = fresh;
+            other->hole -= hole;
+        }
+    }
+    desc->hole = 0;
+    index_block(desc, desc->block_num, fresh);
+    return fresh;
+}
+
+/* reseat -- seek_file() every descriptor on desc's file that's in a hole
+ * again, after blocks went on the end of its chain: the hole they were in
+ * may be blocks now. desc may be a copy, see fill_hole() */
+static void reseat(fs_t * fs, Descriptor * desc)
+{
+    Directory * d = desc->parent;
+    int offset;
+
+    if (desc->index_capacity >= 0 && desc->hole == 0
+            && get_open_count(d, desc->attr - d->attributes) < 2)
+        return;
+    for (int i = 0; i < fs->descriptor_capacity; i++)
+    {
+        Descriptor * other = &fs->descriptors[i];
+        if (other->descriptor == DESCRIPTOR_UNUSED
+                || other->attr != desc->attr || other->hole == 0)
+            continue;
+        offset = other->offset;
+        other->block = desc->attr->offset;
+        other->block_num = other->hole = 0;
+        other->offset = 0;
+        seek_file(fs, other, offset);
+    }
+}
+
+/* index_block -- records that logical block block_num of desc's file lives
+ * in 'block', if desc keeps an index and it reaches that far */
+static void index_block(Descriptor * desc, int block_num, int block)
+{
+    if (desc->index_capacity < 0)
+        return;
+    if (desc->index == NULL && block_num > 0)
+        return;
+    if (block_num != desc->index_size)
+        return;
+
+    if (desc->index_size == desc->index_capacity)
+    {
+        int capacity = desc->index_capacity ? desc->index_capacity * 2 : 64;
+        int * index = realloc(desc->index, capacity * sizeof(int));
+        if (index == NULL)
+            return;
+        desc->index = index;
+        desc->index_capacity = capacity;
+    }
+    desc->index[desc->index_size++] = block;
+}
+
+/* seek_block -- moves desc's cursor to logical block block_num. Uses the
+ * block index when it covers block_num, otherwise walks forward from the
+ * cursor, or from the closest indexed block, and only restarts from the
+ * head when seeking backwards. Past the last block the cursor is in the
+ * hole at the end of the file */
+static int seek_block(fs_t * fs, Descriptor * desc, int block_num)
+{
+    int block = desc->attr->offset,
+        from = 0,
+        start,
+        holed,
+        at = desc->block_num - desc->hole;
+
+    if (block_num < desc->index_size)
+    {
+        desc->block = desc->index[block_num];
+        desc->block_num = block_num;
+        desc->hole = 0;
+        return 0;
+    }
+
+    if (desc->index_size > 0)
+    {
+        from = desc->index_size - 1;
+        block = desc->index[from];
+    }
+    if (at <= block_num && at >= from)
+    {
+        from = at;
+        block = desc->block;
+    }
+
+    // the hole counts are only looked at when there are any
+    holed = __atomic_load_n(&fs->holed, __ATOMIC_RELAXED) > 0;
+    start = from;
+    while (from < block_num)
+    {
+        int next = fs->fat.table[block],
+            step = holed ? 1 + fs->fat.holes[block] : 1;
+        if (next < 0 || from + step > block_num)
+            break;
+        block = next;
+        from += step;
+        index_block(desc, from, block);
+    }
+    if (from > start)
+    {
+        STAT_ADD(fs->stats.chain_walks, 1);
+        STAT_ADD(fs->stats.chain_steps, from - start);
+    }
+    // only a file with holes may end before block_num
+    if (from < block_num && fs->fat.holes == NULL)
+        return -1;
+
+    desc->block = block;
+    desc->block_num = block_num;
+    desc->hole = block_num - from;
+    return 0;
+}
+
+/* read_ahead_bytes -- how far from the start of the cursor's block a read
+ * with nbyte bytes left should have the chain read in: through the end of
+ * the read plus desc's read-ahead window, but not past EOF */
+static size_t read_ahead_bytes(fs_t * fs, Descriptor * desc, int pos,
+        size_t nbyte)
+{
+    size_t want = pos + nbyte + (size_t) desc->ra_window * fs->disk.block_size,
+           left = desc->attr->size - (desc->offset - pos);
+
+    return want < left ? want : left;
+}
+
+/* read_chain -- reads in the chain from block on, as far as the next nbyte
+ * bytes of a read go but no further than READ_RUNS runs or half the cache,
+ * with every run in flight at once. Returns how many blocks it covered */
+static int read_chain(fs_t * fs, int block, size_t nbyte)
+{
+    CacheRun runs[READ_RUNS];
+    AioQueue * q;
+    long want = (nbyte + fs->disk.block_size - 1) / fs->disk.block_size;
+    int limit = fs->cache.mapped ? CACHE_RUN * READ_RUNS : fs->cache.size / 2,
+        nruns = 0,
+        blocks = 0;
+
+    // one block is just a cache_get away
+    if (want > limit)
+        want = limit;
+    if (want <= 1)
+        return 1;
+
+    while (blocks < want && nruns < READ_RUNS && block >= 0)
+    {
+        runs[nruns].block = block;
+        runs[nruns].count = 0;
+        do
+        {
+            runs[nruns].count++;
+            blocks++;
+            block = fs->fat.table[block];
+        } while (blocks < want && block == runs[nruns].block
+                + runs[nruns].count);
+        nruns++;
+    }
+
+    q = get_aio(fs);
+    cache_fetch(&fs->cache, q, runs, nruns);
+    put_aio(fs, q);
+    return blocks;
+}
+
+/* get_aio, put_aio -- take an idle queue from the pool, or open a new one,
+ * and give it back. NULL on a mapped disk, which doesn't need one */
+static AioQueue * get_aio(fs_t * fs)
+{
+    AioQueue * q = NULL;
+
+    if (fs->cache.mapped)
+        return NULL;
+    pthread_mutex_lock(&fs->aio_lock);
+    if (fs->aio_pool_size > 0)
+        q = fs->aio_pool[--fs->aio_pool_size];
+    pthread_mutex_unlock(&fs->aio_lock);
+
+    return q ? q : aio_open(&fs->disk, FS_AIO_DEPTH, AIO_ANY);
+}
+
+static void put_aio(fs_t * fs, AioQueue * q)
+{
+    AioQueue ** pool;
+
+    if (q == NULL)
+        return;
+    pthread_mutex_lock(&fs->aio_lock);
+    pool = realloc(fs->aio_pool, (fs->aio_pool_size + 1) * sizeof(q));
+    if (pool != NULL)
+    {
+        fs->aio_pool = pool;
+        fs->aio_pool[fs->aio_pool_size++] = q;
+        q = NULL;
+    }
+    pthread_mutex_unlock(&fs->aio_lock);
+    aio_close(q);
+}
+
+int write_blocks(fs_t * fs, char * buf, int block_offset, int block_count)
+{
+    if (blocks_write(&fs->disk, block_offset, block_count, buf) < 0)
+        return -1;
+    return block_offset + block_count;
+}
+int read_blocks(fs_t * fs, char * buf, int block_offset, int block_count)
+{
+    if (blocks_read(&fs->disk, block_offset, block_count, buf) < 0)
+        return -1;
+    return block_offset + block_count;
+}
+
+int init_virt_disk(fs_t * fs)
+{
+    // a small image gets no more cache than it has blocks
+    int cache_blocks = CACHE_BYTES / fs->disk.block_size;
+    if (cache_blocks > fs->disk.blocks)
+        cache_blocks = fs->disk.blocks;
+
+    // everything is sized by the geometry of the open disk. The reference
+    // and hole counts and the checksums go right after the FAT, in memory
+    // and on disk
+    fs->fat_blocks = ((long) fs->disk.blocks * sizeof(int)
+            + fs->disk.block_size - 1) / fs->disk.block_size;
+    fs->ref_blocks = fs->hole_blocks = fs->sum_blocks = fs->fat_blocks;
+    fs->super = calloc(SUPERBLOCK_BLOCK_SIZE, fs->disk.block_size);
+    fs->fat.table = calloc(TABLE_BLOCKS(fs), fs->disk.block_size);
+    fs->fat_dirty = calloc(TABLE_BLOCKS(fs), 1);
+    fs->freemap = malloc(FREEMAP_WORDS(fs) * sizeof(uint64_t));
+    fs->resmap = malloc(FREEMAP_WORDS(fs) * sizeof(uint64_t));
+    fs->fresh = malloc(FREEMAP_WORDS(fs) * sizeof(uint64_t));
+    fs->freeing = malloc(FREEMAP_WORDS(fs) * sizeof(uint64_t));
+    if (fs->super == NULL || fs->fat.table == NULL || fs->fat_dirty == NULL
+            || fs->freemap == NULL || fs->resmap == NULL
+            || fs->fresh == NULL || fs->freeing == NULL
+            || cache_init(&fs->cache, &fs->disk, cache_blocks) < 0)
+    {
+        printf("init_virt_disk: out of memory\n");
+        free_virt_disk(fs);
+        return -1;
+    }
+
+    fs->fat.refs = (int *) ((char *) fs->fat.table
+            + (long) fs->fat_blocks * fs->disk.block_size);
+    fs->fat.holes = (int *) ((char *) fs->fat.refs
+            + (long) fs->ref_blocks * fs->disk.block_size);
+    fs->fat.sums = (uint32_t *) ((char *) fs->fat.holes
+            + (long) fs->hole_blocks * fs->disk.block_size);
+    fs->shared = fs->holed = 0;
+    if (!fs->cache.mapped)
+        cache_set_sums(&fs->cache, fs->fat.sums, SUMS_DIRTY(fs));
+
+    // init superblock
+    fs->super->fat_offset = SUPERBLOCK_BLOCK_SIZE;
+    fs->super->refs_offset = SUPERBLOCK_BLOCK_SIZE + fs->fat_blocks;
+    fs->super->holes_offset = fs->super->refs_offset + fs->ref_blocks;
+    fs->super->sums_offset = fs->super->holes_offset + fs->hole_blocks;
+    fs->super->directory_offset = SUPERBLOCK_BLOCK_SIZE + TABLE_BLOCKS(fs);
+    fs->super->data_block_offset = SUPERBLOCK_BLOCK_SIZE + TABLE_BLOCKS(fs)
+        + DIRECTORY_BLOCK_SIZE;
+
+    // mark filesystem blocks as reserved, except the directory's head
+    for (int i = 0; i < fs->super->data_block_offset; i++)
+    {
+        fs->fat.table[i] = FAT_RESERVED;
+    }
+    fs->fat.table[fs->super->directory_offset] = FAT_EOF;
+    fs->super->version = FS_VERSION;
+    fs->super->block_size = fs->disk.block_size;
+    fs->super->block_count = fs->disk.blocks;
+
+    // the journal takes the end of the disk
+    fs->super->journal_blocks = journal_size(fs);
+    fs->super->journal_offset = fs->disk.blocks - fs->super->journal_blocks;
+    for (int i = fs->super->journal_offset; i < fs->disk.blocks; i++)
+        fs->fat.table[i] = FAT_RESERVED;
+    build_freemap(fs);
+
+    return open_journal(fs);
+}
+void free_virt_disk(fs_t * fs)
+{
+    cache_destroy(&fs->cache);
+    if (!fs->metadata_mapped)
+    {
+        free(fs->super);
+        free(fs->fat.table);
+    }
+    free(fs->fat_dirty);
+    free(fs->freemap);
+    free(fs->resmap);
+    free(fs->fresh);
+    free(fs->freeing);
+    free(fs->journal_home);
+    free(fs->journal_iov);
+    free(fs->journal_buf);
+    fs->journal_home = NULL;
+    fs->journal_iov = NULL;
+    fs->journal_buf = NULL;
+    fs->journal_capacity = 0;
+    fs->super = NULL;
+    fs->fat.table = fs->fat.refs = fs->fat.holes = NULL;
+    fs->fat.sums = NULL;
+    fs->fat_dirty = NULL;
+    fs->freemap = fs->resmap = fs->fresh = fs->freeing = NULL;
+    fs->metadata_mapped = 0;
+}
+int flush_metadata(fs_t * fs)
+{
+    int ret = 0;
+
+    // with a journal the directory blocks stay pinned, out of the cache's
+    // write-back, until they have been logged
+    fs->journal_count = fs->journal_pinned = 0;
+    fs->journal_open = fs->journal_capacity > 0;
+    if (store_directories(fs) < 0)
+        ret = -1;
+    fs->journal_open = 0;
+
+    // data blocks first, so the FAT never points at garbage
+    if (ret == 0 && cache_sync(&fs->cache) < 0)
+        ret = -1;
+    if (ret == 0)
+        sum_metadata(fs);
+    if (ret == 0 && fs->journal_capacity > 0 && log_metadata(fs) < 0)
+        ret = -1;
+    for (int i = 0; i < fs->journal_pinned; i++)
+        cache_put(&fs->cache, fs->journal_home[i]);
+    fs->journal_pinned = 0;
+    if (ret < 0)
+        return -1;
+
+    // then everything goes where it belongs
+    if (cache_sync(&fs->cache) < 0
+            || write_blocks(fs, (char *) fs->super, 0,
+                SUPERBLOCK_BLOCK_SIZE) < 0)
+        return -1;
+    // one write per run of dirty FAT, reference and hole count blocks
+    for (int i = 0, end; i < TABLE_BLOCKS(fs); i = end)
+    {
+        for (end = i; end < TABLE_BLOCKS(fs) && fs->fat_dirty[end]; end++)
+            fs->fat_dirty[end] = 0;
+        if (end == i)
+        {
+            end++;
+            continue;
+        }
+        if (write_blocks(fs, (char *) fs->fat.table + i * fs->disk.block_size,
+                    fs->super->fat_offset + i, end - i) < 0)
+            return -1;
+    }
+    if (sync_disk(&fs->disk) < 0)
+        return -1;
+    release_freed(fs);
+    return 0;
+}
+/* load_sums -- checks the FAT and its counts against their checksums at
+ * mount and has the cache check everything else from then on, unless the
+ * last mount crashed part way through a commit logged in parts or this one
+ * is mapped: then they are forgotten */
+static int load_sums(fs_t * fs)
+{
+    int bs = fs->disk.block_size,
+        block;
+
+    cache_set_sums(&fs->cache, NULL, NULL);
+    if (fs->fat.sums == NULL)
+        return 0;
+    if (fs->cache.mapped)
+        forget_sums(fs);
+    else if (fs->journal_torn)
+    {
+        // the parts that made it have no checksums to go with them
+        forget_sums(fs);
+        if (write_blocks(fs, (char *) fs->fat.sums, fs->super->sums_offset,
+                    fs->sum_blocks) < 0)
+            return -1;
+    }
+    else
+    {
+        for (int i = 0; i < TABLE_BLOCKS(fs) - fs->sum_blocks; i++)
+        {
+            block = fs->super->fat_offset + i;
+            if (fs->fat.sums[block] != SUM_UNKNOWN && fs->fat.sums[block]
+                    != cache_sum(&fs->cache, block,
+                        (char *) fs->fat.table + (long) i * bs))
+            {
+                printf("fs_mount: FAT block %d failed its checksum\n", block);
+                return -1;
+            }
+        }
+        cache_set_sums(&fs->cache, fs->fat.sums, SUMS_DIRTY(fs));
+    }
+
+    // so the next mount knows whether this one got to fs_umount
+    fs->super->mounted = 1;
+    if (write_blocks(fs, (char *) fs->super, 0, SUPERBLOCK_BLOCK_SIZE) < 0)
+        return -1;
+    return sync_disk(&fs->disk);
+}
+/* forget_sums -- drops every checksum, for the table to be written out
+ * empty at the next commit */
+static void forget_sums(fs_t * fs)
+{
+    memset(fs->fat.sums, 0, (long) fs->sum_blocks * fs->disk.block_size);
+    memset(SUMS_DIRTY(fs), 1, fs->sum_blocks);
+}
+/* sum_metadata -- checksums of the FAT and count blocks a commit writes,
+ * and of those that have none yet, to be logged with them */
+static void sum_metadata(fs_t * fs)
+{
+    int block;
+
+    if (fs->fat.sums == NULL)
+        return;
+    for (int i = 0; i < TABLE_BLOCKS(fs) - fs->sum_blocks; i++)
+    {
+        block = fs->super->fat_offset + i;
+        if (fs->fat_dirty[i] || fs->fat.sums[block] == SUM_UNKNOWN)
+            cache_set_sum(&fs->cache, block,
+                    (char *) fs->fat.table + (long) i * fs->disk.block_size);
+    }
+}
+/* journal_size -- blocks a new image's journal takes: enough to log the
+ * superblock, the whole FAT with its reference and hole counts and
+ * JOURNAL_DIR_BLOCKS directory blocks. None on disks too small to spare an
+ * eighth of themselves for it */
+static int journal_size(fs_t * fs)
+{
+    int logged = SUPERBLOCK_BLOCK_SIZE + TABLE_BLOCKS(fs) + JOURNAL_DIR_BLOCKS,
+        blocks = 1 + (logged * (int) sizeof(int) + fs->disk.block_size - 1)
+            / fs->disk.block_size + logged;
+
+    return blocks <= fs->disk.blocks / 8 ? blocks : 0;
+}
+/* open_journal -- sets up for commits to the superblock's journal. There
+ * are none on a mapped disk, where metadata is changed in place */
+static int open_journal(fs_t * fs)
+{
+    int bs = fs->disk.block_size;
+
+    free(fs->journal_home);
+    free(fs->journal_iov);
+    free(fs->journal_buf);
+    fs->journal_home = NULL;
+    fs->journal_iov = NULL;
+    fs->journal_buf = NULL;
+    fs->journal_capacity = 0;
+    if (fs->super->journal_blocks <= 0 || fs->metadata_mapped
+            || fs->cache.mapped)
+        return 0;
+
+    fs->journal_capacity = fs->super->journal_blocks - 1 - JOURNAL_LIST(fs);
+    fs->journal_home = malloc(fs->journal_capacity * sizeof(int));
+    fs->journal_iov = malloc((fs->journal_capacity + 1)
+            * sizeof(struct iovec));
+    fs->journal_buf = malloc((1 + JOURNAL_LIST(fs)) * (long) bs);
+    if (fs->journal_home == NULL || fs->journal_iov == NULL
+            || fs->journal_buf == NULL)
+    {
+        printf("fs_mount: out of memory\n");
+        return -1;
+    }
+    fs->journal_iov[0].iov_base = fs->journal_buf;
+    fs->journal_iov[0].iov_len = (1 + JOURNAL_LIST(fs)) * (long) bs;
+    return 0;
+}
+/* journal_add -- puts block, whose new contents are at buf, in the commit
+ * being built. When the journal is full what it has so far goes out as a
+ * part of its own first. The directory blocks added while journal_open
+ * stay pinned in the cache, so they get no more than a quarter of it, for
+ * cache_get to find a slot */
+static int journal_add(fs_t * fs, int block, char * buf)
+{
+    if ((fs->journal_count == fs->journal_capacity
+                || (fs->journal_open
+                    && fs->journal_pinned >= fs->cache.size / 4))
+            && write_journal(fs) < 0)
+        return -1;
+    fs->journal_home[fs->journal_count] = block;
+    fs->journal_iov[fs->journal_count + 1].iov_base = buf;
+    fs->journal_iov[fs->journal_count + 1].iov_len = fs->disk.block_size;
+    fs->journal_count++;
+    fs->journal_pinned += fs->journal_open;
+
+    // a directory block goes in place after its checksum is logged
+    if (fs->journal_open)
+        cache_set_sum(&fs->cache, block, buf);
+    return 0;
+}
+/* write_journal -- logs the part of a commit built so far and writes it
+ * where it belongs, after the data it covers, then starts the next part.
+ * The directory blocks in it are unpinned */
+static int write_journal(fs_t * fs)
+{
+    int ret = 0,
+        block;
+
+    if (cache_sync(&fs->cache) < 0 || log_blocks(fs, 1) < 0)
+        ret = -1;
+    for (int i = 0; ret == 0 && i < fs->journal_count; i++)
+    {
+        block = fs->journal_home[i];
+        if (write_blocks(fs, fs->journal_iov[i + 1].iov_base, block, 1) < 0)
+            ret = -1;
+        // nor do tables written here need it again
+        else if (block >= fs->super->fat_offset
+                && block < fs->super->fat_offset + TABLE_BLOCKS(fs))
+            fs->fat_dirty[block - fs->super->fat_offset] = 0;
+    }
+    if (ret == 0 && sync_disk(&fs->disk) < 0)
+        ret = -1;
+
+    for (int i = 0; i < fs->journal_pinned; i++)
+        cache_put(&fs->cache, fs->journal_home[i]);
+    fs->journal_count = fs->journal_pinned = 0;
+    return ret;
+}
+static uint32_t journal_checksum(const struct iovec * iov, int iovcnt)
+{
+    uint32_t sum = 2166136261u;
+
+    // FNV-1a a word at a time
+    for (int i = 0; i < iovcnt; i++)
+    {
+        const uint32_t * word = iov[i].iov_base;
+        for (size_t n = 0; n < iov[i].iov_len / sizeof(uint32_t); n++)
+            sum = (sum ^ word[n]) * 16777619u;
+    }
+    return sum;
+}
+/* log_metadata -- writes the commit being built to the journal: the
+ * directory blocks store_directories put in it, the superblock and the
+ * dirty FAT and reference count blocks. Returns once it's on stable
+ * storage */
+static int log_metadata(fs_t * fs)
+{
+    int bs = fs->disk.block_size;
+
+    if (journal_add(fs, 0, (char *) fs->super) < 0)
+        return -1;
+    for (int i = 0; i < TABLE_BLOCKS(fs); i++)
+    {
+        if (fs->fat_dirty[i] && journal_add(fs, fs->super->fat_offset + i,
+                    (char *) fs->fat.table + (long) i * bs) < 0)
+            return -1;
+    }
+    return log_blocks(fs, 0);
+}
+/* log_blocks -- writes the blocks journal_add collected to the journal,
+ * for replay_journal to find, and waits for them to be on stable storage.
+ * 'more' says they aren't the last part of the commit */
+static int log_blocks(fs_t * fs, int more)
+{
+    JournalHeader * header = (JournalHeader *) fs->journal_buf;
+    int bs = fs->disk.block_size;
+
+    memset(fs->journal_buf, 0, (1 + JOURNAL_LIST(fs)) * (long) bs);
+    memcpy(fs->journal_buf + bs, fs->journal_home,
+            fs->journal_count * sizeof(int));
+    header->magic = JOURNAL_MAGIC;
+    header->sequence = ++fs->journal_sequence;
+    header->count = fs->journal_count;
+    header->more = more;
+    header->checksum = journal_checksum(fs->journal_iov,
+            fs->journal_count + 1);
+
+    if (blocks_writev(&fs->disk, fs->super->journal_offset, fs->journal_iov,
+                fs->journal_count + 1) < 0)
+        return -1;
+    STAT_ADD(fs->stats.commits, 1);
+    STAT_ADD(fs->stats.commit_blocks, fs->journal_count);
+    return sync_disk(&fs->disk);
+}
+/* replay_journal -- copies a complete commit found in the journal to where
+ * its blocks belong and empties the journal; a torn one is dropped. fs has
+ * the superblock but nothing else loaded yet */
+static int replay_journal(fs_t * fs)
+{
+    Superblock sb = *fs->super;
+    int bs = fs->disk.block_size,
+        list = (sb.journal_blocks * (int) sizeof(int) + bs - 1) / bs,
+        ret = 0;
+    struct iovec iov[2];
+    JournalHeader * header;
+    uint32_t checksum;
+    char * buf;
+    int * home;
+
+    if (sb.journal_blocks <= 0 || sb.journal_offset <= 0
+            || sb.journal_offset + sb.journal_blocks > fs->disk.blocks)
+        return 0;
+    if ((buf = malloc((long) sb.journal_blocks * bs)) == NULL)
+    {
+        printf("fs_mount: out of memory\n");
+        return -1;
+    }
+    header = (JournalHeader *) buf;
+    home = (int *) (buf + bs);
+    if (read_blocks(fs, buf, sb.journal_offset, 1 + list) < 0)
+    {
+        free(buf);
+        return -1;
+    }
+    if (header->magic != JOURNAL_MAGIC || header->count <= 0
+            || header->count > sb.journal_blocks - 1 - list
+            || read_blocks(fs, buf + (1 + list) * (long) bs,
+                sb.journal_offset + 1 + list, header->count) < 0)
+    {
+        free(buf);
+        return 0;
+    }
+
+    checksum = header->checksum;
+    header->checksum = 0;
+    iov[0].iov_base = buf;
+    iov[0].iov_len = (1 + list + header->count) * (long) bs;
+    if (journal_checksum(iov, 1) == checksum)
+    {
+        fs->journal_torn = header->more;
+        for (int i = 0; i < header->count && ret == 0; i++)
+        {
+            if (home[i] < 0 || home[i] >= sb.journal_offset)
+                ret = -1;
+            else if (write_blocks(fs, buf + (1 + list + i) * (long) bs,
+                        home[i], 1) < 0)
+                ret = -1;
+        }
+        if (ret < 0)
+            printf("fs_mount: couldn't replay the journal\n");
+        else
+            ret = sync_disk(&fs->disk);
+    }
+    fs->journal_sequence = header->sequence;
+
+    // nothing in it needs doing again
+    if (ret == 0)
+    {
+        memset(buf, 0, bs);
+        iov[0].iov_len = bs;
+        if (blocks_writev(&fs->disk, sb.journal_offset, iov, 1) < 0
+                || sync_disk(&fs->disk) < 0)
+            ret = -1;
+    }
+    free(buf);
+    return ret;
+}
+/* clear_journal -- empties the journal once everything in it is in place,
+ * so the next mount has nothing to replay */
+static int clear_journal(fs_t * fs)
+{
+    char * buf;
+    int ret;
+
+    if (fs->journal_capacity == 0)
+        return 0;
+    if ((buf = calloc(1, fs->disk.block_size)) == NULL)
+        return -1;
+    ret = write_blocks(fs, buf, fs->super->journal_offset, 1) < 0
+        || sync_disk(&fs->disk) < 0 ? -1 : 0;
+    free(buf);
+    return ret;
+}
+/* commit -- makes everything done on fs so far durable. Callers that come
+ * in while a commit is being written wait for it to finish, then the first
+ * of them writes the next one for all of them */
+static int commit(fs_t * fs)
+{
+    long ticket;
+    int ret;
+
+    pthread_mutex_lock(&fs->commit_lock);
+    ticket = fs->commits_started + 1;
+    while (fs->committing && fs->commits_done < ticket)
+        pthread_cond_wait(&fs->commit_cond, &fs->commit_lock);
+    if (fs->commits_done >= ticket)
+    {
+        ret = fs->commit_status;
+        pthread_mutex_unlock(&fs->commit_lock);
+        return ret;
+    }
+    fs->committing = 1;
+    fs->commits_started = ticket;
+    pthread_mutex_unlock(&fs->commit_lock);
+
+    pthread_rwlock_wrlock(&fs->tree_lock);
+    ret = flush_buffers(fs);
+    if (flush_metadata(fs) < 0)
+        ret = -1;
+    pthread_rwlock_unlock(&fs->tree_lock);
+
+    pthread_mutex_lock(&fs->commit_lock);
+    fs->committing = 0;
+    fs->commits_done = ticket;
+    fs->commit_status = ret;
+    pthread_cond_broadcast(&fs->commit_cond);
+    pthread_mutex_unlock(&fs->commit_lock);
+    return ret;
+}
+/* reclaim_space -- commits if that gives back blocks freed since the last
+ * commit, for a call that ran out of space to try again. Whether it did */
+static int reclaim_space(fs_t * fs)
+{
+    int freeing;
+
+    pthread_mutex_lock(&fs->alloc_lock);
+    freeing = fs->freeing_count;
+    pthread_mutex_unlock(&fs->alloc_lock);
+    return freeing > 0 && commit(fs) == 0;
+}
+/* metadata_dirty -- whether there's anything for a commit to write */
+static int metadata_dirty(fs_t * fs)
+{
+    int dirty = __atomic_load_n(&fs->buffered, __ATOMIC_RELAXED) > 0;
+
+    pthread_rwlock_rdlock(&fs->tree_lock);
+    pthread_mutex_lock(&fs->alloc_lock);
+    for (int i = 0; i < TABLE_BLOCKS(fs) && !dirty; i++)
+        dirty = fs->fat_dirty[i];
+    pthread_mutex_unlock(&fs->alloc_lock);
+    for (int i = 0; i < fs->disk.blocks && !dirty; i++)
+        dirty = fs->dcache[i] != NULL && fs->dcache[i]->dirty;
+    pthread_rwlock_unlock(&fs->tree_lock);
+    return dirty;
+}
+static void * commit_worker(void * arg)
+{
+    fs_t * fs = arg;
+    struct timespec until;
+
+    pthread_mutex_lock(&fs->commit_lock);
+    while (!fs->commit_stopping)
+    {
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += JOURNAL_INTERVAL;
+        while (!fs->commit_stopping && pthread_cond_timedwait(
+                    &fs->commit_wake, &fs->commit_lock, &until) == 0)
+            ;
+        if (fs->commit_stopping)
+            break;
+        pthread_mutex_unlock(&fs->commit_lock);
+        if (metadata_dirty(fs))
+            commit(fs);
+        pthread_mutex_lock(&fs->commit_lock);
+    }
+    pthread_mutex_unlock(&fs->commit_lock);
+    return NULL;
+}
+/* start_commits -- the commit thread, on a mount with a journal. Without
+ * it metadata is only written on fs_sync, fs_fsync and fs_umount */
+static void start_commits(fs_t * fs)
+{
+    if (fs->journal_capacity > 0
+            && pthread_create(&fs->commit_thread, NULL, commit_worker, fs)
+                == 0)
+        fs->commit_running = 1;
+}
+static void stop_commits(fs_t * fs)
+{
+    if (!fs->commit_running)
+        return;
+    pthread_mutex_lock(&fs->commit_lock);
+    fs->commit_stopping = 1;
+    pthread_cond_broadcast(&fs->commit_wake);
+    pthread_mutex_unlock(&fs->commit_lock);
+    pthread_join(fs->commit_thread, NULL);
+    fs->commit_running = 0;
+}
+int free_alloc_chain(fs_t * fs, int head)
+{
+    int idx;
+
+    /* this shouldn't happen */
+    if (head > fs->disk.blocks || head == FAT_RESERVED)
+        return -1;
+
+    pthread_mutex_lock(&fs->alloc_lock);
+    while (head >= 0)
+    {
+        // another file still links to it, and so to the rest of the chain
+        if (fs->fat.refs != NULL && fs->fat.refs[head] > 0)
+        {
+            set_refs(fs, head, fs->fat.refs[head] - 1);
+            break;
+        }
+        idx = fs->fat.table[head];
+        cache_discard(&fs->cache, head);
+
+        /* either unused or probably hit the end of the chain */
+        if (idx == FAT_UNUSED)
+            break;
+
+        set_fat_entry(fs, head, FAT_UNUSED);
+        head = idx;
+    }
+    pthread_mutex_unlock(&fs->alloc_lock);
+    return 0;
+}
+
+int find_avail_alloc_entry(fs_t * fs)
+{
+#ifdef FS_LINEAR_ALLOC
+    /* reference first-fit scan, kept around for bench/bench_alloc.c */
+    int fat_idx = fs->super->data_block_offset;
+    while (fat_idx < fs->disk.blocks
+            && (fs->fat.table[fat_idx] != FAT_UNUSED
+                || fs->freeing[fat_idx / 64] >> fat_idx % 64 & 1))
+    {
+        fat_idx++;
+    }
+    STAT_ADD(fs->stats.alloc_scans, 1);
+    STAT_ADD(fs->stats.alloc_steps, fat_idx - fs->super->data_block_offset);
+
+    if (fat_idx == fs->disk.blocks)
+        return -1;
+    return fat_idx;
+#else
+    int word,
+        fat_idx,
+        hint = fs->freemap_hint;
+
+    // every bit below the hint is known to be in use
+    while (fs->freemap_hint < FREEMAP_WORDS(fs)
+            && fs->freemap[fs->freemap_hint] == UINT64_MAX)
+        fs->freemap_hint++;
+
+    // skip blocks held for other files, unless they're all that's left
+    word = fs->freemap_hint;
+    while (word < FREEMAP_WORDS(fs)
+            && (fs->freemap[word] | fs->resmap[word]) == UINT64_MAX)
+        word++;
+    STAT_ADD(fs->stats.alloc_scans, 1);
+    STAT_ADD(fs->stats.alloc_steps, word - hint + 1);
+
+    if (word == FREEMAP_WORDS(fs))
+    {
+        if (fs->freemap_hint == FREEMAP_WORDS(fs))
+            return -1;
+        drop_reservations(fs);
+        word = fs->freemap_hint;
+    }
+
+    fat_idx = word * 64
+        + __builtin_ctzll(~(fs->freemap[word] | fs->resmap[word]));
+    if (fat_idx >= fs->disk.blocks)
+        return -1;
+    return fat_idx;
+#endif
+}
+int find_free_run(fs_t * fs, int goal, int length)
+{
+    int start = -1,
+        run = 0;
+
+    STAT_ADD(fs->stats.alloc_scans, 1);
+    if (goal < fs->super->data_block_offset || goal >= fs->disk.blocks)
+        goal = fs->super->data_block_offset;
+
+    // search from the goal to the end of the disk, then wrap around once
+    for (int i = 0; i < fs->disk.blocks - fs->super->data_block_offset; i++)
+    {
+        int fat_idx = goal + i;
+        if (fat_idx >= fs->disk.blocks)
+            fat_idx -= fs->disk.blocks - fs->super->data_block_offset;
+        if (fat_idx == fs->super->data_block_offset)
+            run = 0;
+
+        // whole word taken: jump to the next one
+        if (fat_idx % 64 == 0 && fat_idx + 64 <= fs->disk.blocks
+                && (fs->freemap[fat_idx / 64] | fs->resmap[fat_idx / 64])
+                    == UINT64_MAX)
+        {
+            i += 63;
+            run = 0;
+            continue;
+        }
+
+        if (block_taken(fs, fat_idx))
+        {
+            run = 0;
+            continue;
+        }
+        if (run++ == 0)
+            start = fat_idx;
+        if (run == length)
+        {
+            STAT_ADD(fs->stats.alloc_steps, i + 1);
+            return start;
+        }
+    }
+    STAT_ADD(fs->stats.alloc_steps,
+            fs->disk.blocks - fs->super->data_block_offset);
+    return -1;
+}
+int alloc_entry(fs_t * fs, int prev)
+{
+    int fat_idx = -1;
+
+    pthread_mutex_lock(&fs->alloc_lock);
+    // the last free blocks may be promised to buffered appends
+    if (avail_blocks(fs) <= 0)
+    {
+        pthread_mutex_unlock(&fs->alloc_lock);
+        return -1;
+    }
+    if (fs->alloc_mode == ALLOC_EXTENT && prev >= 0)
+    {
+        // prefer growing into the block right after the file's last one,
+        // if the freemap has it free: one freed since the last commit isn't
+        if (prev + 1 < fs->disk.blocks
+                && !(fs->freemap[(prev + 1) / 64] >> (prev + 1) % 64 & 1)
+                && (!block_reserved(fs, prev + 1)
+                    || owns_reservation(fs, prev)))
+        {
+            fat_idx = prev + 1;
+        }
+        else
+        {
+            // start a new run and hold the blocks after it for this file
+            fat_idx = find_free_run(fs, prev + 1, EXTENT_RESERVE);
+            if (fat_idx >= 0)
+                reserve_run(fs, fat_idx + 1, EXTENT_RESERVE - 1);
+        }
+    }
+
+    if (fat_idx < 0)
+        fat_idx = find_avail_alloc_entry(fs);
+    if (fat_idx >= 0)
+    {
+        set_fat_entry(fs, fat_idx, FAT_EOF);
+        if (prev >= 0)
+            set_fat_entry(fs, prev, fat_idx);
+    }
+    pthread_mutex_unlock(&fs->alloc_lock);
+    return fat_idx;
+}
+/* reserve_ahead -- holds length free blocks for the chain ending at tail,
+ * which is about to grow by that much. They follow tail when there's room;
+ * otherwise the first block of a free run that long is allocated and linked
+ * to tail right away. Free blocks right after the run are held as well, up
+ * to EXTENT_RESERVE in all. Returns the chain's tail afterwards */
+int reserve_ahead(fs_t * fs, int tail, int length)
+{
+    int start,
+        hold = length < EXTENT_RESERVE ? EXTENT_RESERVE : length;
+
+    pthread_mutex_lock(&fs->alloc_lock);
+    // whatever the chain held already counts as free for the search
+    release_reservation(fs, tail);
+    start = find_free_run(fs, tail + 1, length);
+    if (start == tail + 1)
+        reserve_run(fs, start, hold);
+    else if (start >= 0)
+    {
+        reserve_run(fs, start + 1, hold - 1);
+        set_fat_entry(fs, start, FAT_EOF);
+        set_fat_entry(fs, tail, start);
+        tail = start;
+    }
+    pthread_mutex_unlock(&fs->alloc_lock);
+    return tail;
+}
+void set_fat_entry(fs_t * fs, int fat_idx, int value)
+{
+    int word = fat_idx / 64,
+        was_free = fs->fat.table[fat_idx] == FAT_UNUSED;
+    uint64_t bit = (uint64_t)1 << (fat_idx % 64);
+
+    fs->fat.table[fat_idx] = value;
+    fs->fat_dirty[fat_idx * sizeof(int) / fs->disk.block_size] = 1;
+    if (value == FAT_UNUSED)
+    {
+        if (!was_free && !(fs->fresh[word] & bit))
+        {
+            // the last commit may still have it in use
+            fs->freeing[word] |= bit;
+            fs->freeing_count++;
+        }
+        else if (!was_free)
+        {
+            fs->fresh[word] &= ~bit;
+            fs->freemap[word] &= ~bit;
+            fs->freemap_free++;
+            if (word < fs->freemap_hint)
+                fs->freemap_hint = word;
+        }
+
+        // the chain this block ended no longer owns what came after it
+        release_reservation(fs, fat_idx);
+        if (fs->holed > 0 && fs->fat.holes[fat_idx] != 0)
+            set_holes(fs, fat_idx, 0);
+    }
+    else
+    {
+        if (fs->freeing[word] & bit)
+        {
+            fs->freeing[word] &= ~bit;
+            fs->freeing_count--;
+        }
+        else if (was_free)
+        {
+            fs->fresh[word] |= bit;
+            fs->freemap_free--;
+        }
+        fs->freemap[word] |= bit;
+        if (fs->resmap[word] & bit)
+            consume_reservation(fs, fat_idx);
+    }
+}
+/* release_freed -- hands the blocks freed before a commit to the allocator
+ * once that commit is durable, and forgets which ones are fresh */
+static void release_freed(fs_t * fs)
+{
+    pthread_mutex_lock(&fs->alloc_lock);
+    for (int i = 0; fs->freeing_count > 0 && i < FREEMAP_WORDS(fs); i++)
+    {
+        if (fs->freeing[i] == 0)
+            continue;
+        fs->freemap[i] &= ~fs->freeing[i];
+        fs->freemap_free += __builtin_popcountll(fs->freeing[i]);
+        if (i < fs->freemap_hint)
+            fs->freemap_hint = i;
+        fs->freeing_count -= __builtin_popcountll(fs->freeing[i]);
+        fs->freeing[i] = 0;
+    }
+    memset(fs->fresh, 0, FREEMAP_WORDS(fs) * sizeof(uint64_t));
+    pthread_mutex_unlock(&fs->alloc_lock);
+}
+/* set_refs -- sets block fat_idx's extra references, under alloc_lock */
+void set_refs(fs_t * fs, int fat_idx, int value)
+{
+    if ((fs->fat.refs[fat_idx] > 0) != (value > 0))
+        __atomic_add_fetch(&fs->shared, value > 0 ? 1 : -1, __ATOMIC_RELAXED);
+    // unshare peeks at it without the lock
+    __atomic_store_n(&fs->fat.refs[fat_idx], value, __ATOMIC_RELAXED);
+    fs->fat_dirty[fs->fat_blocks
+        + fat_idx * sizeof(int) / fs->disk.block_size] = 1;
+}
+/* set_holes -- sets how many blocks are missing after block fat_idx, under
+ * alloc_lock */
+void set_holes(fs_t * fs, int fat_idx, int value)
+{
+    if ((fs->fat.holes[fat_idx] > 0) != (value > 0))
+        __atomic_add_fetch(&fs->holed, value > 0 ? 1 : -1, __ATOMIC_RELAXED);
+    fs->fat.holes[fat_idx] = value;
+    fs->fat_dirty[fs->fat_blocks + fs->ref_blocks
+        + fat_idx * sizeof(int) / fs->disk.block_size] = 1;
+}
+void build_freemap(fs_t * fs)
+{
+    memset(fs->freemap, 0, FREEMAP_WORDS(fs) * sizeof(uint64_t));
+    fs->freemap_free = 0;
+    for (int i = 0; i < fs->disk.blocks; i++)
+    {
+        if (fs->fat.table[i] != FAT_UNUSED)
+            fs->freemap[i / 64] |= (uint64_t)1 << (i % 64);
+        else
+            fs->freemap_free++;
+    }
+
+    // bits past the end of the disk are never available
+    for (int i = fs->disk.blocks; i < FREEMAP_WORDS(fs) * 64; i++)
+        fs->freemap[i / 64] |= (uint64_t)1 << (i % 64);
+
+    // nothing has changed since what's on disk
+    memset(fs->fresh, 0, FREEMAP_WORDS(fs) * sizeof(uint64_t));
+    memset(fs->freeing, 0, FREEMAP_WORDS(fs) * sizeof(uint64_t));
+    fs->freeing_count = 0;
+    fs->freemap_hint = 0;
+    drop_reservations(fs);
+}
+int get_free_blocks(fs_t * fs)
+{
+    return fs->freemap_free + fs->freeing_count;
+}
+/* avail_blocks -- free blocks an allocation may take right now: not those
+ * freed since the last commit, nor those promised to buffered appends.
+ * Under alloc_lock */
+static int avail_blocks(fs_t * fs)
+{
+    return fs->freemap_free - fs->pending_blocks;
+}
+int block_taken(fs_t * fs, int fat_idx)
+{
+    uint64_t bit = (uint64_t)1 << (fat_idx % 64);
+    return ((fs->freemap[fat_idx / 64] | fs->resmap[fat_idx / 64]) & bit) != 0;
+}
+int block_reserved(fs_t * fs, int fat_idx)
+{
+    return (fs->resmap[fat_idx / 64] >> (fat_idx % 64)) & 1;
+}
+int owns_reservation(fs_t * fs, int tail)
+{
+    for (int i = 0; i < MAX_RESERVATIONS; i++)
+    {
+        if (fs->reservations[i].next == tail + 1
+                && fs->reservations[i].next < fs->reservations[i].end)
+            return 1;
+    }
+    return 0;
+}
+int reserve_run(fs_t * fs, int start, int length)
+{
+    Reservation * res;
+    int end = start;
+
+    // only hold blocks that are actually free and not held by someone else
+    while (end < fs->disk.blocks && end < start + length
+            && !block_taken(fs, end))
+        end++;
+    if (end == start)
+        return 0;
+
+    // take over the oldest slot if they're all in use
+    res = &fs->reservations[fs->reservation_clock];
+    fs->reservation_clock = (fs->reservation_clock + 1) % MAX_RESERVATIONS;
+    for (int i = res->next; i < res->end; i++)
+        fs->resmap[i / 64] &= ~((uint64_t)1 << (i % 64));
+
+    res->next = start;
+    res->end = end;
+    for (int i = start; i < end; i++)
+        fs->resmap[i / 64] |= (uint64_t)1 << (i % 64);
+
+    return end - start;
+}
+void consume_reservation(fs_t * fs, int fat_idx)
+{
+    fs->resmap[fat_idx / 64] &= ~((uint64_t)1 << (fat_idx % 64));
+    for (int i = 0; i < MAX_RESERVATIONS; i++)
+    {
+        if (fs->reservations[i].next <= fat_idx
+                && fat_idx < fs->reservations[i].end)
+        {
+            // anything this reservation skipped over is given back
+            for (int j = fs->reservations[i].next; j < fat_idx; j++)
+                fs->resmap[j / 64] &= ~((uint64_t)1 << (j % 64));
+            fs->reservations[i].next = fat_idx + 1;
+            return;
+        }
+    }
+}
+void release_reservation(fs_t * fs, int tail)
+{
+    for (int i = 0; i < MAX_RESERVATIONS; i++)
+    {
+        if (fs->reservations[i].next == tail + 1)
+        {
+            for (int j = fs->reservations[i].next;
+                    j < fs->reservations[i].end; j++)
+                fs->resmap[j / 64] &= ~((uint64_t)1 << (j % 64));
+            fs->reservations[i].next = fs->reservations[i].end = 0;
+        }
+    }
+}
+void drop_reservations(fs_t * fs)
+{
+    memset(fs->resmap, 0, FREEMAP_WORDS(fs) * sizeof(uint64_t));
+    memset(fs->reservations, 0, sizeof(fs->reservations));
+    fs->reservation_clock = 0;
+}
+int fs_set_alloc_mode(fs_t * fs, int mode)
+{
+    if (mode != ALLOC_FIRST_FIT && mode != ALLOC_EXTENT)
+        return -1;
+    fs->alloc_mode = mode;
+    if (mode == ALLOC_FIRST_FIT)
+        drop_reservations(fs);
+    return 0;
+}
+int fs_block_size(fs_t * fs)
+{
+    return fs->disk.block_size;
+}
+/* create_entry -- adds a file or directory 'name', a directory with a fresh
+ * head block */
+int create_entry(fs_t * fs, char * name, int type)
+{
+    int fat_idx;
+    char leaf[MAX_FILENAME];
+    Directory * parent;
+
+    parent = resolve_parent(fs, name, leaf);
+    if (parent == NULL)
+    {
+        printf("No such directory: %s\n", name);
+        return -1;
+    }
+
+    if (!valid_leaf(leaf))
+    {
+        printf("Invalid name: %s\n", name);
+        return -1;
+    }
+
+    if (parent->readonly)
+    {
+        printf("Read-only snapshot: %s\n", name);
+        return -1;
+    }
+
+    if (dir_lookup(parent, leaf) >= 0)
+    {
+        printf("File already exists\n");
+        return -1;
+    }
+
+    // make room in the directory, then find an empty FAT entry for a
+    // directory. A file gets its first block when it outgrows its entry
+    fat_idx = FAT_EOF;
+    if (dir_reserve(fs, parent, parent->size + 1) < 0 || (type != ATTR_FILE
+                && (fat_idx = alloc_entry(fs, -1)) < 0))
+    {
+        printf("Not enough space\n");
+        return -1;
+    }
+
+    // an empty directory is just a zero entry count
+    if (fat_idx >= 0)
+        cache_zero(&fs->cache, fat_idx);
+
+    // finally, create a file attrib entry
+    append_entry(parent, leaf, type, fat_idx, 0);
+    return 0;
+}
+/* append_entry -- adds an entry after d's last one, which dir_reserve has
+ * made room for */
+static void append_entry(Directory * d, const char * name, int type, int head,
+        int size)
+{
+    Attribute * attrib = &d->attributes[d->size];
+
+    memset(attrib, 0, sizeof(Attribute));
+    strcpy(attrib->name, name);
+    attrib->size = size;
+    attrib->offset = head;
+    attrib->type = type;
+    d->open_counts[d->size] = 0;
+
+    d->size++;
+    d->dirty = 1;
+    dir_index_insert(d, d->size - 1);
+}
+/* next_component -- copies the path component at the start of 'path' into
+ * 'name', skipping leading slashes. Returns where the next one starts, or
+ * NULL if the component is too long; 'name' is empty at the end of 'path' */
+static const char * next_component(const char * path, char * name)
+{
+    int len = 0;
+
+    while (*path == '/')
+        path++;
+    while (path[len] != '\0' && path[len] != '/')
+        len++;
+
+    if (len >= MAX_FILENAME)
+    {
+        printf("Filename can't be longer than %d characters.\n", 
+                MAX_FILENAME - 1);
+        return NULL;
+    }
+    memcpy(name, path, len);
+    name[len] = '\0';
+    return path + len;
+}
+/* valid_leaf -- whether a new entry may be called 'leaf': not nothing, and
+ * not "." or "..", which name a directory and its parent in a path */
+static int valid_leaf(const char * leaf)
+{
+    return leaf[0] != '\0' && strcmp(leaf, ".") != 0
+        && strcmp(leaf, "..") != 0;
+}
+Directory * resolve_parent(fs_t * fs, const char * path, char * leaf)
+{
+    char next[MAX_FILENAME];
+    Directory * d = fs->dir;
+    int idx;
+
+    path = next_component(path, leaf);
+    while (path != NULL)
+    {
+        const char * rest = next_component(path, next);
+        if (rest == NULL)
+            return NULL;
+        if (next[0] == '\0')
+            return d;
+
+        // every component but the last has to be a directory
+        idx = dir_lookup(d, leaf);
+        if (idx < 0 || is_file(&d->attributes[idx]))
+            return NULL;
+        d = enter(fs, d, idx);
+        if (d == NULL)
+            return NULL;
+
+        strcpy(leaf, next);
+        path = rest;
+    }
+    return NULL;
+}
+Directory * get_directory(fs_t * fs, int head)
+{
+    Directory * d;
+
+    if (head <= 0 || head >= fs->disk.blocks)
+        return NULL;
+
+    pthread_mutex_lock(&fs->dcache_lock);
+    if ((d = fs->dcache[head]) != NULL)
+    {
+        pthread_mutex_unlock(&fs->dcache_lock);
+        return d;
+    }
+
+    d = calloc(1, sizeof(Directory));
+    if (d != NULL)
+    {
+        d->head = head;
+        if (load_directory(fs, d) < 0)
+        {
+            free_directory(d);
+            d = NULL;
+        }
+        else
+            fs->dcache[head] = d;
+    }
+    pthread_mutex_unlock(&fs->dcache_lock);
+    return d;
+}
+/* enter -- the directory entry idx of d names. It's read-only if d is or
+ * if it's a snapshot */
+static Directory * enter(fs_t * fs, Directory * d, int idx)
+{
+    Directory * child = get_directory(fs, d->attributes[idx].offset);
+
+    if (child != NULL
+            && (d->readonly || d->attributes[idx].type == ATTR_SNAPSHOT))
+        __atomic_store_n(&child->readonly, 1, __ATOMIC_RELAXED);
+    return child;
+}
+/* forget_directory -- drops d from the directory cache and frees it */
+static void forget_directory(fs_t * fs, Directory * d)
+{
+    fs->dcache[d->head] = NULL;
+    pthread_mutex_lock(&fs->alloc_lock);
+    fs->pending_blocks -= d->held;
+    pthread_mutex_unlock(&fs->alloc_lock);
+    free_directory(d);
+}
+/* free_directory -- frees d and everything it holds */
+static void free_directory(Directory * d)
+{
+    for (int i = 0; i < d->capacity; i++)
+        free(d->data[i]);
+    free(d->data);
+    free(d->attributes);
+    free(d->index);
+    free(d->open_counts);
+    free(d);
+}
+int load_root(fs_t * fs)
+{
+    free_directories(fs);
+    fs->dcache = calloc(fs->disk.blocks, sizeof(Directory *));
+    if (fs->dcache == NULL)
+        return -1;
+    fs->dir = get_directory(fs, fs->super->directory_offset);
+    return fs->dir == NULL ? -1 : 0;
+}
+int load_directory(fs_t * fs, Directory * d)
+{
+    int size,
+        block = d->head,
+        stream_size,
+        entry_size = sizeof(Attribute),
+        pos;
+    char * stream,
+         * buf;
+
+    // version 0 images only have a root, with short names. It's rewritten
+    // in the current format at the next flush
+    if (d->head == fs->super->directory_offset && fs->super->version == 0)
+    {
+        entry_size = sizeof(OldAttribute);
+        d->dirty = 1;
+    }
+
+    if ((buf = cache_get(&fs->cache, block, CACHE_READ)) == NULL)
+        return -1;
+    memcpy(&size, buf, sizeof(size));
+    cache_put(&fs->cache, block);
+    if (size < 0 || dir_grow(fs, d, size) < 0)
+        return -1;
+
+    // gather the stream from the whole chain, the entries and then the
+    // bytes of the files kept in the directory: old images end the root's
+    // chain with FAT_RESERVED
+    d->blocks = 1;
+    for (d->tail = block; fs->fat.table[d->tail] > 0; d->blocks++)
+        d->tail = fs->fat.table[d->tail];
+    stream_size = d->blocks * fs->disk.block_size;
+    stream = malloc(stream_size);
+    if (stream == NULL)
+        return -1;
+    for (int i = 0; i < d->blocks; i++, block = fs->fat.table[block])
+    {
+        if ((buf = cache_get(&fs->cache, block, CACHE_READ)) == NULL)
+        {
+            free(stream);
+            return -1;
+        }
+        memcpy(stream + (long) i * fs->disk.block_size, buf,
+                fs->disk.block_size);
+        cache_put(&fs->cache, block);
+    }
+
+    pos = sizeof(size) + size * entry_size;
+    if (pos > stream_size)
+    {
+        printf("load_directory: directory chain is too short\n");
+        free(stream);
+        return -1;
+    }
+
+    d->size = size;
+    for (int i = 0; i < size; i++)
+    {
+        Attribute * attr = &d->attributes[i];
+        char * entry = stream + sizeof(size) + i * entry_size;
+
+        if (entry_size == sizeof(Attribute))
+        {
+            memcpy(attr, entry, sizeof(Attribute));
+            continue;
+        }
+        memset(attr, 0, sizeof(Attribute));
+        memcpy(attr->name, ((OldAttribute *) entry)->name, 16);
+        attr->size = ((OldAttribute *) entry)->size;
+        attr->offset = ((OldAttribute *) entry)->offset;
+        attr->type = ATTR_FILE;
+    }
+
+    // then the bytes of each file without blocks
+    for (int i = 0; i < size; i++)
+    {
+        Attribute * attr = &d->attributes[i];
+
+        if (!is_file(attr) || attr->offset >= 0 || attr->size == 0)
+            continue;
+        if (pos + attr->size > stream_size
+                || (d->data[i] = malloc(attr->size)) == NULL)
+        {
+            printf("load_directory: directory chain is too short\n");
+            free(stream);
+            return -1;
+        }
+        memcpy(d->data[i], stream + pos, attr->size);
+        d->data_bytes += attr->size;
+        pos += attr->size;
+    }
+    free(stream);
+
+    return build_dir_index(d);
+}
+int store_directory(fs_t * fs, Directory * d)
+{
+    int stream_size = sizeof(d->size) + d->size * sizeof(Attribute)
+            + d->data_bytes,
+        needed = (stream_size + fs->disk.block_size - 1) / fs->disk.block_size,
+        block = d->head,
+        pos = 0;
+    char * stream;
+
+    // the blocks held for the chain to grow into are taken now
+    pthread_mutex_lock(&fs->alloc_lock);
+    fs->pending_blocks -= d->held;
+    d->held = 0;
+    pthread_mutex_unlock(&fs->alloc_lock);
+    if (dir_reserve(fs, d, d->size) < 0)
+        return -1;
+
+    stream = malloc(stream_size);
+    if (stream == NULL)
+        return -1;
+    memcpy(stream, &d->size, sizeof(d->size));
+    if (d->size > 0)
+        memcpy(stream + sizeof(d->size), d->attributes, 
+                d->size * sizeof(Attribute));
+    pos = sizeof(d->size) + d->size * sizeof(Attribute);
+    for (int i = 0; i < d->size; i++)
+    {
+        if (d->data[i] == NULL)
+            continue;
+        memcpy(stream + pos, d->data[i], d->attributes[i].size);
+        pos += d->attributes[i].size;
+    }
+    pos = 0;
+
+    for (int i = 0; i < needed; i++)
+    {
+        int len = stream_size - pos < fs->disk.block_size
+            ? stream_size - pos : fs->disk.block_size;
+        char * buf = cache_get(&fs->cache, block, CACHE_OVERWRITE);
+        if (buf == NULL)
+        {
+            free(stream);
+            return -1;
+        }
+        memcpy(buf, stream + pos, len);
+        if (!fs->journal_open)
+            cache_put(&fs->cache, block);
+        else if (journal_add(fs, block, buf) < 0)
+        {
+            cache_put(&fs->cache, block);
+            free(stream);
+            return -1;
+        }
+        pos += len;
+        if (i < needed - 1)
+            block = fs->fat.table[block];
+    }
+    free(stream);
+    d->dirty = 0;
+    return 0;
+}
+int store_directories(fs_t * fs)
+{
+    for (int i = 0; i < fs->disk.blocks; i++)
+    {
+        if (fs->dcache[i] != NULL && fs->dcache[i]->dirty
+                && store_directory(fs, fs->dcache[i]) < 0)
+            return -1;
+    }
+
+    // the root has been rewritten with long names if it wasn't already
+    fs->super->version = FS_VERSION;
+    return 0;
+}
+void free_directories(fs_t * fs)
+{
+    if (fs->dcache == NULL)
+        return;
+    for (int i = 0; i < fs->disk.blocks; i++)
+    {
+        if (fs->dcache[i] != NULL)
+            free_directory(fs->dcache[i]);
+    }
+    free(fs->dcache);
+    fs->dcache = NULL;
+    fs->dir = NULL;
+}
+int dir_grow(fs_t * fs, Directory * d, int capacity)
+{
+    Attribute * attributes;
+    uintptr_t old = (uintptr_t) d->attributes;
+    int * counts;
+    char ** data;
+
+    if (capacity <= d->capacity)
+        return 0;
+    if (capacity < d->capacity * 2)
+        capacity = d->capacity * 2;
+    if (capacity < 16)
+        capacity = 16;
+
+    counts = realloc(d->open_counts, capacity * sizeof(int));
+    if (counts == NULL)
+        return -1;
+    memset(counts + d->capacity, 0, 
+            (capacity - d->capacity) * sizeof(int));
+    d->open_counts = counts;
+
+    data = realloc(d->data, capacity * sizeof(char *));
+    if (data == NULL)
+        return -1;
+    memset(data + d->capacity, 0, (capacity - d->capacity) * sizeof(char *));
+    d->data = data;
+
+    attributes = realloc(d->attributes, capacity * sizeof(Attribute));
+    if (attributes == NULL)
+        return -1;
+
+    // open descriptors point into the old array
+    for (int i = 0; i < fs->descriptor_capacity; i++)
+    {
+        if (fs->descriptors[i].descriptor != DESCRIPTOR_UNUSED
+                && fs->descriptors[i].parent == d)
+            fs->descriptors[i].attr = (Attribute *) ((uintptr_t) attributes
+                + ((uintptr_t) fs->descriptors[i].attr - old));
+    }
+
+    d->attributes = attributes;
+    d->capacity = capacity;
+    return 0;
+}
+int dir_reserve(fs_t * fs, Directory * d, int count)
+{
+    int needed = dir_blocks(fs, d, count);
+
+    if (dir_grow(fs, d, count) < 0)
+        return -1;
+
+    // extend the on-disk chain so the entries will fit at unmount
+    while (d->blocks < needed)
+    {
+        int block = alloc_entry(fs, d->tail);
+        if (block < 0)
+            return -1;
+        d->tail = block;
+        d->blocks++;
+    }
+
+    // rehash once the index gets over half full
+    if (count * 2 > d->index_capacity)
+        return build_dir_index(d);
+    return 0;
+}
+void dir_remove_entry(fs_t * fs, Directory * d, int idx)
+{
+    int last;
+
+    dir_index_remove(d, d->attributes[idx].name);
+    resize_data(fs, d, idx, 0);
+    d->size--;
+    d->dirty = 1;
+    dir_shrink(fs, d);
+    last = d->size;
+    if (last == idx)
+    {
+        return;
+    }
+
+    // the last entry moves into the hole: repoint its index and descriptors
+    d->attributes[idx] = d->attributes[last];
+    d->open_counts[idx] = d->open_counts[last];
+    d->data[idx] = d->data[last];
+    d->data[last] = NULL;
+    dir_index_insert(d, idx);
+    for (int i = 0; d->open_counts[idx] > 0 && i < fs->descriptor_capacity; i++)
+    {
+        if (fs->descriptors[i].descriptor != DESCRIPTOR_UNUSED
+                && fs->descriptors[i].attr == &d->attributes[last])
+            fs->descriptors[i].attr = &d->attributes[idx];
+    }
+}
+void dir_shrink(fs_t * fs, Directory * d)
+{
+    int needed = dir_blocks(fs, d, d->size),
+        block = d->head;
+
+    if (needed >= d->blocks)
+        return;
+
+    // give back the blocks the entries no longer reach into
+    for (int i = 0; i < needed - 1; i++)
+        block = fs->fat.table[block];
+    free_alloc_chain(fs, fs->fat.table[block]);
+    pthread_mutex_lock(&fs->alloc_lock);
+    set_fat_entry(fs, block, FAT_EOF);
+    pthread_mutex_unlock(&fs->alloc_lock);
+    d->blocks = needed;
+    d->tail = block;
+}
+/* dir_blocks -- how long d's chain has to be to store count entries and
+ * the bytes of its files without blocks */
+static int dir_blocks(fs_t * fs, Directory * d, int count)
+{
+    return (sizeof(d->size) + count * sizeof(Attribute) + d->data_bytes
+            + fs->disk.block_size - 1) / fs->disk.block_size;
+}
+unsigned int hash_name(const char * name)
+{
+    /* FNV-1a */
+    unsigned int hash = 2166136261u;
+    for (int i = 0; i < MAX_FILENAME && name[i] != '\0'; i++)
+    {
+        hash ^= (unsigned char) name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+int build_dir_index(Directory * d)
+{
+    int capacity = 16;
+
+    // keep the table at most half full
+    while (capacity < d->size * 2)
+        capacity *= 2;
+
+    free(d->index);
+    d->index = malloc(capacity * sizeof(int));
+    if (d->index == NULL)
+    {
+        printf("build_dir_index: out of memory\n");
+        return -1;
+    }
+    d->index_capacity = capacity;
+
+    for (int i = 0; i < capacity; i++)
+        d->index[i] = DIR_SLOT_EMPTY;
+    for (int i = 0; i < d->size; i++)
+        dir_index_insert(d, i);
+    return 0;
+}
+int dir_lookup(Directory * d, const char * name)
+{
+    unsigned int mask = d->index_capacity - 1,
+                 bucket = hash_name(name) & mask;
+
+    while (d->index[bucket] != DIR_SLOT_EMPTY)
+    {
+        if (strncmp(d->attributes[d->index[bucket]].name, name, 
+                    MAX_FILENAME) == 0)
+            return d->index[bucket];
+        bucket = (bucket + 1) & mask;
+    }
+    return -1;
+}
+void dir_index_insert(Directory * d, int slot)
+{
+    unsigned int mask = d->index_capacity - 1,
+                 bucket = hash_name(d->attributes[slot].name) & mask;
+
+    // a name that's already indexed just gets its slot updated
+    while (d->index[bucket] != DIR_SLOT_EMPTY
+            && strncmp(d->attributes[d->index[bucket]].name, 
+                d->attributes[slot].name, MAX_FILENAME) != 0)
+    {
+        bucket = (bucket + 1) & mask;
+    }
+    d->index[bucket] = slot;
+}
+void dir_index_remove(Directory * d, const char * name)
+{
+    unsigned int mask = d->index_capacity - 1,
+                 bucket = hash_name(name) & mask,
+                 next;
+
+    while (d->index[bucket] != DIR_SLOT_EMPTY
+            && strncmp(d->attributes[d->index[bucket]].name, name, 
+                MAX_FILENAME) != 0)
+    {
+        bucket = (bucket + 1) & mask;
+    }
+    if (d->index[bucket] == DIR_SLOT_EMPTY)
+        return;
+
+    // backward-shift the rest of the probe run so lookups never stop early
+    d->index[bucket] = DIR_SLOT_EMPTY;
+    next = (bucket + 1) & mask;
+    while (d->index[next] != DIR_SLOT_EMPTY)
+    {
+        unsigned int home = 
+            hash_name(d->attributes[d->index[next]].name) & mask;
+        if (((next - home) & mask) >= ((next - bucket) & mask))
+        {
+            d->index[bucket] = d->index[next];
+            d->index[next] = DIR_SLOT_EMPTY;
+            bucket = next;
+        }
+        next = (next + 1) & mask;
+    }
+}
+int get_open_count(Directory * d, int slot)
+{
+    if (slot < 0 || slot >= d->size)
+        return -1;
+    return d->open_counts[slot];
+}
+int alloc_descriptor(fs_t * fs)
+{
+    int idx;
+
+    // no free slots left: double the table and chain up the new ones
+    if (fs->descriptor_size == fs->descriptor_capacity)
+    {
+        int capacity = fs->descriptor_capacity
+            ? fs->descriptor_capacity * 2 : 32;
+        Descriptor * table = realloc(fs->descriptors,
+                capacity * sizeof(Descriptor));
+        if (table == NULL)
+            return -1;
+
+        for (int i = fs->descriptor_capacity; i < capacity; i++)
+        {
+            table[i].descriptor = DESCRIPTOR_UNUSED;
+            table[i].next_free = i + 1 < capacity ? i + 1 : -1;
+        }
+        fs->descriptors = table;
+        fs->descriptor_free = fs->descriptor_capacity;
+        fs->descriptor_capacity = capacity;
+    }
+
+    idx = fs->descriptor_free;
+    fs->descriptor_free = fs->descriptors[idx].next_free;
+    return idx;
+}
+void free_descriptors(fs_t * fs)
+{
+    for (int i = 0; i < fs->descriptor_capacity; i++)
+    {
+        if (fs->descriptors[i].descriptor != DESCRIPTOR_UNUSED)
+        {
+            free(fs->descriptors[i].index);
+            free(fs->descriptors[i].wbuf);
+            free(fs->descriptors[i].zbuf);
+        }
+    }
+    free(fs->descriptors);
+    fs->descriptors = NULL;
+    fs->descriptor_size = fs->descriptor_capacity = 0;
+    fs->descriptor_free = -1;
+}
+int get_fildes_index(fs_t * fs, int fildes)
+{
+    if (fildes < 0 || fildes >= fs->descriptor_capacity)
+        return -1;
+    if (fs->descriptors[fildes].descriptor != fildes)
+        return -1;
+    return fildes;
+}
+int get_file_blocksize(fs_t * fs, int fildes)
+{
+    int idx = get_fildes_index(fs, fildes);
+
+    if (idx < 0)
+        return -1;
+
+    return (fs->descriptors[idx].attr->size + fs->disk.block_size - 1)
+        / fs->disk.block_size;
+}
+int get_extent_count(fs_t * fs, int fildes)
+{
+    int block_idx,
+        extents = 1,
+        idx = get_fildes_index(fs, fildes);
+
+    if (idx < 0)
+        return -1;
+
+    block_idx = fs->descriptors[idx].attr->offset;
+    if (block_idx < 0)
+        return 0;
+    // a chain longer than the disk loops
+    for (int steps = 0; fs->fat.table[block_idx] != FAT_EOF; steps++)
+    {
+        if (fs->fat.table[block_idx] <= 0 || steps == fs->disk.blocks)
+            return -1;
+        if (fs->fat.table[block_idx] != block_idx + 1)
+            extents++;
+        block_idx = fs->fat.table[block_idx];
+    }
+    return extents;
+}
+int get_eof_block_idx(fs_t * fs, int fildes)
+{
+    int block_idx,
+        idx = get_fildes_index(fs, fildes);
+
+    if (idx < 0)
+        return -1;
+
+    block_idx = fs->descriptors[idx].attr->offset;
+    if (block_idx < 0)
+        return -1;
+    STAT_ADD(fs->stats.chain_walks, 1);
+    for (int steps = 0; fs->fat.table[block_idx] != FAT_EOF; steps++)
+    {
+        if (fs->fat.table[block_idx] <= 0 || steps == fs->disk.blocks)
+            return -1;
+        block_idx = fs->fat.table[block_idx];
+        STAT_ADD(fs->stats.chain_steps, 1);
     }
     return block_idx;
 }
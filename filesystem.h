@@ -2,90 +2,397 @@
 #define _FILESYSTEM_H_
 
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include "disk.h"
 
-#define MAX_FILES 64
-#define MAX_FILENAME 16
+#define MAX_FILENAME 64     /* per path component, including the '\0' */
+
+#define FS_VERSION 2        /* on-disk format, see Superblock */
+
+#define ATTR_FILE 0
+#define ATTR_DIR 1
+#define ATTR_SNAPSHOT 2     /* read-only directory made by fs_snapshot */
+#define ATTR_COMPRESSED 3   /* file stored compressed, see fs_set_compression */
 
 #define FAT_UNUSED 0
 #define FAT_EOF -1
 #define FAT_RESERVED -2 
 
+/* block allocation policies, see fs_set_alloc_mode() */
+#define ALLOC_FIRST_FIT 0   /* lowest free block, one at a time */
+#define ALLOC_EXTENT 1      /* grow files contiguously, reserving runs */
+
 /*
  * Superblock -- superblock, first in line
  * All offsets are in blocks
  * alloc_table_offset: offset where allocation table starts
  * directory_offset: offset where root directory struct is stored
  * data_block_offset: offset where data block begins
+ * version: on-disk format. 0 is a flat root with 16 byte names, 1 adds
+ *          subdirectories and MAX_FILENAME names, 2 keeps small files in
+ *          their directory
+ * block_size, block_count: geometry of the disk. 0 on images made before
+ *          it was configurable, which all have the default geometry
+ * journal_offset, journal_blocks: the metadata journal, at the end of the
+ *          disk. 0 blocks on images made before it and on disks too small
+ *          to spare the room, whose metadata is written in place
+ * refs_offset: the block reference counts, right after the FAT and the
+ *          same size. 0 on images made before them, which can't share
+ *          blocks between files
+ * holes_offset: the hole counts, right after the reference counts and the
+ *          same size. 0 on images made before them, whose files can't
+ *          have holes
+ * sums_offset: the block checksums, right after the hole counts and the
+ *          same size. 0 on images made before them, which aren't checked
+ * mounted: set from fs_mount to fs_umount, so a mount finds out the last
+ *          one ended in a crash
  */
 typedef struct {
     int fat_offset;
     int directory_offset;
     int data_block_offset;
+    int version;
+    int block_size;
+    int block_count;
+    int journal_offset;
+    int journal_blocks;
+    int refs_offset;
+    int holes_offset;
+    int sums_offset;
+    int mounted;
 } Superblock;
 
 
+/* FAT -- one entry per block on the disk. The table is sized when the disk
+ * is mounted
+ * refs: refs[i] is how many references block i has beyond the first, from
+ *       file entries and from blocks linking to it. A file shares every
+ *       block from the first one with refs above 0 to its end, since their
+ *       FAT entries are shared too. NULL on images without the table, and
+ *       otherwise right after 'table' in the same buffer
+ * holes: holes[i] is how many blocks of the file's bytes are missing
+ *        between block i and the next one in its chain, which read as
+ *        zeros and take no space. The bytes between a file's last block
+ *        and its size are missing too. NULL on images without the table,
+ *        and otherwise right after 'refs'
+ * sums: sums[i] is the checksum of what was last written to block i, 0 if
+ *       it has none, which the superblock, the journal and the checksums'
+ *       own blocks never do. NULL on images without the table, and
+ *       otherwise right after 'holes'
+ */
 typedef struct {
-    int table[DISK_BLOCKS];
+    int * table;
+    int * refs;
+    int * holes;
+    uint32_t * sums;
 } FAT;
 
 
 /* Attribute -- an entry for 'Directory' struct mimicking the FAT filesystem
  * name: name of file
- * size: size of file in BYTES
- * offset: block offset where file's head block starts
+ * size: size of file in BYTES, 0 for directories
+ * offset: block offset where file's head block starts. FAT_EOF for a file
+ *         that has no blocks yet, whose bytes are in Directory.data
+ * type: ATTR_FILE, ATTR_DIR, ATTR_SNAPSHOT or ATTR_COMPRESSED
  */
 typedef struct {
     char name[MAX_FILENAME];
     int size;
     int offset;
+    int type;
 } Attribute;
 
 
-/* Directory -- represents the root dir
+/* Directory -- a directory, kept in memory once it's been looked at
+ * On disk it's stored like a file: a FAT chain holding 'size' followed by
+ * the packed attributes, then the bytes of each file without blocks in
+ * entry order. The root's chain starts at the superblock's
+ * directory_offset, every other one at its entry's offset in the parent
  * size: how many files are present
  * capacity: capacity of directory
  * attributes: each file entry, represented as an Attribute struct
+ * head, tail, blocks: first and last block of the on-disk chain, and its
+ *                     length
+ * index: hash table from name to slot in attributes, index_capacity buckets
+ * open_counts: open_counts[i] is how many descriptors are open on
+ *              attributes[i]
+ * data: data[i] is the bytes of attributes[i] if it's a file without
+ *       blocks, NULL if it has blocks or is empty
+ * data_bytes: how many bytes data holds in all
+ * held: blocks counted in pending_blocks for the chain to grow into as
+ *       data_bytes grows, until the directory is next written out
+ * dirty: entries changed since the directory was last written out
+ * readonly: the directory is in a snapshot. Not stored, it's set when the
+ *           directory is reached through the snapshot's entry
  */
 typedef struct {
     int size;
-    Attribute attributes[MAX_FILES];
+    int capacity;
+    Attribute * attributes;
+    int head;
+    int tail;
+    int blocks;
+    int * index;
+    int index_capacity;
+    int * open_counts;
+    char ** data;
+    int data_bytes;
+    int held;
+    int dirty;
+    int readonly;
 } Directory;
 
+
+/* fs_t -- a mounted filesystem, from fs_mount until fs_umount. Every call
+ * takes the mount it works on, and each mount has its own cache and
+ * descriptor table, so one process can serve any number of images */
+typedef struct fs fs_t;
+
+
+/* fs_io_t -- one request for fs_submit: nbyte bytes between buf and the
+ * open file fildes, starting at byte offset rather than at the descriptor's
+ * offset, which is left alone. A read stops at EOF; a write may start
+ * wherever fs_lseek could move to. result is what fs_read or fs_write
+ * would have returned, set once fs_reap hands the request back
+ * data: the caller's, left alone
+ */
+typedef struct fs_io {
+    int fildes;
+    int write;
+    void * buf;
+    size_t nbyte;
+    off_t offset;
+    int result;
+    void * data;
+    struct fs_io * next;
+} fs_io_t;
+
+
+/* fs_stats_t -- what a mount has done since fs_mount or fs_stats_reset
+ * ops[FS_OP_*]: one per kind of call. calls, errors (calls returning -1),
+ *               bytes read or written, and time spent: total_ns, max_ns and
+ *               hist[i], the calls that took from 2^i up to 2^(i+1) ns. The
+ *               last bucket also counts everything slower
+ * disk_*: the Disk counters, i.e. calls into the OS, blocks they moved and
+ *         syncs
+ * bytes_copied: between callers' buffers and the cache or write buffers
+ * cache_hits, cache_misses: block lookups in the cache
+ * chain_walks, chain_steps: walks along a FAT chain to find the block at
+ *                           an offset, and the entries they followed
+ * alloc_scans, alloc_steps: searches for free blocks, and the bitmap words
+ *                           or blocks they looked at
+ * commits, commit_blocks: journal commits and the blocks they logged
+ * cow_blocks: shared blocks copied because a file sharing them changed
+ * clusters_packed, clusters_raw: clusters of compressed files written back
+ *                                packed, and those stored as they were
+ *                                because packing saved no block
+ * checksum_errors: blocks read from the disk that failed their checksum
+ * scrub_blocks: blocks the scrubber read and checked
+ */
+#define FS_OP_OPEN 0
+#define FS_OP_CLOSE 1
+#define FS_OP_CREATE 2
+#define FS_OP_DELETE 3
+#define FS_OP_MKDIR 4
+#define FS_OP_RMDIR 5
+#define FS_OP_READDIR 6
+#define FS_OP_READ 7        /* fs_read and fs_readv */
+#define FS_OP_WRITE 8       /* fs_write and fs_writev */
+#define FS_OP_LSEEK 9
+#define FS_OP_TRUNCATE 10
+#define FS_OP_FALLOCATE 11
+#define FS_OP_SYNC 12       /* fs_sync and fs_fsync */
+#define FS_OP_CLONE 13
+#define FS_OP_SNAPSHOT 14
+#define FS_OPS 15
+
+#define FS_STAT_BUCKETS 32
+
+typedef struct {
+    uint64_t calls;
+    uint64_t errors;
+    uint64_t bytes;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t hist[FS_STAT_BUCKETS];
+} fs_op_stats_t;
+
 typedef struct {
-    Superblock superblock;
-    FAT fat;
-    Directory directory;
-} Disk;
+    fs_op_stats_t ops[FS_OPS];
+    uint64_t disk_syscalls;
+    uint64_t disk_blocks_read;
+    uint64_t disk_blocks_written;
+    uint64_t disk_syncs;
+    uint64_t bytes_copied;
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    uint64_t chain_walks;
+    uint64_t chain_steps;
+    uint64_t alloc_scans;
+    uint64_t alloc_steps;
+    uint64_t commits;
+    uint64_t commit_blocks;
+    uint64_t cow_blocks;
+    uint64_t clusters_packed;
+    uint64_t clusters_raw;
+    uint64_t checksum_errors;
+    uint64_t scrub_blocks;
+} fs_stats_t;
 
 
 /* filesystem api unctions */
+/* the fs_ calls may be made from several threads at once, as long as each
+ * descriptor is used by one thread at a time. Calls on different files or
+ * different mounts run in parallel; fs_umount and fs_set_alloc_mode must
+ * not overlap with anything else on the same mount */
 
 int make_fs(char * disk_name);
-int mount_fs(char * disk_name);
-int umount_fs(char * disk_name);
-
-int fs_open(char * name);
-int fs_close(int fildes);
-int fs_create(char * name);
-int fs_delete(char * name);
-int fs_read(int fildes, void * buf, size_t nbyte);
-int fs_write(int fildes, void * buf, size_t nbyte);
-int fs_get_filesize(int fildes);
-int fs_lseek(int fildes, off_t offset);
-int fs_truncate(int fildes, off_t length);
+int make_fs_geometry(char * disk_name, int blocks, int size);
+fs_t * fs_mount(char * disk_name);
+fs_t * fs_mount_mode(char * disk_name, int mode);
+int fs_umount(fs_t * fs);
+int fs_sync(fs_t * fs);
+int fs_fsync(fs_t * fs, int fildes);
+
+int fs_open(fs_t * fs, char * name);
+int fs_close(fs_t * fs, int fildes);
+int fs_create(fs_t * fs, char * name);
+int fs_delete(fs_t * fs, char * name);
+int fs_mkdir(fs_t * fs, char * name);
+int fs_rmdir(fs_t * fs, char * name);
+int fs_readdir(fs_t * fs, char * name, int pos, Attribute * entry);
+int fs_read(fs_t * fs, int fildes, void * buf, size_t nbyte);
+int fs_write(fs_t * fs, int fildes, void * buf, size_t nbyte);
+int fs_readv(fs_t * fs, int fildes, const struct iovec * iov, int iovcnt);
+int fs_writev(fs_t * fs, int fildes, const struct iovec * iov, int iovcnt);
+int fs_get_filesize(fs_t * fs, int fildes);
+int fs_lseek(fs_t * fs, int fildes, off_t offset);
+int fs_truncate(fs_t * fs, int fildes, off_t length);
+int fs_fallocate(fs_t * fs, int fildes, off_t length);
+int fs_set_block_index(fs_t * fs, int fildes, int enable);
+int fs_set_alloc_mode(fs_t * fs, int mode);
+int fs_block_size(fs_t * fs);
+
+/* copy-on-write. fs_clone makes a new file dst holding what src does, and
+ * fs_snapshot a directory 'name' holding what the whole tree does, other
+ * snapshots left out. Neither copies any data: the files share blocks with
+ * the ones they came from until either side writes, truncates or grows,
+ * when the blocks from the start of the file through the one changed are
+ * copied for it. Files in a snapshot can be read but not changed; fs_rmdir
+ * on the snapshot drops it whole. Both fail on images made before blocks
+ * could be shared */
+int fs_clone(fs_t * fs, char * src, char * dst);
+int fs_snapshot(fs_t * fs, char * name);
+
+/* sparse files. Seeking past EOF and writing there, or truncating a file to
+ * a larger size, leaves a hole, which reads as zeros and takes no blocks
+ * until something is written into it. A file's first block is never part
+ * of one. fs_lseek_data moves the descriptor to the first byte at or after
+ * offset that is data (FS_SEEK_DATA) or in a hole (FS_SEEK_HOLE), EOF
+ * counting as a hole, and returns where that is: -1 if offset is at or
+ * past EOF, or there is no data after it. On images made before holes,
+ * fs_lseek stops at EOF and fs_truncate grows a file like fs_fallocate */
+#define FS_SEEK_DATA 0
+#define FS_SEEK_HOLE 1
+
+int fs_lseek_data(fs_t * fs, int fildes, off_t offset, int whence);
+
+/* compression. fs_set_compression on a file that has no blocks yet makes it
+ * store its bytes compressed from then on, or not if enable is 0. Its data
+ * is cut into clusters of 64 KiB, each kept in as few blocks as the LZ
+ * codec in lz.c packs it into, or as it is when that wouldn't save a
+ * block. Writes collect in the cluster they fall in and are packed when
+ * the descriptor moves on to another one, and wherever buffered appends
+ * would be written out; reads unpack a cluster at a time. Its type is
+ * ATTR_COMPRESSED, and so is that of its clones and snapshots. fs_lseek_data
+ * sees a cluster as all data or all hole, and fs_fallocate only grows it.
+ * Fails on images made before holes */
+int fs_set_compression(fs_t * fs, int fildes, int enable);
+
+/* checksums. Every block but the superblock, the journal and the checksums
+ * themselves carries a CRC32C of what was last written to it. A block read
+ * in that doesn't match fails the read; the FAT and its counts are checked
+ * by fs_mount, which fails if they don't match. fs_set_checksums 0 stops
+ * checking and keeping them for the rest of the mount and forgets them, 1
+ * starts again, each block getting its checksum back as it is written or
+ * scrubbed. fs_scrub starts a thread that reads every block in use that
+ * isn't cached, 'rate' a second, and checks it; rate 0 stops it. They are
+ * committed with the blocks they cover, so a crash leaves those of the last
+ * commit: a block written over after it fails its check. A mount through
+ * DISK_MMAP, whose writes go around the cache, forgets them, as does one
+ * after a crash part way through a commit too big to log at once. Fail on
+ * images made before checksums */
+int fs_set_checksums(fs_t * fs, int enable);
+int fs_scrub(fs_t * fs, int rate);
+
+/* asynchronous reads and writes. Requests and their buffers belong to the
+ * mount from fs_submit until fs_reap returns them; their descriptors must
+ * stay open and not be used for anything else meanwhile. fs_reap waits
+ * for at least min requests, so min 0 just polls */
+int fs_submit(fs_t * fs, fs_io_t ** ios, int n);
+int fs_reap(fs_t * fs, fs_io_t ** done, int min, int max);
+
+/* counters and latency histograms, kept all the time. fs_stats copies them
+ * out; fs_stats_dump writes them as one JSON object, along with each kind
+ * of call's p50 and p99 and the cache hit rate. fs_stats_percentile is the
+ * time within which a fraction p of op's calls finished, rounded up to the
+ * histogram's resolution */
+int fs_stats(fs_t * fs, fs_stats_t * stats);
+void fs_stats_reset(fs_t * fs);
+int fs_stats_dump(fs_t * fs, FILE * out);
+uint64_t fs_stats_percentile(const fs_op_stats_t * op, double p);
 
 /* helpers */
-void print_disk_struct();
-int write_blocks(char * buf, int block_offset, int block_count);
-int read_blocks(char * buf, int block_offset, int block_count);
-void init_virt_disk();
-int free_alloc_chain(int head);
-int find_avail_alloc_entry();
-int get_fildes_index(int fildes);
-int get_file_blocksize(int fildes);
-int get_eof_block_idx(int fildes);
+void print_disk_struct(fs_t * fs);
+int write_blocks(fs_t * fs, char * buf, int block_offset, int block_count);
+int read_blocks(fs_t * fs, char * buf, int block_offset, int block_count);
+int init_virt_disk(fs_t * fs);
+void free_virt_disk(fs_t * fs);
+int flush_metadata(fs_t * fs);
+int free_alloc_chain(fs_t * fs, int head);
+int find_avail_alloc_entry(fs_t * fs);
+int alloc_entry(fs_t * fs, int prev);
+int reserve_ahead(fs_t * fs, int tail, int length);
+void set_fat_entry(fs_t * fs, int fat_idx, int value);
+void build_freemap(fs_t * fs);
+int get_free_blocks(fs_t * fs);
+int find_free_run(fs_t * fs, int goal, int length);
+int block_taken(fs_t * fs, int fat_idx);
+int block_reserved(fs_t * fs, int fat_idx);
+int owns_reservation(fs_t * fs, int tail);
+int reserve_run(fs_t * fs, int start, int length);
+void consume_reservation(fs_t * fs, int fat_idx);
+void release_reservation(fs_t * fs, int tail);
+void drop_reservations(fs_t * fs);
+void set_refs(fs_t * fs, int fat_idx, int value);
+void set_holes(fs_t * fs, int fat_idx, int value);
+int create_entry(fs_t * fs, char * name, int type);
+Directory * resolve_parent(fs_t * fs, const char * path, char * leaf);
+Directory * get_directory(fs_t * fs, int head);
+int load_root(fs_t * fs);
+int load_directory(fs_t * fs, Directory * d);
+int store_directory(fs_t * fs, Directory * d);
+int store_directories(fs_t * fs);
+void free_directories(fs_t * fs);
+int dir_grow(fs_t * fs, Directory * d, int capacity);
+int dir_reserve(fs_t * fs, Directory * d, int count);
+void dir_remove_entry(fs_t * fs, Directory * d, int idx);
+void dir_shrink(fs_t * fs, Directory * d);
+unsigned int hash_name(const char * name);
+int build_dir_index(Directory * d);
+int dir_lookup(Directory * d, const char * name);
+void dir_index_insert(Directory * d, int slot);
+void dir_index_remove(Directory * d, const char * name);
+int get_open_count(Directory * d, int slot);
+int alloc_descriptor(fs_t * fs);
+void free_descriptors(fs_t * fs);
+int get_fildes_index(fs_t * fs, int fildes);
+int get_file_blocksize(fs_t * fs, int fildes);
+int get_extent_count(fs_t * fs, int fildes);
+int get_eof_block_idx(fs_t * fs, int fildes);
 
 #endif
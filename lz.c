@@ -0,0 +1,172 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+/******************************************************************************/
+/* the compressor finds matches through a table from a hash of the 4 bytes
+ * at a position to the last position they were seen at. The block format
+ * wants the last LAST_LITERALS bytes left as literals and no match starting
+ * in the last MATCH_LIMIT, so a decoder may copy in whole words near the
+ * end. Misses in a row skip further and further ahead, which is what keeps
+ * incompressible data cheap                                                  */
+#define HASH_BITS 12
+#define LAST_LITERALS 5
+#define MATCH_LIMIT 12
+#define SKIP_SHIFT 6
+
+static uint32_t load32(const unsigned char *p)
+{
+  uint32_t v;
+
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint64_t load64(const unsigned char *p)
+{
+  uint64_t v;
+
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static unsigned hash4(const unsigned char *p)
+{
+  return (load32(p) * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/* put_length -- the 255-byte extension of a length that didn't fit its
+ * nibble                                                                     */
+static unsigned char *put_length(unsigned char *op, int len)
+{
+  for (; len >= 255; len -= 255)
+    *op++ = 255;
+  *op++ = len;
+  return op;
+}
+
+/* emit -- one sequence: nlit literals, then a match of mlen bytes 'offset'
+ * back, or no match at all if mlen is 0. -1 if it may not fit before end     */
+static int emit(unsigned char **op, unsigned char *end,
+                const unsigned char *lit, int nlit, int offset, int mlen)
+{
+  unsigned char *o = *op, *token;
+
+  if (end - o < 1 + nlit + nlit / 255 + 1 + 2 + mlen / 255 + 1)
+    return -1;
+  token = o++;
+  *token = (nlit < 15 ? nlit : 15) << 4;
+  if (nlit >= 15)
+    o = put_length(o, nlit - 15);
+  memcpy(o, lit, nlit);
+  o += nlit;
+
+  if (mlen > 0) {
+    *o++ = offset & 0xff;
+    *o++ = offset >> 8;
+    mlen -= LZ_MIN_MATCH;
+    *token |= mlen < 15 ? mlen : 15;
+    if (mlen >= 15)
+      o = put_length(o, mlen - 15);
+  }
+  *op = o;
+  return 0;
+}
+
+/******************************************************************************/
+int lz_compress(const char *src, int n, char *dst, int cap)
+{
+  const unsigned char *in = (const unsigned char *)src;
+  unsigned char *op = (unsigned char *)dst, *end = op + cap;
+  int table[1 << HASH_BITS];
+  int anchor = 0, pos = 0, limit = n - MATCH_LIMIT, last = n - LAST_LITERALS,
+      misses = 0;
+
+  memset(table, 0xff, sizeof(table));
+  while (pos < limit) {
+    unsigned h = hash4(in + pos);
+    int ref = table[h], len = LZ_MIN_MATCH;
+
+    table[h] = pos;
+    if (ref < 0 || pos - ref > LZ_MAX_OFFSET
+        || load32(in + ref) != load32(in + pos)) {
+      pos += 1 + (misses++ >> SKIP_SHIFT);
+      // the literals alone won't fit any more
+      if ((op - (unsigned char *)dst) + (pos - anchor) > cap)
+        return -1;
+      continue;
+    }
+
+    while (pos + len + 8 <= last && load64(in + ref + len)
+           == load64(in + pos + len))
+      len += 8;
+    while (pos + len < last && in[ref + len] == in[pos + len])
+      len++;
+    if (emit(&op, end, in + anchor, pos - anchor, pos - ref, len) < 0)
+      return -1;
+    pos += len;
+    anchor = pos;
+    misses = 0;
+  }
+
+  if (emit(&op, end, in + anchor, n - anchor, 0, 0) < 0)
+    return -1;
+  return op - (unsigned char *)dst;
+}
+
+int lz_decompress(const char *src, int n, char *dst, int cap)
+{
+  const unsigned char *ip = (const unsigned char *)src, *iend = ip + n;
+  unsigned char *op = (unsigned char *)dst, *oend = op + cap, *match;
+  int token, len, offset, b;
+
+  while (ip < iend) {
+    token = *ip++;
+    len = token >> 4;
+    if (len == 15) {
+      do {
+        if (ip >= iend)
+          return -1;
+        len += b = *ip++;
+      } while (b == 255);
+    }
+    if (len > iend - ip || len > oend - op)
+      return -1;
+    memcpy(op, ip, len);
+    op += len;
+    ip += len;
+
+    // the last sequence is literals only
+    if (ip == iend)
+      break;
+    if (iend - ip < 2)
+      return -1;
+    offset = ip[0] | ip[1] << 8;
+    ip += 2;
+    if (offset == 0 || offset > op - (unsigned char *)dst)
+      return -1;
+
+    len = (token & 15) + LZ_MIN_MATCH;
+    if ((token & 15) == 15) {
+      do {
+        if (ip >= iend)
+          return -1;
+        len += b = *ip++;
+      } while (b == 255);
+    }
+    if (len > oend - op)
+      return -1;
+
+    // a match may overlap what it writes, so copy it a period at a time,
+    // the period doubling as the copied part grows
+    match = op - offset;
+    while (len > 0) {
+      int chunk = op - match < len ? op - match : len;
+      memcpy(op, match, chunk);
+      op += chunk;
+      len -= chunk;
+    }
+  }
+  return op - (unsigned char *)dst;
+}
@@ -0,0 +1,23 @@
+#ifndef _LZ_H_
+#define _LZ_H_
+
+/******************************************************************************/
+/* LZ77 in the LZ4 block format: a token byte holding a literal run length
+ * and a match length, each extended by bytes of 255 while they don't fit,
+ * the literals, then a 2 byte little-endian offset back to the match.
+ * Fast rather than tight: one hash probe per position, no entropy coding     */
+#define LZ_MIN_MATCH 4         /* shortest match worth encoding               */
+#define LZ_MAX_OFFSET 65535    /* furthest back a match can start             */
+
+/******************************************************************************/
+int lz_compress(const char *src, int n, char *dst, int cap);
+                               /* compress n bytes of src into dst; returns
+                                  the compressed length, or -1 as soon as it
+                                  would take more than cap bytes              */
+int lz_decompress(const char *src, int n, char *dst, int cap);
+                               /* expand n compressed bytes into dst; returns
+                                  the expanded length, or -1 if src is
+                                  damaged or expands past cap bytes           */
+/******************************************************************************/
+
+#endif
@@ -7,6 +7,7 @@
 
 static const int DISKNAME_LEN = 100;
 static const char * DISK_DIR = "./disks/";
+static const int DEMO_FILES = 64;
 
 int get_diskname(char * name);
 int list_disks();
@@ -16,10 +17,11 @@ int main()
     char buf[DISKNAME_LEN - strlen(DISK_DIR)];
     char diskname[DISKNAME_LEN];
     int create = 0;
-    
+    fs_t * fs;
+
     create = get_diskname(buf);
     strcpy(diskname, DISK_DIR);
-    strncat(diskname, buf, DISKNAME_LEN);
+    strncat(diskname, buf, DISKNAME_LEN - strlen(diskname) - 1);
 
     if (create)
     {
@@ -27,37 +29,37 @@ int main()
             return 1;
     }
 
-    if (mount_fs(diskname) < 0)
+    if ((fs = fs_mount(diskname)) == NULL)
         return 1;
 
     // test it out real quick
-    fs_create("example");
-    int d = fs_open("example");
+    fs_create(fs, "example");
+    int d = fs_open(fs, "example");
     char buffer[13] = "what is this";
     char target[13];
     printf("\nwriting 'what is this'\n");
-    int bytes = fs_write(d, buffer, 13);
-    fs_lseek(d, 0);
+    int bytes = fs_write(fs, d, buffer, 13);
+    fs_lseek(fs, d, 0);
     printf("%d bytes written\n", bytes);
-    print_disk_struct();
+    print_disk_struct(fs);
 
     printf("\nreading 'example' file\n");
-    bytes = fs_read(d, target, 13);
-    fs_lseek(d, 0);
+    bytes = fs_read(fs, d, target, 13);
+    fs_lseek(fs, d, 0);
     printf("%d bytes read\n", bytes);
-    print_disk_struct();
+    print_disk_struct(fs);
 
     printf("\ntruncating 'example' to 10 bytes\n");
-    fs_truncate(0, 10);
-    print_disk_struct();
+    fs_truncate(fs, 0, 10);
+    print_disk_struct(fs);
 
     printf("\nreading truncated 'example' file\n");
     memset(target, 0, 13);
-    bytes = fs_read(d, target, 13);
-    fs_lseek(d, 0);
+    bytes = fs_read(fs, d, target, 13);
+    fs_lseek(fs, d, 0);
     printf("result should be '%.10s': |%s|\n", buffer, target);
     printf("%d bytes read\n", bytes);
-    print_disk_struct();
+    print_disk_struct(fs);
 
     char chonk[9000];
     for (int i = 0; i < 8999; i++)
@@ -66,86 +68,89 @@ int main()
     }
     chonk[8999] = '\0';
     printf("\nwriting a really long file\n");
-    bytes = fs_write(d, chonk, 9000);
-    fs_lseek(d, 0);
+    bytes = fs_write(fs, d, chonk, 9000);
+    fs_lseek(fs, d, 0);
     printf("%d bytes written\n", bytes);
-    print_disk_struct();
+    print_disk_struct(fs);
 
     printf("\nreading really long file\n");
     memset(target, 0, 13);
-    bytes = fs_read(d, target, 12);
-    fs_lseek(d, 0);
+    bytes = fs_read(fs, d, target, 12);
+    fs_lseek(fs, d, 0);
     printf("%d bytes read\n", bytes);
     printf("result should be '%.12s': |%s|\n", chonk, target);
-    print_disk_struct();
+    print_disk_struct(fs);
 
     printf("\nreading the whole chonk\n");
     char chonkt[9000];
     memset(chonkt, 0, 9000);
-    bytes = fs_read(d, chonkt, 8999);
-    fs_lseek(d, 0);
+    bytes = fs_read(fs, d, chonkt, 8999);
+    fs_lseek(fs, d, 0);
     printf("%d bytes read\n", bytes);
     printf("result should be '%s'", chonk);
     printf(", and it was this|%s|\n", chonkt);
-    print_disk_struct();
+    print_disk_struct(fs);
 
     printf("\ntruncating that large file\n");
-    fs_truncate(d, 10);
+    fs_truncate(fs, d, 10);
     memset(target, 0, 13);
-    bytes = fs_read(d, target, 12);
-    fs_lseek(d, 0);
+    bytes = fs_read(fs, d, target, 12);
+    fs_lseek(fs, d, 0);
     printf("result should be '%.10s': |%s|\n", chonk, target);
     printf("%d bytes read\n", bytes);
-    print_disk_struct();
+    print_disk_struct(fs);
 
     printf("\ndeleting file\n");
-    fs_close(d);
-    fs_delete("example");
-    print_disk_struct();
+    fs_close(fs, d);
+    fs_delete(fs, "example");
+    print_disk_struct(fs);
 
-    printf("\ncreating max number of files\n");
+    printf("\ncreating %d files\n", DEMO_FILES);
     char name[2] = { 'a' };
-    for (int i = 0; i < MAX_FILES; i++)
+    for (int i = 0; i < DEMO_FILES; i++)
     {
         printf("creating file '%s'\n", name);
-        fs_create(name);
+        fs_create(fs, name);
         name[0]++;
     }
-    print_disk_struct();
+    print_disk_struct(fs);
 
     printf("\ndeleting all those files\n");
     name[0] = 'a';
-    for (int i = 0; i < MAX_FILES; i++)
+    for (int i = 0; i < DEMO_FILES; i++)
     {
         printf("deleting file '%s'\n", name);
-        fs_delete(name);
+        fs_delete(fs, name);
         name[0]++;
     }
-    print_disk_struct();
+    print_disk_struct(fs);
 
     printf("\ncreating & writing a file with max possible size (4096x4096)\n");
-    char bigbuf[BLOCK_SIZE];
-    memset(bigbuf, 'x', BLOCK_SIZE);
-    fs_create("big file");
-    int big_file_fildes = fs_open("big file");
-    for (int i = 0; i < BLOCK_SIZE; i++)
-        fs_write(big_file_fildes, bigbuf, BLOCK_SIZE);
-    print_disk_struct();
+    char bigbuf[fs_block_size(fs)];
+    memset(bigbuf, 'x', fs_block_size(fs));
+    fs_create(fs, "big file");
+    int big_file_fildes = fs_open(fs, "big file");
+    for (int i = 0; i < fs_block_size(fs); i++)
+        fs_write(fs, big_file_fildes, bigbuf, fs_block_size(fs));
+    fs_fsync(fs, big_file_fildes);
+    printf("big file is stored in %d extent(s)\n", 
+            get_extent_count(fs, big_file_fildes));
+    print_disk_struct(fs);
 
     printf("\nreading first 100 chars of that giant file\n");
-    fs_lseek(big_file_fildes, 0);
+    fs_lseek(fs, big_file_fildes, 0);
     char bigtarget[101];
     memset(bigtarget, 0, 101);
-    fs_read(big_file_fildes, bigtarget, 100);
+    fs_read(fs, big_file_fildes, bigtarget, 100);
     printf("result: %s\n", bigtarget);
 
     printf("\ndeleting that giant file\n");
-    fs_close(big_file_fildes);
-    fs_delete("big file");
-    print_disk_struct();
+    fs_close(fs, big_file_fildes);
+    fs_delete(fs, "big file");
+    print_disk_struct(fs);
 
 
-    if (umount_fs(diskname) < 0)
+    if (fs_umount(fs) < 0)
         return 1;
 
     return 0;
@@ -170,7 +175,7 @@ int get_diskname(char * name)
     }
 
     fgets(name, DISKNAME_LEN - strlen(DISK_DIR), stdin);
-    
+
     strtok(name, "\n");
     if (name[0] == '\n')
     {
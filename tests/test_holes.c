@@ -0,0 +1,185 @@
+/* test_holes -- writes into the hole at the end of a file while another
+ * descriptor is parked in it, or with only scattered blocks left to fill
+ * it with, checked against what reads back after a remount. Prints what
+ * differs and exits 1 if anything does
+ *   $ make test
+ *   $ ./test_holes /tmp/test.disk
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "filesystem.h"
+
+#define MAX_SIZE (64 << 10)
+#define SMALL_DISK 512
+
+static char * diskname;
+static fs_t * fs;
+static char want[MAX_SIZE];     /* what the file under test should hold */
+static int want_size;
+
+/* begin -- creates and opens 'name', which should end up empty */
+static int begin(char * name)
+{
+    memset(want, 0, sizeof(want));
+    want_size = 0;
+    if (fs_create(fs, name) < 0)
+        return -1;
+    return fs_open(fs, name);
+}
+
+/* put -- writes nbyte bytes of c at fd's cursor, which is at 'at', and
+ * the same into want */
+static int put(int fd, int at, char c, int nbyte)
+{
+    char buf[MAX_SIZE];
+
+    memset(buf, c, nbyte);
+    memset(want + at, c, nbyte);
+    if (want_size < at + nbyte)
+        want_size = at + nbyte;
+    return fs_write(fs, fd, buf, nbyte) == nbyte ? 0 : -1;
+}
+
+/* check -- remounts and compares 'name' with want */
+static int check(char * name)
+{
+    static char got[MAX_SIZE];
+    int fd, size;
+
+    if (fs_umount(fs) < 0 || (fs = fs_mount(diskname)) == NULL
+            || (fd = fs_open(fs, name)) < 0)
+        return -1;
+    size = fs_get_filesize(fs, fd);
+    if (size != want_size || fs_read(fs, fd, got, size) != size)
+    {
+        printf("test_holes: %s is %d bytes, not %d\n", name, size,
+                want_size);
+        return -1;
+    }
+    fs_close(fs, fd);
+    for (int i = 0; i < size; i++)
+    {
+        if (got[i] != want[i])
+        {
+            printf("test_holes: %s: byte %d is %d, not %d\n", name, i,
+                    got[i], want[i]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* fs_fallocate fills the hole fd is parked in */
+static int fallocate_under()
+{
+    int fd = begin("fallocate");
+
+    if (fd < 0 || put(fd, 0, 'a', 5000) < 0 || fs_close(fs, fd) < 0
+            || (fd = fs_open(fs, "fallocate")) < 0
+            || fs_lseek(fs, fd, 12000) < 0 || fs_fallocate(fs, fd, 20000) < 0)
+        return -1;
+    want_size = 20000;
+    if (put(fd, 12000, 'b', 10) < 0 || fs_lseek(fs, fd, 30000) < 0
+            || put(fd, 30000, 'c', 100) < 0 || fs_close(fs, fd) < 0)
+        return -1;
+    return check("fallocate");
+}
+
+/* a write through another descriptor fills it */
+static int write_under()
+{
+    int fd = begin("write"),
+        other;
+
+    if (fd < 0 || put(fd, 0, 'a', 5000) < 0 || fs_close(fs, fd) < 0
+            || (fd = fs_open(fs, "write")) < 0
+            || (other = fs_open(fs, "write")) < 0
+            || fs_lseek(fs, fd, 12000) < 0 || fs_lseek(fs, other, 5000) < 0
+            || put(other, 5000, 'd', 15000) < 0 || fs_close(fs, other) < 0)
+        return -1;
+    if (put(fd, 12000, 'b', 10) < 0 || fs_lseek(fs, fd, 30000) < 0
+            || put(fd, 30000, 'c', 100) < 0 || fs_close(fs, fd) < 0)
+        return -1;
+    return check("write");
+}
+
+/* a file without blocks is seeked past its end first */
+static int empty_under()
+{
+    int fd = begin("empty");
+
+    if (fd < 0 || fs_lseek(fs, fd, 5000) < 0
+            || fs_fallocate(fs, fd, 20000) < 0)
+        return -1;
+    want_size = 20000;
+    if (put(fd, 5000, 'b', 10) < 0 || fs_lseek(fs, fd, 30000) < 0
+            || put(fd, 30000, 'c', 100) < 0 || fs_close(fs, fd) < 0)
+        return -1;
+    return check("empty");
+}
+
+/* on a small image filled by two files growing block by block in turn,
+ * only every other block is free once one of them is deleted, and a write
+ * past EOF gets blocks that aren't next to each other. Whatever it doesn't
+ * cover has to read back as zeros once the file grows */
+static int fragmented()
+{
+    int bs = DEFAULT_BLOCK_SIZE,
+        old,
+        keep,
+        fd;
+    char buf[DEFAULT_BLOCK_SIZE];
+
+    memset(buf, '\n', bs);
+    if (fs_umount(fs) < 0
+            || make_fs_geometry(diskname, SMALL_DISK, bs) < 0
+            || (fs = fs_mount(diskname)) == NULL
+            || fs_set_alloc_mode(fs, ALLOC_FIRST_FIT) < 0
+            || fs_create(fs, "old") < 0 || fs_create(fs, "keep") < 0
+            || (old = fs_open(fs, "old")) < 0
+            || (keep = fs_open(fs, "keep")) < 0)
+        return -1;
+    // a seek gets each block written before the other file's next one
+    for (off_t at = bs; get_free_blocks(fs) > 4; at += bs)
+    {
+        if (fs_write(fs, old, buf, bs) != bs || fs_lseek(fs, old, at) < 0
+                || fs_write(fs, keep, buf, bs) != bs
+                || fs_lseek(fs, keep, at) < 0)
+            return -1;
+    }
+    // the old data has to be on the disk, not just in the cache
+    if (fs_close(fs, old) < 0 || fs_close(fs, keep) < 0 || fs_sync(fs) < 0
+            || fs_delete(fs, "old") < 0 || fs_sync(fs) < 0)
+        return -1;
+
+    if ((fd = begin("fragmented")) < 0 || put(fd, 0, 'a', bs) < 0
+            || put(fd, bs, 'b', bs + 100) < 0
+            || fs_truncate(fs, fd, 4 * bs) < 0 || fs_close(fs, fd) < 0)
+        return -1;
+    want_size = 4 * bs;
+    return check("fragmented");
+}
+
+int main(int argc, char ** argv)
+{
+    int (* tests[])() = { fallocate_under, write_under, empty_under,
+        fragmented };
+    int failed = 0;
+
+    diskname = argc > 1 ? argv[1] : "test_holes.disk";
+    if (make_fs(diskname) < 0 || (fs = fs_mount(diskname)) == NULL)
+        return 1;
+    for (int i = 0; i < (int) (sizeof(tests) / sizeof(tests[0])); i++)
+    {
+        if (tests[i]() < 0)
+        {
+            printf("test_holes: test %d failed\n", i + 1);
+            failed = 1;
+        }
+    }
+    if (fs_umount(fs) < 0)
+        return 1;
+    return failed;
+}